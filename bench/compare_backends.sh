@@ -0,0 +1,31 @@
+#!/bin/sh
+# Times every benchmark script on the stack VM and on the register backend.
+# A CLOX_PROFILE_OPCODES build adds the dispatched instruction counts.
+#   usage: bench/compare_backends.sh [build-root] [-O<level>]
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build_root=${1:-"$root/_bench_build"}
+level=${2:-"-O2"}
+
+for config in release profile; do
+    if [ "$config" = profile ]; then profile=ON; else profile=OFF; fi
+    cmake -S "$root" -B "$build_root/$config" -DCMAKE_BUILD_TYPE=Release \
+        -DCLOX_PROFILE_OPCODES=$profile \
+        -DCLOX_DEBUG_PRINT_CODE=OFF -DCLOX_DEBUG_TRACE_EXECUTION=OFF > /dev/null
+    cmake --build "$build_root/$config" > /dev/null
+done
+
+for script in "$root"/bench/*.lox; do
+    for backend in stack registers; do
+        if [ "$backend" = registers ]; then flag=--registers; else flag=; fi
+        instructions=$("$build_root/profile/clox" $level $flag "$script" 2>&1 > /dev/null |
+            awk '/opcode profile/ { print $4; exit }')
+        start=$(date +%s.%N)
+        "$build_root/release/clox" $level $flag "$script" > /dev/null
+        end=$(date +%s.%N)
+        awk -v name="$(basename "$script")" -v backend=$backend \
+            -v count="$instructions" -v start="$start" -v end="$end" \
+            'BEGIN { printf "%-24s %-10s %12s instructions %.3fs\n", name, backend, count, end - start }'
+    done
+done
@@ -0,0 +1,44 @@
+#!/bin/sh
+# Runs a few thousand small generated scripts, a mix of short and longer
+# loops: one clox process per script, then all of them in one --jobs run
+# on a single worker and on every core.
+#   usage: bench/compare_batch.sh [build-root] [-O<level>]
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build_root=${1:-"$root/_bench_build"}
+level=${2:-"-O2"}
+
+cmake -S "$root" -B "$build_root/release" -DCMAKE_BUILD_TYPE=Release \
+    -DCLOX_DEBUG_PRINT_CODE=OFF -DCLOX_DEBUG_TRACE_EXECUTION=OFF > /dev/null
+cmake --build "$build_root/release" > /dev/null
+clox="$build_root/release/clox"
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+awk -v work="$work" 'BEGIN {
+    for (i = 0; i < 2000; i++) {
+        script = sprintf("%s/s%04d.lox", work, i)
+        # every 50th script loops 100 times longer
+        n = (i % 50 == 0) ? 200000 : 2000
+        printf "var sum = 0;\nfor (var i = 0; i < %d; i = i + 1) { sum = sum + i * %d; }\nprint sum;\n", n, i > script
+        close(script)
+        print script > (work "/manifest")
+    }
+}'
+cores=$(getconf _NPROCESSORS_ONLN 2> /dev/null || echo 1)
+
+time_run() {
+    start=$(date +%s.%N)
+    "$@" > /dev/null 2>&1
+    end=$(date +%s.%N)
+    awk -v start="$start" -v end="$end" 'BEGIN { printf "%.4fs\n", end - start }'
+}
+
+run_each() {
+    while read -r script; do "$clox" $level "$script"; done < "$work/manifest"
+}
+
+printf "%-12s " processes; time_run run_each
+printf "%-12s " "jobs 1"; time_run "$clox" $level --jobs 1 --manifest "$work/manifest"
+printf "%-12s " "jobs $cores"; time_run "$clox" $level --jobs "$cores" --manifest "$work/manifest"
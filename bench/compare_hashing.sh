@@ -0,0 +1,13 @@
+#!/bin/sh
+# Builds bench/hash_strings.c and compares the string hash with FNV-1a
+# across string lengths.
+#   usage: bench/compare_hashing.sh [build-root]
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build_root=${1:-"$root/_bench_build"}
+
+mkdir -p "$build_root/hashing"
+${CC:-cc} -O2 -I"$root/src" -o "$build_root/hashing/hash_strings" "$root/bench/hash_strings.c" \
+    "$root/src/common/hash/hash.c"
+"$build_root/hashing/hash_strings"
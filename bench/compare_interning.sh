@@ -0,0 +1,14 @@
+#!/bin/sh
+# Builds bench/intern_lookup.c against the VM sources and compares the
+# memory and lookup time of the intern set with a Table on a million
+# distinct strings.
+#   usage: bench/compare_interning.sh [build-root]
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build_root=${1:-"$root/_bench_build"}
+
+mkdir -p "$build_root/interning"
+${CC:-cc} -O2 -I"$root/src" -o "$build_root/interning/intern_lookup" "$root/bench/intern_lookup.c" \
+    $(find "$root/src" -name '*.c' ! -name main.c ! -name jit.c) -lm -pthread
+"$build_root/interning/intern_lookup"
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Builds bench/program_reuse.c against the VM sources and compares running
+# a small script from source every time with compiling it once into a
+# Program.
+#   usage: bench/compare_programs.sh [build-root]
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build_root=${1:-"$root/_bench_build"}
+
+mkdir -p "$build_root/programs"
+${CC:-cc} -O2 -I"$root/src" -o "$build_root/programs/program_reuse" "$root/bench/program_reuse.c" \
+    $(find "$root/src" -name '*.c' ! -name main.c ! -name jit.c) -lm -pthread
+"$build_root/programs/program_reuse"
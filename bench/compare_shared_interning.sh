@@ -0,0 +1,14 @@
+#!/bin/sh
+# Builds bench/shared_interning.c against the VM sources and compares 1 to
+# 64 threads interning the same identifiers into a VM each with sharing one
+# SharedStrings between them.
+#   usage: bench/compare_shared_interning.sh [build-root]
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build_root=${1:-"$root/_bench_build"}
+
+mkdir -p "$build_root/shared_interning"
+${CC:-cc} -O2 -I"$root/src" -o "$build_root/shared_interning/shared_interning" "$root/bench/shared_interning.c" \
+    $(find "$root/src" -name '*.c' ! -name main.c ! -name jit.c) -lm -pthread
+"$build_root/shared_interning/shared_interning"
@@ -0,0 +1,38 @@
+#!/bin/sh
+# Times a large generated script that does little work, so that the run is
+# dominated by scanning and compiling: from source, from a --compile'd
+# .loxc file and through a warm --cache.
+#   usage: bench/compare_startup.sh [build-root] [-O<level>]
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build_root=${1:-"$root/_bench_build"}
+level=${2:-"-O2"}
+
+cmake -S "$root" -B "$build_root/release" -DCMAKE_BUILD_TYPE=Release \
+    -DCLOX_DEBUG_PRINT_CODE=OFF -DCLOX_DEBUG_TRACE_EXECUTION=OFF > /dev/null
+cmake --build "$build_root/release" > /dev/null
+clox="$build_root/release/clox"
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+awk 'BEGIN {
+    for (i = 0; i < 12000; i++) {
+        printf "var g%d = %d * 2 + 1;\n", i, i
+        printf "if (g%d < %d) { g%d = g%d - \"\" == nil; } else { g%d = g%d / 3; }\n", i, i, i, i, i, i
+    }
+    print "print g11999;"
+}' > "$work/large.lox"
+"$clox" $level --compile "$work/large.lox" -o "$work/large.loxc"
+"$clox" $level --cache="$work/cache" "$work/large.lox" > /dev/null
+
+time_runs() {
+    start=$(date +%s.%N)
+    for run in 1 2 3 4 5; do "$@" > /dev/null; done
+    end=$(date +%s.%N)
+    awk -v start="$start" -v end="$end" 'BEGIN { printf "%.4fs\n", (end - start) / 5 }'
+}
+
+printf "%-12s " source; time_runs "$clox" $level "$work/large.lox"
+printf "%-12s " loxc; time_runs "$clox" "$work/large.loxc"
+printf "%-12s " cache; time_runs "$clox" $level --cache="$work/cache" "$work/large.lox"
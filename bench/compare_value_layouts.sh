@@ -0,0 +1,27 @@
+#!/bin/sh
+# Builds clox with the tagged-union and the NaN-boxed Value and times both
+# on every benchmark script.
+#   usage: bench/compare_value_layouts.sh [build-root]
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build_root=${1:-"$root/_bench_build"}
+
+for layout in union nanbox; do
+    if [ "$layout" = nanbox ]; then nan_boxing=ON; else nan_boxing=OFF; fi
+    cmake -S "$root" -B "$build_root/$layout" -DCMAKE_BUILD_TYPE=Release \
+        -DCLOX_NAN_BOXING=$nan_boxing \
+        -DCLOX_DEBUG_PRINT_CODE=OFF -DCLOX_DEBUG_TRACE_EXECUTION=OFF > /dev/null
+    cmake --build "$build_root/$layout" > /dev/null
+done
+
+for script in "$root"/bench/*.lox; do
+    for layout in union nanbox; do
+        start=$(date +%s.%N)
+        "$build_root/$layout/clox" "$script" > /dev/null
+        end=$(date +%s.%N)
+        awk -v name="$(basename "$script")" -v layout=$layout \
+            -v start="$start" -v end="$end" \
+            'BEGIN { printf "%-24s %-8s %.3fs\n", name, layout, end - start }'
+    done
+done
@@ -0,0 +1,22 @@
+#!/bin/sh
+# Builds bench/time_slicing.c against the VM sources and compares running
+# a thousand scripts one after the other with multiplexing them on one
+# thread through budgets and INTERPRET_YIELD.
+#   usage: bench/compare_yielding.sh [build-root]
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+build_root=${1:-"$root/_bench_build"}
+
+# compiled loops have to yield as well, so the JIT is in where it builds
+jit="! -name jit.c"
+jit_flag=""
+if [ "$(uname -s)" = Linux ] && [ "$(uname -m)" = x86_64 ]; then
+    jit=""
+    jit_flag="-DCLOX_JIT"
+fi
+
+mkdir -p "$build_root/yielding"
+${CC:-cc} -O2 $jit_flag -I"$root/src" -o "$build_root/yielding/time_slicing" "$root/bench/time_slicing.c" \
+    $(find "$root/src" -name '*.c' ! -name main.c $jit) -lm -pthread
+"$build_root/yielding/time_slicing"
@@ -0,0 +1,66 @@
+// Times hashString against the byte-at-a-time FNV-1a it replaced on
+// strings of growing length. Built and run by bench/compare_hashing.sh.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common/hash/hash.h"
+
+#define BUFFER_SIZE (1 << 20) // twice the longest string
+// every length hashes about this many bytes in total
+#define BYTES_PER_LENGTH (256 << 20)
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static uint32_t hashFnv1a(const char* key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; ++i) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static uint64_t hash_state;
+static uint32_t hashSeeded(const char* key, int length) {
+    return hashString(hash_state, key, length);
+}
+
+// ns per string, the start moves so that unaligned reads are timed too
+static double timeHash(uint32_t (*hash)(const char*, int), const char* buffer, int length,
+    uint32_t* sink)
+{
+    int count = BYTES_PER_LENGTH / length;
+    double start = now();
+    for (int i = 0; i < count; ++i) {
+        *sink += hash(buffer + ((uint32_t)i * 2654435761u & (BUFFER_SIZE / 2 - 1)), length);
+    }
+    return (now() - start) * 1e9 / count;
+}
+
+int main() {
+    hash_state = hashState(0);
+    char* buffer = (char*)malloc(BUFFER_SIZE);
+    uint32_t state = 1;
+    for (int i = 0; i < BUFFER_SIZE; ++i) {
+        state = state * 1664525 + 1013904223;
+        buffer[i] = (char)('a' + (state >> 24) % 26);
+    }
+
+    static const int lengths[] = { 1, 3, 4, 8, 12, 16, 24, 32, 48, 64, 128, 256, 1024, 4096, 16384 };
+    uint32_t sink = 0;
+    printf("%8s %14s %14s %10s\n", "length", "fnv-1a ns", "hashString ns", "speedup");
+    for (int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); ++i) {
+        double fnv = timeHash(hashFnv1a, buffer, lengths[i], &sink);
+        double current = timeHash(hashSeeded, buffer, lengths[i], &sink);
+        printf("%8d %14.2f %14.2f %9.1fx\n", lengths[i], fnv, current, fnv / current);
+    }
+    // keeps the hashes from being optimized away
+    if (sink == 42) printf("\n");
+    free(buffer);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,127 @@
+// Interns a million distinct strings into a Table, the way vm->strings used
+// to hold them, and into an InternSet, then looks every one of them up in
+// random order and as many strings that are not there. Built and run by
+// bench/compare_interning.sh.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common/memory/memory.h"
+#include "common/table/intern_set.h"
+#include "common/table/table.h"
+#include "vm/vm.h"
+
+#define STRING_COUNT 1000000
+#define LOOKUP_ROUNDS 4
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// strings of 8 to 40 bytes, with a shared prefix like identifiers tend to have
+static ObjString** makeStrings(VM* vm, const char* prefix) {
+    ObjString** strings = (ObjString**)malloc(sizeof(ObjString*) * STRING_COUNT);
+    for (int i = 0; i < STRING_COUNT; ++i) {
+        char buffer[64];
+        int length = snprintf(buffer, sizeof(buffer), "%s_%d_%.*s", prefix, i,
+            i % 24, "abcdefghijklmnopqrstuvwx");
+        char* chars = (char*)malloc(length);
+        memcpy(chars, buffer, length);
+        strings[i] = constantString(vm, chars, length);
+    }
+    return strings;
+}
+
+static void shuffle(ObjString** strings) {
+    uint32_t state = 12345;
+    for (int i = STRING_COUNT - 1; i > 0; --i) {
+        state = state * 1664525 + 1013904223;
+        int j = (int)(state % (uint32_t)(i + 1));
+        ObjString* swap = strings[i];
+        strings[i] = strings[j];
+        strings[j] = swap;
+    }
+}
+
+static void report(const char* name, size_t bytes, double insert, double hit, double miss) {
+    int lookups = STRING_COUNT * LOOKUP_ROUNDS;
+    printf("%-10s %8.1f bytes/string %8.1f ns/insert %8.1f ns/hit %8.1f ns/miss\n", name,
+        (double)bytes / STRING_COUNT, insert * 1e9 / STRING_COUNT,
+        hit * 1e9 / lookups, miss * 1e9 / lookups);
+}
+
+int main() {
+    VM vm;
+    initVM(&vm, NULL);
+    // the strings live outside the VM's roots
+    vm.heap.next_gc = SIZE_MAX;
+
+    ObjString** present = makeStrings(&vm, "present");
+    ObjString** absent = makeStrings(&vm, "absent");
+    shuffle(present);
+    size_t found = 0;
+
+    Table table;
+    initTable(&table);
+    size_t before = vm.heap.categories[MEMORY_TABLES].bytes;
+    double start = now();
+    for (int i = 0; i < STRING_COUNT; ++i) tableSet(&vm, &table, present[i], NIL_VAL);
+    double insert = now() - start;
+    size_t bytes = vm.heap.categories[MEMORY_TABLES].bytes - before;
+    shuffle(present);
+    start = now();
+    for (int round = 0; round < LOOKUP_ROUNDS; ++round) {
+        for (int i = 0; i < STRING_COUNT; ++i) {
+            ObjString* key = present[i];
+            found += tableFindString(&table, key->chars, key->length, key->hash) != NULL;
+        }
+    }
+    double hit = now() - start;
+    start = now();
+    for (int round = 0; round < LOOKUP_ROUNDS; ++round) {
+        for (int i = 0; i < STRING_COUNT; ++i) {
+            ObjString* key = absent[i];
+            found += tableFindString(&table, key->chars, key->length, key->hash) != NULL;
+        }
+    }
+    double miss = now() - start;
+    report("table", bytes, insert, hit, miss);
+    freeTable(&vm, &table);
+
+    InternSet set;
+    initInternSet(&set);
+    before = vm.heap.categories[MEMORY_TABLES].bytes;
+    start = now();
+    for (int i = 0; i < STRING_COUNT; ++i) internSetAdd(&vm, &set, present[i]);
+    insert = now() - start;
+    bytes = vm.heap.categories[MEMORY_TABLES].bytes - before;
+    shuffle(present);
+    start = now();
+    for (int round = 0; round < LOOKUP_ROUNDS; ++round) {
+        for (int i = 0; i < STRING_COUNT; ++i) {
+            ObjString* key = present[i];
+            found += internSetFind(&set, key->chars, key->length, key->hash) != NULL;
+        }
+    }
+    hit = now() - start;
+    start = now();
+    for (int round = 0; round < LOOKUP_ROUNDS; ++round) {
+        for (int i = 0; i < STRING_COUNT; ++i) {
+            ObjString* key = absent[i];
+            found += internSetFind(&set, key->chars, key->length, key->hash) != NULL;
+        }
+    }
+    miss = now() - start;
+    report("intern set", bytes, insert, hit, miss);
+    freeInternSet(&vm, &set);
+
+    // every present string is found once per round and structure
+    if (found != (size_t)STRING_COUNT * LOOKUP_ROUNDS * 2) {
+        fprintf(stderr, "found %zu strings\n", found);
+        return 1;
+    }
+    return 0;
+}
\ No newline at end of file
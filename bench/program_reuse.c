@@ -0,0 +1,94 @@
+// Runs a small rule script many times: compiled from source on every run
+// with interpret(), and compiled once with compileProgram() and run with
+// runProgram(), both on one VM that lives across the runs and on a fresh VM
+// per run. Built and run by bench/compare_programs.sh.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vm/program.h"
+#include "vm/vm.h"
+
+#define RUNS 20000
+
+static const char* rule =
+    "var tier = \"standard\";\n"
+    "var limit = 100;\n"
+    "var score = 0;\n"
+    "for (var i = 0; i < 20; i = i + 1) {\n"
+    "    if (i < 5) score = score + 3; else score = score + 1;\n"
+    "    if (score > limit) tier = \"blocked\";\n"
+    "}\n"
+    "if (score > 25 and score < 40) tier = \"review\";\n"
+    "if (tier == \"review\") {\n"
+    "    var reason = \"score \" + tier + \" above\" + \" threshold\";\n"
+    "    print reason;\n"
+    "} else {\n"
+    "    print tier;\n"
+    "}\n"
+    "var a = 1; var b = 2; var c = 3; var d = 4; var e = 5;\n"
+    "var f = a * b + c * d - e / 2;\n"
+    "if (f > 10) print \"f large\"; else print \"f small\";\n"
+    "print tier + \":\" + \"done\";\n";
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static FILE* sink;
+
+static void setUp(VM* vm) {
+    initVM(vm, NULL);
+    vm->out = sink;
+}
+
+static void report(const char* name, double seconds) {
+    printf("%-26s %8.2f us/run\n", name, seconds * 1e6 / RUNS);
+}
+
+int main() {
+    sink = fopen("/dev/null", "w");
+    if (sink == NULL) return 1;
+    int failed = 0;
+
+    VM vm;
+    setUp(&vm);
+    double start = now();
+    for (int i = 0; i < RUNS; ++i) failed += interpret(&vm, rule) != INTERPRET_OK;
+    report("interpret, one VM", now() - start);
+    freeVM(&vm);
+
+    setUp(&vm);
+    Program* program;
+    if (compileProgram(&vm, rule, &program) != INTERPRET_OK) return 1;
+    start = now();
+    for (int i = 0; i < RUNS; ++i) failed += runProgram(&vm, program) != INTERPRET_OK;
+    report("runProgram, one VM", now() - start);
+    freeVM(&vm);
+
+    start = now();
+    for (int i = 0; i < RUNS; ++i) {
+        setUp(&vm);
+        failed += interpret(&vm, rule) != INTERPRET_OK;
+        freeVM(&vm);
+    }
+    report("interpret, fresh VMs", now() - start);
+
+    start = now();
+    for (int i = 0; i < RUNS; ++i) {
+        setUp(&vm);
+        failed += runProgram(&vm, program) != INTERPRET_OK;
+        freeVM(&vm);
+    }
+    report("runProgram, fresh VMs", now() - start);
+
+    freeProgram(program);
+    fclose(sink);
+    if (failed > 0) {
+        fprintf(stderr, "%d runs failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,123 @@
+// Starts 1 to 64 threads with a VM each that intern the same few thousand
+// identifiers over and over through constantString(), once into their own
+// vm->strings and once into one SharedStrings for all of them, and reports
+// the interning rate and the bytes the strings take. The first round of a
+// shared run races to add every string, the others only look them up.
+// Built and run by bench/compare_shared_interning.sh.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common/hash/hash.h"
+#include "common/object/object.h"
+#include "common/table/shared_strings.h"
+#include "vm/vm.h"
+
+#define NAME_COUNT 4096
+#define ROUNDS 64
+#define MAX_THREADS 64
+
+static char names[NAME_COUNT][32];
+static int lengths[NAME_COUNT];
+
+typedef struct {
+    SharedStrings* shared; // NULL for local interning
+    int index;
+    pthread_barrier_t* start;
+    size_t bytes;          // string and intern set bytes of its VM
+    int unshared;          // names it got another string for than the table holds
+    pthread_t thread;
+} Worker;
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void* intern(void* argument) {
+    Worker* worker = (Worker*)argument;
+    VM vm;
+    initVM(&vm, NULL);
+    // the strings live outside the VM's roots
+    vm.heap.next_gc = SIZE_MAX;
+    if (worker->shared != NULL) shareStrings(&vm, worker->shared);
+    ObjString** got = (ObjString**)malloc(sizeof(ObjString*) * NAME_COUNT);
+
+    pthread_barrier_wait(worker->start);
+    // every thread walks the names from its own offset and step
+    int step = 2 * worker->index + 1;
+    for (int round = 0; round < ROUNDS; ++round) {
+        int at = worker->index * 97 + round;
+        for (int i = 0; i < NAME_COUNT; ++i) {
+            int name = (at + i * step) % NAME_COUNT;
+            got[name] = constantString(&vm, names[name], lengths[name]);
+        }
+    }
+
+    worker->bytes = vm.heap.categories[MEMORY_STRINGS].bytes + vm.heap.categories[MEMORY_TABLES].bytes;
+    worker->unshared = 0;
+    for (int i = 0; worker->shared != NULL && i < NAME_COUNT; ++i) {
+        uint32_t hash = hashString(vm.hash_state, names[i], lengths[i]);
+        worker->unshared += got[i] != sharedStringsFind(worker->shared, names[i], lengths[i], hash);
+    }
+    free(got);
+    freeVM(&vm);
+    return NULL;
+}
+
+// the seconds all threads took together, every thread interns NAME_COUNT
+// strings ROUNDS times
+static double run(SharedStrings* shared, int thread_count, size_t* bytes, int* unshared) {
+    Worker workers[MAX_THREADS];
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, thread_count + 1);
+    for (int i = 0; i < thread_count; ++i) {
+        workers[i] = (Worker){ shared, i, &start, 0, 0, 0 };
+        pthread_create(&workers[i].thread, NULL, intern, &workers[i]);
+    }
+    pthread_barrier_wait(&start);
+    double began = now();
+    *bytes = 0;
+    for (int i = 0; i < thread_count; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        *bytes += workers[i].bytes;
+        *unshared += workers[i].unshared;
+    }
+    double seconds = now() - began;
+    pthread_barrier_destroy(&start);
+    return seconds;
+}
+
+int main() {
+    for (int i = 0; i < NAME_COUNT; ++i) {
+        lengths[i] = snprintf(names[i], sizeof(names[i]), "field_%d_%.*s", i, i % 12, "abcdefghijkl");
+    }
+
+    printf("%8s %14s %14s %14s %14s\n", "threads", "local Mops/s", "shared Mops/s", "local bytes", "shared bytes");
+    int unshared = 0;
+    for (int thread_count = 1; thread_count <= MAX_THREADS; thread_count *= 2) {
+        double operations = (double)thread_count * NAME_COUNT * ROUNDS;
+        size_t local_bytes;
+        double local = run(NULL, thread_count, &local_bytes, &unshared);
+
+        SharedStrings shared;
+        if (!initSharedStrings(&shared, 4 * NAME_COUNT, hashState(randomHashSeed()))) return 1;
+        size_t shared_bytes;
+        double seconds = run(&shared, thread_count, &shared_bytes, &unshared);
+        // the VMs hold next to nothing, the table holds the strings
+        shared_bytes += sizeof(SharedSlot) * shared.capacity;
+        for (int i = 0; i < NAME_COUNT; ++i) shared_bytes += sizeof(ObjString) + lengths[i] + 1;
+        freeSharedStrings(&shared);
+
+        printf("%8d %14.1f %14.1f %14zu %14zu\n", thread_count, operations / local / 1e6,
+            operations / seconds / 1e6, local_bytes, shared_bytes);
+    }
+
+    if (unshared > 0) {
+        fprintf(stderr, "%d names were not shared\n", unshared);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+// Multiplexes a thousand scripts on one thread: every script gets its own
+// VM and runs for a budget of back-edges before it yields and the next one
+// gets a turn. Compares the total time with running them one after the
+// other without a budget and reports the median and the 99th percentile
+// of the slice times. Built and run by bench/compare_yielding.sh.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vm/program.h"
+#include "vm/vm.h"
+
+#define SCRIPT_COUNT 1000
+
+static const char* script =
+    "var sum = 0;\n"
+    "for (var i = 0; i < 20000; i = i + 1) {\n"
+    "    if (i < 10000) sum = sum + i; else sum = sum - 1;\n"
+    "}\n"
+    "print sum;\n";
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static FILE* sink;
+static double* slice_times;
+static long slice_count;
+static long slice_capacity;
+
+static void addSlice(double seconds) {
+    if (slice_capacity < slice_count + 1) {
+        slice_capacity = slice_capacity < 1024 ? 1024 : slice_capacity * 2;
+        slice_times = (double*)realloc(slice_times, sizeof(double) * slice_capacity);
+    }
+    slice_times[slice_count++] = seconds;
+}
+
+static int compareTimes(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void setUp(VM* vm, bool use_jit) {
+    initVM(vm, NULL);
+    vm->out = sink;
+    vm->jit_enabled = vm->jit_enabled && use_jit;
+}
+
+// returns how many scripts failed
+static int runSliced(const Program* program, VM* vms, int64_t budget, bool use_jit) {
+    InterpretResult* results = (InterpretResult*)malloc(sizeof(InterpretResult) * SCRIPT_COUNT);
+    slice_count = 0;
+    double start = now();
+    for (int i = 0; i < SCRIPT_COUNT; ++i) {
+        setUp(&vms[i], use_jit);
+        setBudget(&vms[i], budget, 0);
+        double slice = now();
+        results[i] = runProgram(&vms[i], program);
+        addSlice(now() - slice);
+    }
+    for (bool is_running = true; is_running;) {
+        is_running = false;
+        for (int i = 0; i < SCRIPT_COUNT; ++i) {
+            if (results[i] != INTERPRET_YIELD) continue;
+            setBudget(&vms[i], budget, 0);
+            double slice = now();
+            results[i] = interpretResume(&vms[i]);
+            addSlice(now() - slice);
+            is_running = true;
+        }
+    }
+    double total = now() - start;
+
+    int failed = 0;
+    for (int i = 0; i < SCRIPT_COUNT; ++i) {
+        failed += results[i] != INTERPRET_OK;
+        freeVM(&vms[i]);
+    }
+    free(results);
+    qsort(slice_times, slice_count, sizeof(double), compareTimes);
+    printf("budget %-8lld %8.3f s %8ld slices %9.1f us median %9.1f us p99\n",
+        (long long)budget, total, slice_count, slice_times[slice_count / 2] * 1e6,
+        slice_times[slice_count * 99 / 100] * 1e6);
+    return failed;
+}
+
+int main() {
+    sink = fopen("/dev/null", "w");
+    if (sink == NULL) return 1;
+    VM* vms = (VM*)malloc(sizeof(VM) * SCRIPT_COUNT);
+    int failed = 0;
+
+    for (int use_jit = 0; use_jit < 2; ++use_jit) {
+        printf("%s\n", use_jit ? "jit" : "no jit");
+        VM vm;
+        setUp(&vm, use_jit);
+        Program* program;
+        if (compileProgram(&vm, script, &program) != INTERPRET_OK) return 1;
+        freeVM(&vm);
+
+        double start = now();
+        for (int i = 0; i < SCRIPT_COUNT; ++i) {
+            setUp(&vm, use_jit);
+            failed += runProgram(&vm, program) != INTERPRET_OK;
+            freeVM(&vm);
+        }
+        printf("%-15s %8.3f s\n", "no budget", now() - start);
+
+        failed += runSliced(program, vms, 100000, use_jit);
+        failed += runSliced(program, vms, 10000, use_jit);
+        failed += runSliced(program, vms, 1000, use_jit);
+        freeProgram(program);
+    }
+
+    free(vms);
+    free(slice_times);
+    fclose(sink);
+    if (failed > 0) {
+        fprintf(stderr, "%d runs failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
@@ -11,38 +11,177 @@ void initChunk(Chunk* chunk) {
     initValueArray(&chunk->constants);
 }
 
-void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    freeLinesInfo(&chunk->lines_info);
-    freeValueArray(&chunk->constants);
+void freeChunk(VM* vm, Chunk* chunk) {
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity, MEMORY_CODE);
+    freeLinesInfo(vm, &chunk->lines_info);
+    freeValueArray(vm, &chunk->constants);
     initChunk(chunk);
 }
 
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int old_capacity = chunk->capacity;
-        chunk->capacity = GROW_CAPACITY(old_capacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, 
-            old_capacity, chunk->capacity);
+        int capacity = GROW_CAPACITY(old_capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code,
+            old_capacity, capacity, MEMORY_CODE);
+        chunk->capacity = capacity;
     }
 
     chunk->code[chunk->count] = byte;
     chunk->count++;
 
-    writeLinesInfo(&chunk->lines_info, line);
+    writeLinesInfo(vm, &chunk->lines_info, line);
 }
 
-void writeConstant(Chunk* chunk, Value value, int line) {
-    writeChunk(chunk, OP_CONSTANT_LONG, line);
+// drops every byte from count onwards, line info included
+void truncateChunk(Chunk* chunk, int count) {
+    dropLinesInfo(&chunk->lines_info, chunk->count - count);
+    chunk->count = count;
+}
+
+// size of the instruction at offset in bytes, opcode included
+int instructionSize(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+    case OP_ADD_MANY:
+        return 2;
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+// destination of the jump instruction at offset
+int jumpTarget(Chunk* chunk, int offset) {
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+void remapGlobals(Chunk* chunk, const uint16_t* slots) {
+    for (int offset = 0; offset < chunk->count; offset += instructionSize(chunk, offset)) {
+        switch (chunk->code[offset]) {
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP: {
+            uint16_t slot = slots[(chunk->code[offset + 1] << 8) | chunk->code[offset + 2]];
+            chunk->code[offset + 1] = (slot >> 8) & 0xff;
+            chunk->code[offset + 2] = slot & 0xff;
+        } break;
+        default:
+            break;
+        }
+    }
+}
+
+// how many values the instruction leaves on the stack minus how many it
+// takes, the same on both edges of a jump
+int stackEffect(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+        return 1;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTILPY:
+    case OP_DIVIDE:
+    case OP_PRINT:
+    case OP_SET_LOCAL_POP:
+    case OP_SET_GLOBAL_POP:
+        return -1;
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return -2;
+    case OP_ADD_MANY:
+        return 1 - chunk->code[offset + 1];
+    default:
+        return 0;
+    }
+}
+
+int registerInstructionSize(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+    case OP_REG_RETURN:
+        return 1;
+    case OP_REG_LOAD_NIL:
+    case OP_REG_LOAD_TRUE:
+    case OP_REG_LOAD_FALSE:
+    case OP_REG_PRINT:
+        return 2;
+    case OP_REG_MOVE:
+    case OP_REG_NOT:
+    case OP_REG_NEGATE:
+    case OP_REG_JUMP:
+    case OP_REG_LOOP:
+        return 3;
+    case OP_REG_LOAD_CONSTANT:
+    case OP_REG_GET_GLOBAL:
+    case OP_REG_DEFINE_GLOBAL:
+    case OP_REG_SET_GLOBAL:
+    case OP_REG_EQUAL:
+    case OP_REG_GREATER:
+    case OP_REG_LESS:
+    case OP_REG_ADD:
+    case OP_REG_SUBTRACT:
+    case OP_REG_MULTIPLY:
+    case OP_REG_DIVIDE:
+    case OP_REG_JUMP_IF_FALSE:
+    case OP_REG_ADD_MANY:
+        return 4;
+    default:
+        return 5;
+    }
+}
+
+void writeConstant(VM* vm, Chunk* chunk, Value value, int line) {
+    writeChunk(vm, chunk, OP_CONSTANT_LONG, line);
 
-    uint16_t constant = addConstant(chunk, value);
+    uint16_t constant = addConstant(vm, chunk, value);
     uint8_t* bytes = (uint8_t*)&constant;
 
-    writeChunk(chunk, bytes[0], line);
-    writeChunk(chunk, bytes[1], line);
+    writeChunk(vm, chunk, bytes[0], line);
+    writeChunk(vm, chunk, bytes[1], line);
 }
 
-uint16_t addConstant(Chunk* chunk, Value value) {
-    writeValueArray(&chunk->constants, value);
+uint16_t addConstant(VM* vm, Chunk* chunk, Value value) {
+    // growing the pool can collect before value is in it
+    pushRoot(vm, value);
+    writeValueArray(vm, &chunk->constants, value);
+    popRoot(vm);
     return chunk->constants.count - 1;
 }
@@ -30,9 +30,70 @@ typedef enum {
     OP_JUMP,
     OP_JUMP_IF_FALSE,
     OP_LOOP,
-    OP_RETURN
+    OP_RETURN,
+    // Superinstructions for the opcode pairs that dominate CLOX_PROFILE_OPCODES
+    // runs over bench/: a comparison feeding a conditional jump, a local
+    // combined with a constant and a store right before its pop.
+    // The compare-and-jump family pops both operands and leaves no
+    // condition behind, so neither of its successors starts with OP_POP.
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_LESS,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_GREATER,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_EQUAL,
+    OP_ADD_LOCAL_CONSTANT,
+    OP_SUBTRACT_LOCAL_CONSTANT,
+    OP_SET_LOCAL_POP,
+    OP_SET_GLOBAL_POP,
+    // a + b + ... with n operands, 2 < n <= ADD_MANY_MAX: strings are
+    // joined with one copy, anything else is added up left to right
+    OP_ADD_MANY
 } OpCode;
 
+// longer chains of + are split, which bounds the stack they take
+#define ADD_MANY_MAX 16
+
+// Instruction set of the register backend, see compiler/register_emitter.h.
+// Registers are frame slots, locals keep the slot the stack VM gives them.
+// Operands: A is the destination register, B and C source registers,
+// K a 16-bit constant index, G a 16-bit global slot, J a 16-bit jump.
+// The opcodes sit in the upper half of the byte so that profiles and
+// listings never mix them up with the stack set.
+typedef enum {
+    OP_REG_MOVE = 128,          // A B
+    OP_REG_LOAD_CONSTANT,       // A K
+    OP_REG_LOAD_NIL,            // A
+    OP_REG_LOAD_TRUE,           // A
+    OP_REG_LOAD_FALSE,          // A
+    OP_REG_GET_GLOBAL,          // A G
+    OP_REG_DEFINE_GLOBAL,       // A G, stores R[A]
+    OP_REG_SET_GLOBAL,          // A G, stores R[A]
+    OP_REG_EQUAL,               // A B C
+    OP_REG_GREATER,             // A B C
+    OP_REG_LESS,                // A B C
+    OP_REG_ADD,                 // A B C
+    OP_REG_SUBTRACT,            // A B C
+    OP_REG_MULTIPLY,            // A B C
+    OP_REG_DIVIDE,              // A B C
+    OP_REG_ADD_CONSTANT,        // A B K
+    OP_REG_SUBTRACT_CONSTANT,   // A B K
+    OP_REG_NOT,                 // A B
+    OP_REG_NEGATE,              // A B
+    OP_REG_PRINT,               // A
+    OP_REG_JUMP,                // J
+    OP_REG_LOOP,                // J
+    OP_REG_JUMP_IF_FALSE,       // A J
+    OP_REG_JUMP_IF_NOT_LESS,    // B C J
+    OP_REG_JUMP_IF_LESS,        // B C J
+    OP_REG_JUMP_IF_NOT_GREATER, // B C J
+    OP_REG_JUMP_IF_GREATER,     // B C J
+    OP_REG_JUMP_IF_NOT_EQUAL,   // B C J
+    OP_REG_JUMP_IF_EQUAL,       // B C J
+    OP_REG_RETURN,
+    OP_REG_ADD_MANY             // A B n, adds R[B] to R[B + n - 1]
+} RegisterOpCode;
+
 typedef struct {
     int count;
     int capacity;
@@ -42,10 +103,17 @@ typedef struct {
 } Chunk;
 
 void initChunk(Chunk* chuck);
-void freeChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
-void writeConstant(Chunk* chunk, Value value, int line);
-uint16_t addConstant(Chunk* chunk, Value value);
+void freeChunk(VM* vm, Chunk* chunk);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+void truncateChunk(Chunk* chunk, int count);
+int instructionSize(Chunk* chunk, int offset);
+int stackEffect(Chunk* chunk, int offset);
+int jumpTarget(Chunk* chunk, int offset);
+// rewrites the slot operand of every global instruction to slots[slot]
+void remapGlobals(Chunk* chunk, const uint16_t* slots);
+int registerInstructionSize(Chunk* chunk, int offset);
+void writeConstant(VM* vm, Chunk* chunk, Value value, int line);
+uint16_t addConstant(VM* vm, Chunk* chunk, Value value);
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,508 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common/memory/memory.h"
+#include "common/object/object.h"
+#include "vm/vm.h"
+#include "chunk_file.h"
+
+#define CHUNK_FILE_BYTE_ORDER 0x0102
+
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING
+} ConstantTag;
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t byte_order;
+    int32_t optimize_level;
+    uint32_t code_count;
+    uint32_t line_count;
+    uint32_t constant_count;
+    uint32_t global_count;
+    uint32_t pool_size;       // bytes of constants and globals after the code
+    uint64_t source_hash;
+    uint64_t source_length;
+} ChunkFileHeader;
+
+_Static_assert(sizeof(ChunkFileHeader) % 8 == 0, "the line runs follow the header aligned");
+_Static_assert(sizeof(int) == sizeof(int32_t), "LinesInfo arrays are mapped as int32_t");
+
+static size_t alignTo8(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+ChunkFileKey chunkFileKey(const char* source, int optimize_level) {
+    // 64-bit FNV-1a, the cache only needs to tell sources apart
+    uint64_t hash = 14695981039346656037ull;
+    size_t length = 0;
+    for (; source[length] != '\0'; ++length) {
+        hash ^= (uint8_t)source[length];
+        hash *= 1099511628211ull;
+    }
+
+    ChunkFileKey key;
+    key.source_hash = hash;
+    key.source_length = length;
+    key.optimize_level = optimize_level;
+    return key;
+}
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} Buffer;
+
+static void writeBytes(VM* vm, Buffer* buffer, const void* bytes, size_t count) {
+    if (buffer->capacity < buffer->count + count) {
+        size_t old_capacity = buffer->capacity;
+        while (buffer->capacity < buffer->count + count) {
+            buffer->capacity = GROW_CAPACITY(buffer->capacity);
+        }
+        buffer->bytes = GROW_ARRAY(vm, uint8_t, buffer->bytes, old_capacity, buffer->capacity, MEMORY_SCRATCH);
+    }
+    memcpy(buffer->bytes + buffer->count, bytes, count);
+    buffer->count += count;
+}
+static void writeName(VM* vm, Buffer* buffer, const char* chars, int length) {
+    uint32_t size = (uint32_t)length;
+    writeBytes(vm, buffer, &size, sizeof(size));
+    writeBytes(vm, buffer, chars, size);
+}
+
+static void writeConstantPool(VM* vm, Buffer* buffer, Chunk* chunk) {
+    for (int i = 0; i < chunk->constants.count; ++i) {
+        Value value = chunk->constants.values[i];
+        uint8_t tag;
+        if (IS_NIL(value)) tag = CONSTANT_NIL;
+        else if (IS_BOOL(value)) tag = AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE;
+        else if (IS_NUMBER(value)) tag = CONSTANT_NUMBER;
+        else tag = CONSTANT_STRING;
+        writeBytes(vm, buffer, &tag, 1);
+
+        if (tag == CONSTANT_NUMBER) {
+            double number = AS_NUMBER(value);
+            writeBytes(vm, buffer, &number, sizeof(number));
+        }
+        else if (tag == CONSTANT_STRING) {
+            ObjString* string = AS_STRING(value);
+            writeName(vm, buffer, string->chars, string->length);
+        }
+    }
+
+    for (int i = 0; i < vm->global_count; ++i) {
+        writeName(vm, buffer, vm->global_names[i]->chars, vm->global_names[i]->length);
+    }
+}
+
+bool writeChunkFile(VM* vm, Chunk* chunk, ChunkFileKey key, const char* path) {
+    Buffer pool = {NULL, 0, 0};
+    pushChunkRoot(vm, chunk);
+    writeConstantPool(vm, &pool, chunk);
+
+    ChunkFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "LOXC", 4);
+    header.version = CHUNK_FILE_VERSION;
+    header.byte_order = CHUNK_FILE_BYTE_ORDER;
+    header.optimize_level = key.optimize_level;
+    header.code_count = (uint32_t)chunk->count;
+    header.line_count = (uint32_t)chunk->lines_info.count;
+    header.constant_count = (uint32_t)chunk->constants.count;
+    header.global_count = (uint32_t)vm->global_count;
+    header.pool_size = (uint32_t)pool.count;
+    header.source_hash = key.source_hash;
+    header.source_length = key.source_length;
+
+    // written next to the destination and renamed over it, so that a
+    // concurrent run never maps a half written file
+    size_t temp_length = strlen(path) + 48;
+    char* temp_path = ALLOCATE(vm, char, temp_length, MEMORY_SCRATCH);
+    // VMs on other threads may write the same path at the same time
+    snprintf(temp_path, temp_length, "%s.%ld.%lx.tmp", path, (long)getpid(),
+        (unsigned long)(uintptr_t)vm);
+
+    FILE* file = fopen(temp_path, "wb");
+    bool ok = file != NULL;
+    if (ok) {
+        static const uint8_t padding[8] = {0};
+        size_t line_bytes = sizeof(int32_t) * header.line_count;
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(chunk->lines_info.lines, 1, line_bytes, file) == line_bytes &&
+            fwrite(chunk->lines_info.counts, 1, line_bytes, file) == line_bytes &&
+            fwrite(chunk->code, 1, chunk->count, file) == (size_t)chunk->count &&
+            fwrite(padding, 1, alignTo8(chunk->count) - chunk->count, file) ==
+                alignTo8(chunk->count) - chunk->count &&
+            fwrite(pool.bytes, 1, pool.count, file) == pool.count;
+        ok = fclose(file) == 0 && ok;
+        ok = ok && rename(temp_path, path) == 0;
+        if (!ok) remove(temp_path);
+    }
+
+    FREE_ARRAY(vm, char, temp_path, temp_length, MEMORY_SCRATCH);
+    FREE_ARRAY(vm, uint8_t, pool.bytes, pool.capacity, MEMORY_SCRATCH);
+    popChunkRoot(vm);
+    return ok;
+}
+
+typedef struct {
+    const uint8_t* at;
+    const uint8_t* end;
+} Reader;
+
+static bool readBytes(Reader* reader, void* bytes, size_t count) {
+    if ((size_t)(reader->end - reader->at) < count) return false;
+    memcpy(bytes, reader->at, count);
+    reader->at += count;
+    return true;
+}
+static bool readName(Reader* reader, const char** chars, int* length) {
+    uint32_t size;
+    if (!readBytes(reader, &size, sizeof(size))) return false;
+    if ((size_t)(reader->end - reader->at) < size || size > INT32_MAX) return false;
+    *chars = (const char*)reader->at;
+    *length = (int)size;
+    reader->at += size;
+    return true;
+}
+
+// walks the pool once without creating anything, a file that fails here
+// leaves the VM untouched
+static bool checkPool(Reader reader, const ChunkFileHeader* header) {
+    for (uint32_t i = 0; i < header->constant_count; ++i) {
+        uint8_t tag;
+        if (!readBytes(&reader, &tag, 1)) return false;
+
+        const char* chars;
+        int length;
+        double number;
+        switch (tag) {
+        case CONSTANT_NIL:
+        case CONSTANT_FALSE:
+        case CONSTANT_TRUE:
+            break;
+        case CONSTANT_NUMBER:
+            if (!readBytes(&reader, &number, sizeof(number))) return false;
+            break;
+        case CONSTANT_STRING:
+            if (!readName(&reader, &chars, &length)) return false;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < header->global_count; ++i) {
+        const char* chars = NULL;
+        int length = 0;
+        if (!readName(&reader, &chars, &length)) return false;
+    }
+    return reader.at == reader.end;
+}
+
+// the runs have to cover the code exactly, getLine gives up otherwise
+static bool checkLines(Chunk* chunk) {
+    int64_t covered = 0;
+    for (int i = 0; i < chunk->lines_info.count; ++i) {
+        if (chunk->lines_info.counts[i] <= 0) return false;
+        covered += chunk->lines_info.counts[i];
+    }
+    return covered == chunk->count;
+}
+
+static uint16_t readOperand(const uint8_t* code) {
+    return (uint16_t)((code[0] << 8) | code[1]);
+}
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP ||
+        (op >= OP_JUMP_IF_NOT_LESS && op <= OP_JUMP_IF_EQUAL);
+}
+
+// every instruction has to be known, every operand in range and every
+// jump has to land on an instruction inside the code
+static bool checkCode(VM* vm, Chunk* chunk, const ChunkFileHeader* header) {
+    if (chunk->count == 0) return false;
+
+    bool* starts = ALLOCATE(vm, bool, chunk->count, MEMORY_SCRATCH);
+    memset(starts, 0, chunk->count);
+    bool ok = true;
+    int offset = 0;
+    int last = 0;
+    while (ok && offset < chunk->count) {
+        uint8_t op = chunk->code[offset];
+        int size = op <= OP_ADD_MANY ? instructionSize(chunk, offset) : 0;
+        if (size == 0 || offset + size > chunk->count) {
+            ok = false;
+            break;
+        }
+        starts[offset] = true;
+        last = offset;
+
+        switch (op) {
+        case OP_CONSTANT:
+            ok = chunk->code[offset + 1] < header->constant_count;
+            break;
+        case OP_CONSTANT_LONG: {
+            uint16_t constant;
+            memcpy(&constant, chunk->code + offset + 1, sizeof(constant));
+            ok = constant < header->constant_count;
+        } break;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+            ok = readOperand(chunk->code + offset + 1) < header->global_count;
+            break;
+        case OP_ADD_LOCAL_CONSTANT:
+        case OP_SUBTRACT_LOCAL_CONSTANT:
+            ok = chunk->code[offset + 2] < header->constant_count;
+            break;
+        case OP_ADD_MANY:
+            ok = chunk->code[offset + 1] > 2 && chunk->code[offset + 1] <= ADD_MANY_MAX;
+            break;
+        default:
+            break;
+        }
+        offset += size;
+    }
+    ok = ok && chunk->code[last] == OP_RETURN;
+
+    for (offset = 0; ok && offset < chunk->count; offset += instructionSize(chunk, offset)) {
+        if (!isJump(chunk->code[offset])) continue;
+        int target = jumpTarget(chunk, offset);
+        ok = target >= 0 && target < chunk->count && starts[target];
+    }
+
+    FREE_ARRAY(vm, bool, starts, chunk->count, MEMORY_SCRATCH);
+    return ok;
+}
+
+// values the instruction reads off the top of the stack
+static int stackInputs(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTILPY:
+    case OP_DIVIDE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return 2;
+    case OP_POP:
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_JUMP_IF_FALSE:
+        return 1;
+    case OP_ADD_MANY:
+        return chunk->code[offset + 1];
+    default:
+        return 0;
+    }
+}
+
+// The stack has to have one depth per instruction whichever way it is
+// reached, like the compiler leaves it. Together with the operand checks
+// this keeps every stack and local access inside vm->stack.
+static bool checkStack(VM* vm, Chunk* chunk) {
+    int* depths = ALLOCATE(vm, int, chunk->count, MEMORY_SCRATCH);
+    int* worklist = ALLOCATE(vm, int, chunk->count, MEMORY_SCRATCH);
+    for (int i = 0; i < chunk->count; ++i) depths[i] = -1;
+    int pending = 0;
+    depths[0] = 0;
+    worklist[pending++] = 0;
+
+    bool ok = true;
+    while (ok && pending > 0) {
+        int offset = worklist[--pending];
+        int depth = depths[offset];
+        uint8_t op = chunk->code[offset];
+        if (depth < stackInputs(chunk, offset)) ok = false;
+        if ((op == OP_GET_LOCAL || op == OP_SET_LOCAL || op == OP_SET_LOCAL_POP ||
+            op == OP_ADD_LOCAL_CONSTANT || op == OP_SUBTRACT_LOCAL_CONSTANT) &&
+            chunk->code[offset + 1] >= depth) ok = false;
+
+        int after = depth + stackEffect(chunk, offset);
+        if (after >= STACK_MAX) ok = false;
+        // adding up mixed operands pushes two values above them
+        if (op == OP_ADD_MANY && depth + 2 > STACK_MAX) ok = false;
+
+        int successors[2];
+        int successor_count = 0;
+        if (op != OP_RETURN && op != OP_JUMP && op != OP_LOOP) {
+            successors[successor_count++] = offset + instructionSize(chunk, offset);
+        }
+        if (isJump(op)) {
+            successors[successor_count++] = jumpTarget(chunk, offset);
+        }
+        for (int i = 0; ok && i < successor_count; ++i) {
+            int next = successors[i];
+            if (depths[next] == -1) {
+                depths[next] = after;
+                worklist[pending++] = next;
+            }
+            else if (depths[next] != after) {
+                ok = false;
+            }
+        }
+    }
+
+    FREE_ARRAY(vm, int, depths, chunk->count, MEMORY_SCRATCH);
+    FREE_ARRAY(vm, int, worklist, chunk->count, MEMORY_SCRATCH);
+    return ok;
+}
+
+// strings are copied out of the map, the VM may keep them interned or as
+// global names after the loaded chunk is freed
+static void loadConstantPool(VM* vm, Reader* reader, Chunk* chunk, const ChunkFileHeader* header) {
+    for (uint32_t i = 0; i < header->constant_count; ++i) {
+        uint8_t tag = CONSTANT_NIL;
+        readBytes(reader, &tag, 1);
+
+        const char* chars = NULL;
+        int length = 0;
+        double number = 0;
+        switch (tag) {
+        case CONSTANT_NIL:
+            addConstant(vm, chunk, NIL_VAL);
+            break;
+        case CONSTANT_FALSE:
+            addConstant(vm, chunk, BOOL_VAL(false));
+            break;
+        case CONSTANT_TRUE:
+            addConstant(vm, chunk, BOOL_VAL(true));
+            break;
+        case CONSTANT_NUMBER:
+            readBytes(reader, &number, sizeof(number));
+            addConstant(vm, chunk, NUMBER_VAL(number));
+            break;
+        case CONSTANT_STRING:
+            readName(reader, &chars, &length);
+            addConstant(vm, chunk, OBJ_VAL(copyString(vm, chars, length)));
+            break;
+        default:
+            break; // validated by checkPool()
+        }
+    }
+}
+
+// The file names its globals in the slots the compiling VM gave them. A
+// fresh VM hands out the same slots, otherwise the operands are rewritten,
+// which copies only the pages of the private mapping they sit on.
+static void resolveGlobals(VM* vm, Reader* reader, Chunk* chunk, const ChunkFileHeader* header) {
+    uint16_t* slots = ALLOCATE(vm, uint16_t, header->global_count, MEMORY_SCRATCH);
+    bool moved = false;
+    for (uint32_t i = 0; i < header->global_count; ++i) {
+        const char* chars = NULL;
+        int length = 0;
+        readName(reader, &chars, &length);
+        slots[i] = (uint16_t)globalSlot(vm, copyString(vm, chars, length));
+        moved = moved || slots[i] != i;
+    }
+
+    if (moved) remapGlobals(chunk, slots);
+    FREE_ARRAY(vm, uint16_t, slots, header->global_count, MEMORY_SCRATCH);
+}
+
+ChunkFileResult loadChunkFile(VM* vm, const char* path, const ChunkFileKey* expect, LoadedChunk* loaded) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return CHUNK_FILE_IO_ERROR;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return CHUNK_FILE_IO_ERROR;
+    }
+    if (info.st_size < (off_t)sizeof(ChunkFileHeader)) {
+        close(fd);
+        return CHUNK_FILE_BAD_FORMAT;
+    }
+
+    size_t size = (size_t)info.st_size;
+    uint8_t* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return CHUNK_FILE_IO_ERROR;
+
+    ChunkFileHeader header;
+    memcpy(&header, map, sizeof(header));
+    size_t line_bytes = sizeof(int32_t) * (size_t)header.line_count;
+    size_t code_at = sizeof(header) + 2 * line_bytes;
+    size_t pool_at = code_at + alignTo8(header.code_count);
+    bool well_formed = memcmp(header.magic, "LOXC", 4) == 0 &&
+        header.version == CHUNK_FILE_VERSION &&
+        header.byte_order == CHUNK_FILE_BYTE_ORDER &&
+        header.code_count <= INT32_MAX && header.line_count <= header.code_count &&
+        header.constant_count <= UINT16_COUNT && header.global_count <= UINT16_COUNT &&
+        pool_at + header.pool_size == size;
+
+    ChunkFileResult result = CHUNK_FILE_OK;
+    if (!well_formed) {
+        result = CHUNK_FILE_BAD_FORMAT;
+    }
+    else if (expect != NULL && (header.source_hash != expect->source_hash ||
+        header.source_length != expect->source_length ||
+        header.optimize_level != expect->optimize_level)) {
+        result = CHUNK_FILE_KEY_MISMATCH;
+    }
+
+    Chunk* chunk = &loaded->chunk;
+    initChunk(chunk);
+    chunk->code = map + code_at;
+    chunk->count = (int)header.code_count;
+    chunk->lines_info.lines = (int*)(map + sizeof(header));
+    chunk->lines_info.counts = (int*)(map + sizeof(header) + line_bytes);
+    chunk->lines_info.count = (int)header.line_count;
+
+    Reader pool = {map + pool_at, map + size};
+    if (result == CHUNK_FILE_OK && (!checkPool(pool, &header) ||
+        !checkLines(chunk) || !checkCode(vm, chunk, &header) || !checkStack(vm, chunk))) {
+        result = CHUNK_FILE_BAD_FORMAT;
+    }
+    if (result != CHUNK_FILE_OK) {
+        munmap(map, size);
+        initChunk(chunk);
+        return result;
+    }
+
+    pushChunkRoot(vm, chunk);
+    loadConstantPool(vm, &pool, chunk, &header);
+    resolveGlobals(vm, &pool, chunk, &header);
+    popChunkRoot(vm);
+
+    loaded->key.source_hash = header.source_hash;
+    loaded->key.source_length = header.source_length;
+    loaded->key.optimize_level = header.optimize_level;
+    loaded->map = map;
+    loaded->map_size = size;
+    return CHUNK_FILE_OK;
+}
+
+void freeLoadedChunk(VM* vm, LoadedChunk* loaded) {
+    freeValueArray(vm, &loaded->chunk.constants);
+    initChunk(&loaded->chunk);
+    munmap(loaded->map, loaded->map_size);
+    loaded->map = NULL;
+    loaded->map_size = 0;
+}
\ No newline at end of file
@@ -0,0 +1,55 @@
+#ifndef clox_chunk_file_h
+#define clox_chunk_file_h
+
+#include "common/common.h"
+#include "common/chunk/chunk.h"
+
+// Compiled chunks on disk (.loxc). The file is laid out so that the
+// loader can map it and use the code and the line runs in place:
+//
+//   ChunkFileHeader
+//   int32_t lines[line_count], int32_t counts[line_count]
+//   uint8_t code[code_count], padded to 8 bytes
+//   constants: a tag byte, then 8 bytes of double or a uint32_t length
+//              and the characters of a string
+//   globals:   uint32_t length and characters per name, in slot order
+//
+// Numbers are stored in the byte order of the machine that wrote the file,
+// OP_CONSTANT_LONG operands are too, so a file only loads on a machine
+// with the same order. Bump CHUNK_FILE_VERSION with every opcode change.
+#define CHUNK_FILE_VERSION 2
+
+// what a file was compiled from, the cache only reuses a file whose key
+// matches the source it is about to run
+typedef struct {
+    uint64_t source_hash;
+    uint64_t source_length;
+    int optimize_level;
+} ChunkFileKey;
+
+typedef struct {
+    Chunk chunk;      // code and line runs point into map, do not freeChunk it
+    ChunkFileKey key;
+    void* map;
+    size_t map_size;
+} LoadedChunk;
+
+typedef enum {
+    CHUNK_FILE_OK,
+    CHUNK_FILE_IO_ERROR,
+    CHUNK_FILE_BAD_FORMAT,
+    CHUNK_FILE_KEY_MISMATCH
+} ChunkFileResult;
+
+ChunkFileKey chunkFileKey(const char* source, int optimize_level);
+// globals are named by vm->global_names, the chunk must have been compiled
+// by the running VM
+bool writeChunkFile(VM* vm, Chunk* chunk, ChunkFileKey key, const char* path);
+// expect may be NULL to take the file whatever it was compiled from,
+// global slots are resolved against the running VM
+ChunkFileResult loadChunkFile(VM* vm, const char* path, const ChunkFileKey* expect, LoadedChunk* loaded);
+// the code and line runs stay in the map, free the loaded chunk only when
+// nothing runs its code anymore; its strings were copied into the VM
+void freeLoadedChunk(VM* vm, LoadedChunk* loaded);
+
+#endif // !clox_chunk_file_h
\ No newline at end of file
@@ -5,9 +5,14 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// DEBUG_PRINT_CODE, DEBUG_TRACE_EXECUTION, CLOX_THREADED_DISPATCH and
+// CLOX_NAN_BOXING are set by the build, see CMakeLists.txt
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+
+// an interpreter instance, see vm/vm.h; every function that allocates,
+// prints or touches globals takes one
+typedef struct VM VM;
 
 #endif
\ No newline at end of file
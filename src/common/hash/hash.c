@@ -0,0 +1,109 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+static const uint64_t secrets[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+// the 128-bit product of a and b, in place
+static void multiply(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)*a * *b;
+    *a = (uint64_t)product;
+    *b = (uint64_t)(product >> 64);
+#else
+    uint64_t low_low = (uint32_t)*a * (*b & 0xffffffffull);
+    uint64_t high_low = (*a >> 32) * (uint32_t)*b;
+    uint64_t low_high = (uint32_t)*a * (*b >> 32);
+    uint64_t high_high = (*a >> 32) * (*b >> 32);
+    uint64_t cross = (low_low >> 32) + (uint32_t)high_low + low_high;
+    *a = cross << 32 | (uint32_t)low_low;
+    *b = (high_low >> 32) + (cross >> 32) + high_high;
+#endif // __SIZEOF_INT128__
+}
+static uint64_t mix(uint64_t a, uint64_t b) {
+    multiply(&a, &b);
+    return a ^ b;
+}
+
+static uint64_t read64(const uint8_t* bytes) {
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+static uint64_t read32(const uint8_t* bytes) {
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+// 1 to 3 bytes, the first, the middle and the last one
+static uint64_t readSmall(const uint8_t* bytes, size_t length) {
+    return (uint64_t)bytes[0] << 16 | (uint64_t)bytes[length >> 1] << 8 | bytes[length - 1];
+}
+
+uint64_t hashState(uint64_t seed) {
+    return seed ^ mix(seed ^ secrets[0], secrets[1]);
+}
+
+uint64_t randomHashSeed() {
+    uint64_t seed;
+    if (getentropy(&seed, sizeof(seed)) != 0) {
+        // no entropy source, the clock and the stack address still vary
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        seed = (uint64_t)now.tv_nsec ^ (uint64_t)now.tv_sec << 32 ^ (uint64_t)(uintptr_t)&now;
+    }
+    return seed;
+}
+
+uint32_t hashString(uint64_t state, const char* chars, int length) {
+    const uint8_t* bytes = (const uint8_t*)chars;
+    size_t left = (size_t)length;
+    uint64_t a, b;
+    if (left <= 16) {
+        if (left >= 4) {
+            // two overlapping reads from each end cover 4 to 16 bytes
+            size_t quarter = (left >> 3) << 2;
+            a = read32(bytes) << 32 | read32(bytes + quarter);
+            b = read32(bytes + left - 4) << 32 | read32(bytes + left - 4 - quarter);
+        }
+        else if (left > 0) {
+            a = readSmall(bytes, left);
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        if (left > 48) {
+            // three independent lanes
+            uint64_t lane1 = state, lane2 = state;
+            do {
+                state = mix(read64(bytes) ^ secrets[1], read64(bytes + 8) ^ state);
+                lane1 = mix(read64(bytes + 16) ^ secrets[2], read64(bytes + 24) ^ lane1);
+                lane2 = mix(read64(bytes + 32) ^ secrets[3], read64(bytes + 40) ^ lane2);
+                bytes += 48;
+                left -= 48;
+            } while (left > 48);
+            state ^= lane1 ^ lane2;
+        }
+        while (left > 16) {
+            state = mix(read64(bytes) ^ secrets[1], read64(bytes + 8) ^ state);
+            bytes += 16;
+            left -= 16;
+        }
+        // the last 16 bytes, overlapping what was mixed already
+        a = read64(bytes + left - 16);
+        b = read64(bytes + left - 8);
+    }
+
+    a ^= secrets[1];
+    b ^= state;
+    multiply(&a, &b);
+    uint64_t hash = mix(a ^ secrets[0] ^ (uint64_t)length, b ^ secrets[1]);
+    return (uint32_t)(hash ^ hash >> 32);
+}
\ No newline at end of file
@@ -0,0 +1,16 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common/common.h"
+
+// String hashes, wyhash reading 8 or 16 bytes at a time. Every VM keys its
+// hashes with a random seed so that nobody can pick keys that all collide
+// in vm->strings; a fixed one makes probe sequences reproducible. Hashes
+// are never stored outside a VM, so seeds may differ between VMs and runs,
+// except in a shared string table whose VMs all hash with its seed.
+uint32_t hashString(uint64_t state, const char* chars, int length);
+// what every hash of a seed starts from, see VM.hash_state
+uint64_t hashState(uint64_t seed);
+uint64_t randomHashSeed();
+
+#endif // !clox_hash_h
\ No newline at end of file
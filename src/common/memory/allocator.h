@@ -0,0 +1,20 @@
+#ifndef clox_allocator_h
+#define clox_allocator_h
+
+#include "common/common.h"
+
+// Where a VM gets its memory from, every reallocate() call ends up here.
+// Callers always pass the size they asked for when resizing or freeing a
+// block, so allocators need not remember it. alloc and resize return NULL
+// when they are out of memory.
+typedef struct {
+    void* (*alloc)(void* context, size_t size);
+    void* (*resize)(void* context, void* pointer, size_t old_size, size_t new_size);
+    void (*free)(void* context, void* pointer, size_t size);
+    void* context;
+} Allocator;
+
+// malloc, realloc and free
+Allocator systemAllocator();
+
+#endif // !clox_allocator_h
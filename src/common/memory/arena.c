@@ -0,0 +1,81 @@
+#include <string.h>
+
+#include "arena.h"
+#include "memory.h"
+#include "vm/vm.h"
+
+struct ArenaBlock {
+    ArenaBlock* next;
+    size_t size;       // of the whole block, header included
+    size_t used;       // bytes of data handed out
+    max_align_t data[];
+};
+
+static size_t alignSize(size_t size) {
+    return (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+}
+static size_t blockRoom(ArenaBlock* block) {
+    return block->size - sizeof(ArenaBlock) - block->used;
+}
+
+void initArena(VM* vm, Arena* arena, MemoryCategory category) {
+    arena->blocks = NULL;
+    arena->last = NULL;
+    arena->category = category;
+    arena->vm = vm;
+    arena->next = vm->heap.arenas;
+    vm->heap.arenas = arena;
+}
+
+void freeArena(Arena* arena) {
+    VM* vm = arena->vm;
+    ArenaBlock* block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        reallocate(vm, block, block->size, 0, arena->category);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->last = NULL;
+
+    // arenas nest, so this is almost always the newest one
+    Arena** link = &vm->heap.arenas;
+    while (*link != NULL && *link != arena) link = &(*link)->next;
+    if (*link != NULL) *link = arena->next;
+}
+
+void* arenaAllocate(Arena* arena, size_t size) {
+    size = alignSize(size);
+    ArenaBlock* block = arena->blocks;
+    if (block == NULL || blockRoom(block) < size) {
+        size_t block_size = sizeof(ArenaBlock) + size;
+        if (block_size < ARENA_BLOCK_SIZE) block_size = ARENA_BLOCK_SIZE;
+        block = (ArenaBlock*)reallocate(arena->vm, NULL, 0, block_size, arena->category);
+        block->next = arena->blocks;
+        block->size = block_size;
+        block->used = 0;
+        arena->blocks = block;
+    }
+
+    void* result = (uint8_t*)block->data + block->used;
+    block->used += size;
+    arena->last = result;
+    return result;
+}
+
+void* arenaResize(Arena* arena, void* pointer, size_t old_size, size_t new_size) {
+    if (pointer == NULL) return arenaAllocate(arena, new_size);
+    if (new_size <= old_size) return pointer;
+
+    ArenaBlock* block = arena->blocks;
+    size_t old_aligned = alignSize(old_size);
+    size_t new_aligned = alignSize(new_size);
+    if (pointer == arena->last && blockRoom(block) >= new_aligned - old_aligned) {
+        block->used += new_aligned - old_aligned;
+        return pointer;
+    }
+
+    void* result = arenaAllocate(arena, new_size);
+    memcpy(result, pointer, old_size);
+    return result;
+}
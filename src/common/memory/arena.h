@@ -0,0 +1,36 @@
+#ifndef clox_arena_h
+#define clox_arena_h
+
+#include "common/common.h"
+#include "common/memory/heap.h"
+
+// Bump allocator for data that dies together, like the scratch arrays of
+// the optimizer, the register emitter and the JIT assembler. Allocating
+// moves a pointer, nothing is freed on its own and freeArena() hands all
+// blocks back to the VM allocator at once. Live arenas are listed in
+// vm->heap so that running out of memory can free them too.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+#define ARENA_ALLOCATE(arena, type, count) \
+    (type*)arenaAllocate(arena, sizeof(type) * (count))
+
+#define ARENA_GROW_ARRAY(arena, type, pointer, old_count, new_count) \
+    (type*)arenaResize(arena, pointer, sizeof(type) * (old_count), \
+        sizeof(type) * (new_count))
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock* blocks;
+    void* last;        // the newest allocation grows in place
+    MemoryCategory category;
+    VM* vm;            // blocks come from this VM's allocator
+    struct Arena* next; // in vm->heap.arenas
+} Arena;
+
+void initArena(VM* vm, Arena* arena, MemoryCategory category);
+void freeArena(Arena* arena);
+void* arenaAllocate(Arena* arena, size_t size);
+void* arenaResize(Arena* arena, void* pointer, size_t old_size, size_t new_size);
+
+#endif // !clox_arena_h
@@ -0,0 +1,82 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include <setjmp.h>
+
+#include "common/common.h"
+#include "common/chunk/chunk.h"
+#include "common/value/value.h"
+#include "common/memory/nursery.h"
+
+// what an allocation is for, every reallocate() call names one
+typedef enum {
+    MEMORY_CODE,      // bytecode of chunks
+    MEMORY_CONSTANTS, // constant pools
+    MEMORY_LINES,     // line runs of chunks
+    MEMORY_TABLES,    // hash table entries and global slots
+    MEMORY_STRINGS,   // strings and ropes
+    MEMORY_NURSERY,   // the young generation and its remembered set
+    MEMORY_JIT,       // compiled loops and the assembler
+    MEMORY_SCRATCH,   // buffers of the compiler passes, the chunk files and flattening
+    MEMORY_CATEGORY_COUNT
+} MemoryCategory;
+
+typedef struct {
+    size_t bytes;
+    size_t peak;
+} HeapUsage;
+
+// the collector runs once the heap has doubled since the last collection,
+// and not before it holds this much
+#define HEAP_GROW_FACTOR 2
+#define HEAP_MIN_NEXT_GC (1024 * 1024)
+// values and chunks a C caller keeps alive across an allocation
+#define HEAP_TEMP_ROOTS_MAX 8
+#define HEAP_CHUNK_ROOTS_MAX 8
+
+// Running out of memory unwinds to the innermost guard, which frees what
+// its frames held and returns an error or raises again:
+//
+//     HeapGuard guard;
+//     if (setjmp(guard.jump) == 0) {
+//         pushHeapGuard(vm, &guard);
+//         ...
+//         popHeapGuard(vm, &guard);
+//     }
+//     else ... // the guard is popped already
+//
+// Arenas opened inside the guard are freed before the jump and roots
+// pushed inside it are dropped.
+typedef struct HeapGuard {
+    jmp_buf jump;
+    struct HeapGuard* enclosing;
+    struct Arena* arenas; // live when the guard was pushed, they stay
+    int temp_root_count;
+    int chunk_root_count;
+} HeapGuard;
+
+typedef struct {
+    HeapUsage total;
+    HeapUsage categories[MEMORY_CATEGORY_COUNT];
+    size_t limit;         // growing past it runs out of memory, 0 for none
+    HeapGuard* guard;     // innermost, without one running out of memory exits
+    struct Arena* arenas; // live arenas, the newest first
+
+    // Mark-sweep collection of vm->objects. The roots are the VM stack, the
+    // globals, the constants of the chunk roots and the temporary roots;
+    // vm->strings only holds its strings weakly.
+    size_t next_gc;       // total bytes that trigger the next collection
+    size_t collections;
+    Value temp_roots[HEAP_TEMP_ROOTS_MAX];
+    int temp_root_count;
+    Chunk* chunk_roots[HEAP_CHUNK_ROOTS_MAX];
+    int chunk_root_count;
+    Obj** gray;           // marked ropes whose sides are not marked yet
+    int gray_count;
+    int gray_capacity;
+    Nursery nursery;
+} Heap;
+
+void initHeap(Heap* heap);
+
+#endif // !clox_heap_h
\ No newline at end of file
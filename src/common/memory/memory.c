@@ -1,40 +1,327 @@
 #include <stdlib.h>
 
+#include "arena.h"
 #include "memory.h"
+#include "common/table/table.h"
 #include "vm/vm.h"
 
-void* reallocate(void* pointer, size_t old_size, size_t new_size) {
+static void* systemAlloc(void* context, size_t size) {
+    (void)context;
+    return malloc(size);
+}
+static void* systemResize(void* context, void* pointer, size_t old_size, size_t new_size) {
+    (void)context;
+    (void)old_size;
+    return realloc(pointer, new_size);
+}
+static void systemFree(void* context, void* pointer, size_t size) {
+    (void)context;
+    (void)size;
+    free(pointer);
+}
+
+Allocator systemAllocator() {
+    return (Allocator){ systemAlloc, systemResize, systemFree, NULL };
+}
+
+void initHeap(Heap* heap) {
+    heap->total = (HeapUsage){ 0, 0 };
+    for (int i = 0; i < MEMORY_CATEGORY_COUNT; ++i) {
+        heap->categories[i] = (HeapUsage){ 0, 0 };
+    }
+    heap->limit = 0;
+    heap->guard = NULL;
+    heap->arenas = NULL;
+    heap->next_gc = HEAP_MIN_NEXT_GC;
+    heap->collections = 0;
+    heap->temp_root_count = 0;
+    heap->chunk_root_count = 0;
+    heap->gray = NULL;
+    heap->gray_count = 0;
+    heap->gray_capacity = 0;
+    initNursery(&heap->nursery);
+}
+
+static void countBytes(HeapUsage* usage, size_t old_size, size_t new_size) {
+    usage->bytes = usage->bytes - old_size + new_size;
+    if (usage->bytes > usage->peak) usage->peak = usage->bytes;
+}
+
+static bool fitsHeap(VM* vm, size_t size) {
+    Heap* heap = &vm->heap;
+    return heap->limit == 0 ||
+        (heap->total.bytes <= heap->limit && size <= heap->limit - heap->total.bytes);
+}
+
+void* reallocate(VM* vm, void* pointer, size_t old_size, size_t new_size, MemoryCategory category) {
+    Allocator* allocator = &vm->allocator;
     if (new_size == 0) {
-        free(pointer);
+        if (pointer == NULL) return NULL;
+        allocator->free(allocator->context, pointer, old_size);
+        countBytes(&vm->heap.total, old_size, 0);
+        countBytes(&vm->heap.categories[category], old_size, 0);
         return NULL;
     }
 
-    void* result = realloc(pointer, new_size);
-    if (result == NULL) {
-        exit(EXIT_FAILURE);
+    if (pointer == NULL) old_size = 0;
+    if (new_size > old_size) {
+        size_t growth = new_size - old_size;
+        if (!vm->heap.nursery.is_collecting) {
+#ifdef DEBUG_STRESS_GC
+            collectGarbage(vm);
+#else
+            if (vm->heap.total.bytes + growth > vm->heap.next_gc || !fitsHeap(vm, growth)) {
+                collectGarbage(vm);
+            }
+#endif // DEBUG_STRESS_GC
+        }
+        if (!fitsHeap(vm, growth)) raiseOutOfMemory(vm);
     }
+
+    void* result = pointer == NULL ?
+        allocator->alloc(allocator->context, new_size) :
+        allocator->resize(allocator->context, pointer, old_size, new_size);
+    if (result == NULL) raiseOutOfMemory(vm);
+
+    countBytes(&vm->heap.total, old_size, new_size);
+    countBytes(&vm->heap.categories[category], old_size, new_size);
+    return result;
+}
+
+void* tryReallocate(VM* vm, void* pointer, size_t old_size, size_t new_size, MemoryCategory category) {
+    Allocator* allocator = &vm->allocator;
+    if (pointer == NULL) old_size = 0;
+    if (new_size > old_size && !fitsHeap(vm, new_size - old_size)) return NULL;
+
+    void* result = pointer == NULL ?
+        allocator->alloc(allocator->context, new_size) :
+        allocator->resize(allocator->context, pointer, old_size, new_size);
+    if (result == NULL) return NULL;
+
+    countBytes(&vm->heap.total, old_size, new_size);
+    countBytes(&vm->heap.categories[category], old_size, new_size);
     return result;
 }
 
-static void freeObject(Obj* object) {
+void pushHeapGuard(VM* vm, HeapGuard* guard) {
+    guard->enclosing = vm->heap.guard;
+    guard->arenas = vm->heap.arenas;
+    guard->temp_root_count = vm->heap.temp_root_count;
+    guard->chunk_root_count = vm->heap.chunk_root_count;
+    vm->heap.guard = guard;
+}
+
+void popHeapGuard(VM* vm, HeapGuard* guard) {
+    vm->heap.guard = guard->enclosing;
+}
+
+void raiseOutOfMemory(VM* vm) {
+    HeapGuard* guard = vm->heap.guard;
+    if (guard == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // the frames that opened these arenas are about to go
+    while (vm->heap.arenas != guard->arenas) freeArena(vm->heap.arenas);
+    vm->heap.temp_root_count = guard->temp_root_count;
+    vm->heap.chunk_root_count = guard->chunk_root_count;
+    popHeapGuard(vm, guard);
+    longjmp(guard->jump, 1);
+}
+
+void printHeapStats(VM* vm, FILE* out) {
+    static const char* names[MEMORY_CATEGORY_COUNT] = {
+        [MEMORY_CODE] = "code",
+        [MEMORY_CONSTANTS] = "constants",
+        [MEMORY_LINES] = "lines",
+        [MEMORY_TABLES] = "tables",
+        [MEMORY_STRINGS] = "strings",
+        [MEMORY_NURSERY] = "nursery",
+        [MEMORY_JIT] = "jit",
+        [MEMORY_SCRATCH] = "scratch",
+    };
+
+    fprintf(out, "%-10s %12s %12s\n", "heap", "bytes", "peak");
+    for (int i = 0; i < MEMORY_CATEGORY_COUNT; ++i) {
+        HeapUsage* usage = &vm->heap.categories[i];
+        fprintf(out, "%-10s %12zu %12zu\n", names[i], usage->bytes, usage->peak);
+    }
+    fprintf(out, "%-10s %12zu %12zu\n", "total", vm->heap.total.bytes, vm->heap.total.peak);
+    if (vm->heap.limit != 0) fprintf(out, "%-10s %12zu\n", "limit", vm->heap.limit);
+    fprintf(out, "%-10s %12zu\n", "gc runs", vm->heap.collections);
+    fprintf(out, "%-10s %12zu\n", "minor gcs", vm->heap.nursery.collections);
+}
+
+void pushRoot(VM* vm, Value value) {
+    vm->heap.temp_roots[vm->heap.temp_root_count++] = value;
+}
+
+void popRoot(VM* vm) {
+    vm->heap.temp_root_count--;
+}
+
+void pushChunkRoot(VM* vm, Chunk* chunk) {
+    vm->heap.chunk_roots[vm->heap.chunk_root_count++] = chunk;
+}
+
+void popChunkRoot(VM* vm) {
+    vm->heap.chunk_root_count--;
+}
+
+static void freeObject(VM* vm, Obj* object) {
     switch (object->type) {
     case OBJ_STRING: {
         ObjString* string = (ObjString*)object;
-        if (!string->is_constant) {
-            FREE_ARRAY(char, string->chars, string->length + 1);
-        }
-        FREE(ObjString, object);
+        size_t bytes = string->is_constant ? 0 : string->length + 1;
+        reallocate(vm, object, sizeof(ObjString) + bytes, 0, MEMORY_STRINGS);
         break;
     }
+    case OBJ_ROPE:
+        FREE(vm, ObjRope, object, MEMORY_STRINGS);
+        break;
     default: return; // unreachable
     }
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
+// Growing the gray stack must neither start another collection nor run
+// out of memory halfway through marking.
+static bool pushGray(VM* vm, Obj* object) {
+    Heap* heap = &vm->heap;
+    if (heap->gray_capacity < heap->gray_count + 1) {
+        int old_capacity = heap->gray_capacity;
+        int capacity = GROW_CAPACITY(old_capacity);
+        Obj** gray = (Obj**)tryReallocate(vm, heap->gray,
+            sizeof(Obj*) * old_capacity, sizeof(Obj*) * capacity, MEMORY_SCRATCH);
+        if (gray == NULL) return false;
+
+        heap->gray = gray;
+        heap->gray_capacity = capacity;
+    }
+
+    heap->gray[heap->gray_count++] = object;
+    return true;
+}
+
+static bool markObject(VM* vm, Obj* object) {
+    if (object == NULL || object->is_marked) return true;
+    object->is_marked = true;
+
+    // strings reference nothing, only ropes have sides to trace
+    return object->type != OBJ_ROPE || pushGray(vm, object);
+}
+
+static bool markValue(VM* vm, Value value) {
+    return !IS_OBJ(value) || markObject(vm, AS_OBJ(value));
+}
+
+static bool markTable(VM* vm, Table* table) {
+    bool marked = true;
+    for (int i = 0; i < table->capacity; ++i) {
+        if (!isTableSlotUsed(table, i)) continue;
+
+        Entry* entry = &table->entries[i];
+        marked &= markObject(vm, (Obj*)entry->key);
+        marked &= markValue(vm, entry->value);
+    }
+    return marked;
+}
+
+static bool markRoots(VM* vm) {
+    bool marked = true;
+    for (Value* slot = vm->stack; slot < vm->stack_top; ++slot) {
+        marked &= markValue(vm, *slot);
+    }
+    for (int i = 0; i < vm->global_count; ++i) {
+        marked &= markValue(vm, vm->global_values[i]);
+        marked &= markObject(vm, (Obj*)vm->global_names[i]);
+    }
+    marked &= markTable(vm, &vm->global_slots);
+    for (int i = 0; i < vm->heap.chunk_root_count; ++i) {
+        ValueArray* constants = &vm->heap.chunk_roots[i]->constants;
+        for (int j = 0; j < constants->count; ++j) {
+            marked &= markValue(vm, constants->values[j]);
+        }
+    }
+    for (int i = 0; i < vm->bound_chunk.constants.count; ++i) {
+        marked &= markValue(vm, vm->bound_chunk.constants.values[i]);
+    }
+    for (int i = 0; i < vm->heap.temp_root_count; ++i) {
+        marked &= markValue(vm, vm->heap.temp_roots[i]);
+    }
+    return marked;
+}
+
+static bool traceReferences(VM* vm) {
+    bool marked = true;
+    while (vm->heap.gray_count > 0) {
+        ObjRope* rope = (ObjRope*)vm->heap.gray[--vm->heap.gray_count];
+        // append loops build left-deep ropes, walk down the left sides
+        // right away instead of pushing every node
+        for (;;) {
+            marked &= markObject(vm, rope->right);
+            marked &= markObject(vm, (Obj*)rope->flat);
+            Obj* left = rope->left;
+            if (left == NULL || left->is_marked) break;
+            left->is_marked = true;
+            if (left->type != OBJ_ROPE) break;
+            rope = (ObjRope*)left;
+        }
+    }
+    return marked;
+}
+
+// frees every unmarked object and clears the marks for the next collection,
+// with is_complete false marking was cut short and nothing is freed
+static void sweep(VM* vm, bool is_complete) {
+    Obj* previous = NULL;
+    Obj* object = vm->objects;
+    while (object != NULL) {
+        if (object->is_marked || !is_complete) {
+            object->is_marked = false;
+            previous = object;
+            object = object->next;
+            continue;
+        }
+
+        Obj* unreached = object;
+        object = object->next;
+        if (previous != NULL) {
+            previous->next = object;
+        }
+        else {
+            vm->objects = object;
+        }
+        freeObject(vm, unreached);
+    }
+}
+
+void collectGarbage(VM* vm) {
+    bool is_complete = markRoots(vm) && traceReferences(vm);
+    vm->heap.gray_count = 0;
+    if (is_complete) {
+        internSetRemoveWhite(&vm->strings);
+        sweepRemembered(vm);
+    }
+    sweep(vm, is_complete);
+    clearYoungMarks(vm);
+
+    vm->heap.collections++;
+    vm->heap.next_gc = vm->heap.total.bytes * HEAP_GROW_FACTOR;
+    if (vm->heap.next_gc < HEAP_MIN_NEXT_GC) vm->heap.next_gc = HEAP_MIN_NEXT_GC;
+}
+
+void freeObjects(VM* vm) {
+    Obj* object = vm->objects;
     while (object != NULL) {
         Obj* next = object->next;
-        freeObject(object);
+        freeObject(vm, object);
         object = next;
     }
+
+    FREE_ARRAY(vm, Obj*, vm->heap.gray, vm->heap.gray_capacity, MEMORY_SCRATCH);
+    vm->heap.gray = NULL;
+    vm->heap.gray_count = 0;
+    vm->heap.gray_capacity = 0;
+    freeNursery(vm, &vm->heap.nursery);
 }
\ No newline at end of file
@@ -1,25 +1,47 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdio.h>
+
 #include "common/common.h"
+#include "common/memory/allocator.h"
+#include "common/memory/heap.h"
 #include "common/object/object.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * count)
+#define ALLOCATE(vm, type, count, category) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count), category)
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer, category) reallocate(vm, pointer, sizeof(type), 0, category)
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, old_count, new_count) \
-    (type*)reallocate(pointer, sizeof(type) * (old_count), \
-        sizeof(type) * (new_count))
-
-#define FREE_ARRAY(type, pointer, old_count) \
-    reallocate(pointer, sizeof(type) * (old_count), 0)
-
-void* reallocate(void* pointer, size_t old_size, size_t new_size);
-void freeObjects();
+#define GROW_ARRAY(vm, type, pointer, old_count, new_count, category) \
+    (type*)reallocate(vm, pointer, sizeof(type) * (old_count), \
+        sizeof(type) * (new_count), category)
+
+#define FREE_ARRAY(vm, type, pointer, old_count, category) \
+    reallocate(vm, pointer, sizeof(type) * (old_count), 0, category)
+
+// every allocation of a VM goes through here to vm->allocator and is
+// counted in vm->heap, growing past vm->heap.limit runs out of memory
+void* reallocate(VM* vm, void* pointer, size_t old_size, size_t new_size, MemoryCategory category);
+// counted like reallocate() but never collects, NULL when out of memory
+void* tryReallocate(VM* vm, void* pointer, size_t old_size, size_t new_size, MemoryCategory category);
+void pushHeapGuard(VM* vm, HeapGuard* guard);
+void popHeapGuard(VM* vm, HeapGuard* guard);
+// unwinds to the innermost guard, exits when there is none
+void raiseOutOfMemory(VM* vm);
+void printHeapStats(VM* vm, FILE* out);
+
+// Keep an object a C caller holds alive until the matching pop, a chunk
+// root keeps its constants alive. Pushes and pops nest.
+void pushRoot(VM* vm, Value value);
+void popRoot(VM* vm);
+void pushChunkRoot(VM* vm, Chunk* chunk);
+void popChunkRoot(VM* vm);
+// frees every object the roots do not reach
+void collectGarbage(VM* vm);
+void freeObjects(VM* vm);
 
 #endif
\ No newline at end of file
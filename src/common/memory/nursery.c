@@ -0,0 +1,173 @@
+#include <setjmp.h>
+
+#include "memory.h"
+#include "nursery.h"
+#include "vm/vm.h"
+
+static size_t alignSize(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+void initNursery(Nursery* nursery) {
+    nursery->start = NULL;
+    nursery->top = NULL;
+    nursery->end = NULL;
+    nursery->is_full = false;
+    nursery->is_collecting = false;
+    nursery->remembered = NULL;
+    nursery->remembered_count = 0;
+    nursery->remembered_capacity = 0;
+    nursery->collections = 0;
+}
+
+void freeNursery(VM* vm, Nursery* nursery) {
+    if (nursery->start != NULL) {
+        reallocate(vm, nursery->start, NURSERY_SIZE, 0, MEMORY_NURSERY);
+    }
+    FREE_ARRAY(vm, Obj*, nursery->remembered, nursery->remembered_capacity, MEMORY_NURSERY);
+    initNursery(nursery);
+}
+
+Obj* allocateYoung(VM* vm, size_t size) {
+    Nursery* nursery = &vm->heap.nursery;
+    size = alignSize(size);
+    if (size > NURSERY_MAX_OBJECT) return NULL;
+
+    if (nursery->start == NULL) {
+        // made on first use, without it everything is allocated old
+        nursery->start = tryReallocate(vm, NULL, 0, NURSERY_SIZE, MEMORY_NURSERY);
+        if (nursery->start == NULL) return NULL;
+        nursery->top = nursery->start;
+        nursery->end = nursery->start + NURSERY_SIZE;
+    }
+    if ((size_t)(nursery->end - nursery->top) < size) {
+        nursery->is_full = true;
+        return NULL;
+    }
+
+    Obj* object = (Obj*)nursery->top;
+    nursery->top += size;
+    return object;
+}
+
+bool isYoung(VM* vm, Obj* object) {
+    uint8_t* at = (uint8_t*)object;
+    return at >= vm->heap.nursery.start && at < vm->heap.nursery.top;
+}
+
+// growing the set never collects, promotion adds to it while objects move
+static void remember(VM* vm, Obj* object) {
+    Nursery* nursery = &vm->heap.nursery;
+    if (nursery->remembered_capacity < nursery->remembered_count + 1) {
+        int old_capacity = nursery->remembered_capacity;
+        int capacity = GROW_CAPACITY(old_capacity);
+        Obj** remembered = (Obj**)tryReallocate(vm, nursery->remembered,
+            sizeof(Obj*) * old_capacity, sizeof(Obj*) * capacity, MEMORY_NURSERY);
+        if (remembered == NULL) raiseOutOfMemory(vm);
+        nursery->remembered = remembered;
+        nursery->remembered_capacity = capacity;
+    }
+    nursery->remembered[nursery->remembered_count++] = object;
+}
+
+void writeBarrier(VM* vm, Obj* owner, Obj* value) {
+    if (value != NULL && isYoung(vm, value) && !isYoung(vm, owner)) remember(vm, owner);
+}
+
+// the next field of a young object is free, promotion keeps the old
+// copy there
+static void evacuate(VM* vm, Obj** slot) {
+    Obj* object = *slot;
+    if (object == NULL || !isYoung(vm, object)) return;
+
+    if (object->next == NULL) {
+        Obj* copy = promoteObject(vm, object);
+        // the sides of a promoted rope are scanned like a remembered one
+        if (copy->type == OBJ_ROPE) remember(vm, copy);
+        object->next = copy;
+    }
+    *slot = object->next;
+}
+static void evacuateValue(VM* vm, Value* slot) {
+    if (!IS_OBJ(*slot)) return;
+
+    Obj* object = AS_OBJ(*slot);
+    evacuate(vm, &object);
+    *slot = OBJ_VAL(object);
+}
+
+// walks the young objects in allocation order, reservations included, and
+// clears forwarding pointers as well
+void clearYoungMarks(VM* vm) {
+    Nursery* nursery = &vm->heap.nursery;
+    for (uint8_t* at = nursery->start; at < nursery->top; at += alignSize(objectSize((Obj*)at))) {
+        Obj* object = (Obj*)at;
+        object->is_marked = false;
+        object->next = NULL;
+    }
+}
+
+void collectNursery(VM* vm) {
+    Nursery* nursery = &vm->heap.nursery;
+    if (nursery->top == nursery->start) {
+        nursery->is_full = false;
+        return;
+    }
+
+    HeapGuard guard;
+    if (setjmp(guard.jump) != 0) {
+        // What was promoted so far stays promoted, the rest stays young.
+        // Dropping the forwarding pointers keeps the young objects whole,
+        // the remembered set still lists every promoted rope.
+        clearYoungMarks(vm);
+        nursery->is_collecting = false;
+        raiseOutOfMemory(vm);
+    }
+    pushHeapGuard(vm, &guard);
+    nursery->is_collecting = true;
+
+    for (Value* slot = vm->stack; slot < vm->stack_top; ++slot) {
+        evacuateValue(vm, slot);
+    }
+    for (int i = 0; i < vm->global_count; ++i) {
+        evacuateValue(vm, &vm->global_values[i]);
+    }
+    for (int i = 0; i < vm->heap.chunk_root_count; ++i) {
+        ValueArray* constants = &vm->heap.chunk_roots[i]->constants;
+        for (int j = 0; j < constants->count; ++j) {
+            evacuateValue(vm, &constants->values[j]);
+        }
+    }
+    for (int i = 0; i < vm->bound_chunk.constants.count; ++i) {
+        evacuateValue(vm, &vm->bound_chunk.constants.values[i]);
+    }
+    for (int i = 0; i < vm->heap.temp_root_count; ++i) {
+        evacuateValue(vm, &vm->heap.temp_roots[i]);
+    }
+
+    // promoting a rope appends it, the loop runs until nothing is left
+    for (int i = 0; i < nursery->remembered_count; ++i) {
+        ObjRope* rope = (ObjRope*)nursery->remembered[i];
+        evacuate(vm, &rope->left);
+        evacuate(vm, &rope->right);
+        evacuate(vm, (Obj**)&rope->flat);
+    }
+
+    popHeapGuard(vm, &guard);
+    nursery->remembered_count = 0;
+    nursery->top = nursery->start;
+    nursery->is_full = false;
+    nursery->is_collecting = false;
+    nursery->collections++;
+}
+
+void sweepRemembered(VM* vm) {
+    Nursery* nursery = &vm->heap.nursery;
+    int count = 0;
+    for (int i = 0; i < nursery->remembered_count; ++i) {
+        if (nursery->remembered[i]->is_marked) {
+            nursery->remembered[count++] = nursery->remembered[i];
+        }
+    }
+    nursery->remembered_count = count;
+}
\ No newline at end of file
@@ -0,0 +1,50 @@
+#ifndef clox_nursery_h
+#define clox_nursery_h
+
+#include "common/common.h"
+#include "common/value/value.h"
+
+// young objects are bump allocated in one block of this size, larger
+// ones go straight to the old generation
+#define NURSERY_SIZE (256 * 1024)
+#define NURSERY_MAX_OBJECT (NURSERY_SIZE / 16)
+
+// The young generation. New strings and ropes are carved out of one block
+// by moving a pointer and are not linked into vm->objects until they
+// survive. A minor collection copies what the roots and the remembered set
+// still reach into the old generation and empties the block. It moves
+// objects, so it only runs at safe points where every live reference sits
+// in a root: between instructions and before a chunk starts. When the
+// block fills up in between, objects are allocated old until then.
+//
+// The roots are the same as for a full collection. Old objects that point
+// into the nursery are found through the remembered set, which the write
+// barrier fills; globals and constants are roots and need no barrier.
+typedef struct {
+    uint8_t* start;
+    uint8_t* top;
+    uint8_t* end;
+    bool is_full;       // an allocation did not fit, collect at the next safe point
+    bool is_collecting; // reallocate() must not start a full collection meanwhile
+    Obj** remembered;   // old ropes that may point into the nursery
+    int remembered_count;
+    int remembered_capacity;
+    size_t collections;
+} Nursery;
+
+void initNursery(Nursery* nursery);
+void freeNursery(VM* vm, Nursery* nursery);
+// NULL when the object has to be allocated old instead
+Obj* allocateYoung(VM* vm, size_t size);
+bool isYoung(VM* vm, Obj* object);
+// call before storing value into a field of owner, it never collects
+void writeBarrier(VM* vm, Obj* owner, Obj* value);
+// promotes every young object the roots reach and empties the nursery,
+// a young pointer held anywhere else is stale afterwards
+void collectNursery(VM* vm);
+// part of a full collection: drops the remembered objects it is about to
+// free, then clears the marks it left on young objects
+void sweepRemembered(VM* vm);
+void clearYoungMarks(VM* vm);
+
+#endif // !clox_nursery_h
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+struct PoolSlab {
+    PoolSlab* next;
+    // keeps the blocks carved after the header 16-byte aligned
+    max_align_t align;
+};
+
+void initPool(Pool* pool) {
+    for (int i = 0; i < POOL_CLASS_COUNT; ++i) pool->free_lists[i] = NULL;
+    pool->slab_top = NULL;
+    pool->slab_end = NULL;
+    pool->slabs = NULL;
+}
+
+void freePool(Pool* pool) {
+    PoolSlab* slab = pool->slabs;
+    while (slab != NULL) {
+        PoolSlab* next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    initPool(pool);
+}
+
+static int sizeClass(size_t size) {
+    return size == 0 ? 0 : (int)((size + POOL_CLASS_SIZE - 1) / POOL_CLASS_SIZE) - 1;
+}
+
+static void* poolAlloc(void* context, size_t size) {
+    Pool* pool = (Pool*)context;
+    if (size > POOL_MAX_SIZE) return malloc(size);
+
+    int size_class = sizeClass(size);
+    void* block = pool->free_lists[size_class];
+    if (block != NULL) {
+        pool->free_lists[size_class] = *(void**)block;
+        return block;
+    }
+
+    size_t class_size = (size_t)(size_class + 1) * POOL_CLASS_SIZE;
+    if (pool->slab_top == NULL || (size_t)(pool->slab_end - pool->slab_top) < class_size) {
+        // the rest of the old slab is too small for this class, it is
+        // handed out to the smaller classes that still fit
+        while (pool->slab_top != NULL && pool->slab_end - pool->slab_top >= POOL_CLASS_SIZE) {
+            int rest_class = (int)((pool->slab_end - pool->slab_top) / POOL_CLASS_SIZE) - 1;
+            if (rest_class >= POOL_CLASS_COUNT) rest_class = POOL_CLASS_COUNT - 1;
+            *(void**)pool->slab_top = pool->free_lists[rest_class];
+            pool->free_lists[rest_class] = pool->slab_top;
+            pool->slab_top += (size_t)(rest_class + 1) * POOL_CLASS_SIZE;
+        }
+
+        PoolSlab* slab = (PoolSlab*)malloc(POOL_SLAB_SIZE);
+        if (slab == NULL) return NULL;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->slab_top = (uint8_t*)&slab->align;
+        pool->slab_end = (uint8_t*)slab + POOL_SLAB_SIZE;
+    }
+
+    block = pool->slab_top;
+    pool->slab_top += class_size;
+    return block;
+}
+
+static void poolFree(void* context, void* pointer, size_t size) {
+    Pool* pool = (Pool*)context;
+    if (size > POOL_MAX_SIZE) {
+        free(pointer);
+        return;
+    }
+
+    int size_class = sizeClass(size);
+    *(void**)pointer = pool->free_lists[size_class];
+    pool->free_lists[size_class] = pointer;
+}
+
+static void* poolResize(void* context, void* pointer, size_t old_size, size_t new_size) {
+    if (old_size > POOL_MAX_SIZE && new_size > POOL_MAX_SIZE) {
+        return realloc(pointer, new_size);
+    }
+    if (old_size <= POOL_MAX_SIZE && new_size <= POOL_MAX_SIZE &&
+        sizeClass(old_size) == sizeClass(new_size)) {
+        return pointer;
+    }
+
+    void* block = poolAlloc(context, new_size);
+    if (block == NULL) return NULL;
+    memcpy(block, pointer, old_size < new_size ? old_size : new_size);
+    poolFree(context, pointer, old_size);
+    return block;
+}
+
+Allocator poolAllocator(Pool* pool) {
+    return (Allocator){ poolAlloc, poolResize, poolFree, pool };
+}
@@ -0,0 +1,29 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include "common/memory/allocator.h"
+
+// Size-class pool, the allocator a VM uses unless it is given another.
+// Blocks up to POOL_MAX_SIZE come from per-class free lists that are
+// refilled by carving slabs, so object headers and small arrays never
+// reach malloc once the pool is warm. Larger blocks go to malloc.
+#define POOL_CLASS_SIZE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASS_COUNT (POOL_MAX_SIZE / POOL_CLASS_SIZE)
+#define POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct PoolSlab PoolSlab;
+
+typedef struct {
+    void* free_lists[POOL_CLASS_COUNT];
+    uint8_t* slab_top;  // unused part of the newest slab
+    uint8_t* slab_end;
+    PoolSlab* slabs;
+} Pool;
+
+void initPool(Pool* pool);
+// releases every slab, blocks still in use become invalid
+void freePool(Pool* pool);
+Allocator poolAllocator(Pool* pool);
+
+#endif // !clox_pool_h
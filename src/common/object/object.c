@@ -1,66 +1,336 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "common/hash/hash.h"
+#include "common/memory/arena.h"
 #include "common/memory/memory.h"
-#include "common/table/table.h"
+#include "common/table/intern_set.h"
+#include "common/table/shared_strings.h"
 #include "vm/vm.h"
 #include "object.h"
 
 #define ALLOCATE_OBJ(type, object_type) \
-    (type*)allocateObject(sizeof(type), object_type)
+    (type*)allocateObject(vm, sizeof(type), object_type)
+#define ALLOCATE_YOUNG_OBJ(type, object_type) \
+    (type*)allocateYoungObject(vm, sizeof(type), object_type)
 
-static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+// ropes that keep fewer nodes pending are flattened without allocating a stack
+#define FLATTEN_LOCAL_PENDING 32
+
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+    Obj* object = (Obj*)reallocate(vm, NULL, 0, size, MEMORY_STRINGS);
     object->type = type;
+    object->is_marked = false;
 
-    object->next = vm.objects;
-    vm.objects = object;
+    object->next = vm->objects;
+    vm->objects = object;
+    return object;
+}
+// young objects stay out of vm->objects, next is their forwarding pointer
+static Obj* allocateYoungObject(VM* vm, size_t size, ObjType type) {
+    Obj* object = allocateYoung(vm, size);
+    if (object == NULL) return allocateObject(vm, size, type);
+
+    object->type = type;
+    object->is_marked = false;
+    object->next = NULL;
     return object;
 }
 
-// FNV-1a
-static uint32_t hashString(const char* key, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; ++i) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+static void addInterned(VM* vm, ObjString* string, uint32_t hash) {
+    string->hash = hash;
+    string->is_interned = true;
+    pushRoot(vm, OBJ_VAL(string));
+    internSetAdd(vm, &vm->strings, string);
+    popRoot(vm);
+}
+
+static ObjString* initReservation(ObjString* string, int length) {
+    string->obj.type = OBJ_STRING;
+    string->obj.is_marked = false;
+    string->obj.next = NULL;
+    string->length = length;
+    string->is_constant = false;
+    string->is_interned = false;
+    string->hash = 0;
+    string->chars = string->bytes;
+    string->bytes[length] = '\0';
+    return string;
+}
+static ObjString* reserveOldString(VM* vm, int length) {
+    size_t size = sizeof(ObjString) + length + 1;
+    return initReservation((ObjString*)reallocate(vm, NULL, 0, size, MEMORY_STRINGS), length);
+}
+
+ObjString* reserveString(VM* vm, int length) {
+    ObjString* string = (ObjString*)allocateYoung(vm, sizeof(ObjString) + length + 1);
+    if (string == NULL) return reserveOldString(vm, length);
+    return initReservation(string, length);
+}
+
+ObjString* takeString(VM* vm, ObjString* string) {
+    // only now an old reservation becomes an object of the VM, young
+    // objects are found through the roots
+    if (!isYoung(vm, (Obj*)string)) {
+        string->obj.next = vm->objects;
+        vm->objects = (Obj*)string;
     }
-    return hash;
+    return string;
+}
+// A VM never holds two interned strings with the same characters: once a
+// string is in the local set that one is found first, even if another VM
+// adds it to the shared table later, and a string the shared table had
+// never goes to the local set since that table never drops one.
+static ObjString* findConstant(VM* vm, const char* chars, int length, uint32_t hash) {
+    ObjString* interned = internSetFind(&vm->strings, chars, length, hash);
+    if (interned != NULL || vm->shared_strings == NULL) return interned;
+    return sharedStringsIntern(vm->shared_strings, chars, length, hash);
 }
 
-static ObjString* allocateString(char* chars, int length, bool is_constant, uint32_t hash) {
+ObjString* constantString(VM* vm, const char* chars, int length) {
+    uint32_t hash = hashString(vm->hash_state, chars, length);
+    ObjString* interned = findConstant(vm, chars, length, hash);
+    if (interned != NULL) return interned;
+
     ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
     string->length = length;
-    string->is_constant = is_constant;
+    string->is_constant = true;
     string->chars = chars;
-    string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL);
+    addInterned(vm, string, hash);
     return string;
 }
 
-ObjString* takeString(char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if (interned != NULL) {
-        FREE_ARRAY(char, chars, length + 1ull);
-        return interned;
-    }
+ObjString* copyString(VM* vm, const char* chars, int length) {
+    uint32_t hash = hashString(vm->hash_state, chars, length);
+    ObjString* interned = findConstant(vm, chars, length, hash);
+    if (interned != NULL) return interned;
 
-    return allocateString(chars, length, false, hash);
+    // interned strings never move, so it is allocated old
+    ObjString* string = reserveOldString(vm, length);
+    memcpy(string->bytes, chars, length);
+    addInterned(vm, takeString(vm, string), hash);
+    return string;
 }
-ObjString* constantString(const char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
 
+ObjString* internString(VM* vm, ObjString* string) {
+    if (string->is_interned) return string;
+
+    uint32_t hash = hashString(vm->hash_state, string->chars, string->length);
+    ObjString* interned = internSetFind(&vm->strings, string->chars, string->length, hash);
     if (interned != NULL) return interned;
-    return allocateString(chars, length, true, hash);
+    // runtime strings are only looked up there, the table would keep them
+    // for good
+    if (vm->shared_strings != NULL) {
+        interned = sharedStringsFind(vm->shared_strings, string->chars, string->length, hash);
+        if (interned != NULL) return interned;
+    }
+
+    // the set can't hold a string that moves
+    if (isYoung(vm, (Obj*)string)) {
+        ObjString* copy = reserveOldString(vm, string->length);
+        memcpy(copy->bytes, string->chars, string->length);
+        string = takeString(vm, copy);
+    }
+    addInterned(vm, string, hash);
+    return string;
+}
+
+// a flattened rope stands for its string, so ropes built from it stay shallow
+static Obj* settledString(Obj* object) {
+    if (object->type == OBJ_ROPE && ((ObjRope*)object)->flat != NULL) {
+        return (Obj*)((ObjRope*)object)->flat;
+    }
+    return object;
+}
+static int objectLength(Obj* object) {
+    return object->type == OBJ_STRING ? ((ObjString*)object)->length : ((ObjRope*)object)->length;
+}
+static int objectPending(Obj* object) {
+    return object->type == OBJ_STRING ? 1 : ((ObjRope*)object)->pending;
 }
 
-void printObject(Value value) {
+Obj* concatenateStrings(VM* vm, Obj* a, Obj* b) {
+    a = settledString(a);
+    b = settledString(b);
+    if (objectLength(a) == 0) return b;
+    if (objectLength(b) == 0) return a;
+
+    // every unflattened rope is at least ROPE_MIN_LENGTH long, so both
+    // sides of a short concatenation are strings
+    int length = objectLength(a) + objectLength(b);
+    if (length < ROPE_MIN_LENGTH) {
+        ObjString* left = (ObjString*)a;
+        ObjString* right = (ObjString*)b;
+        ObjString* result = reserveString(vm, length);
+        memcpy(result->bytes, left->chars, left->length);
+        memcpy(result->bytes + left->length, right->chars, right->length);
+        return (Obj*)takeString(vm, result);
+    }
+
+    ObjRope* rope = ALLOCATE_YOUNG_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = length;
+    // flattening keeps the left side pending while it copies the right one
+    rope->pending = objectPending(a) > 1 + objectPending(b) ?
+        objectPending(a) : 1 + objectPending(b);
+    // a rope allocated old while the nursery is full may point into it
+    writeBarrier(vm, (Obj*)rope, a);
+    writeBarrier(vm, (Obj*)rope, b);
+    rope->left = a;
+    rope->right = b;
+    rope->flat = NULL;
+    return (Obj*)rope;
+}
+
+// Adjacent strings that together stay short of ROPE_MIN_LENGTH are
+// copied into one string, the rest is joined by rope nodes as
+// concatenateStrings() would.
+Obj* concatenateMany(VM* vm, Value* parts, int count) {
+    Obj* result = NULL;
+    for (int i = 0; i < count;) {
+        Obj* piece = settledString(AS_OBJ(parts[i]));
+        int end = i + 1;
+        if (piece->type == OBJ_STRING) {
+            int length = objectLength(piece);
+            while (end < count) {
+                Obj* next = settledString(AS_OBJ(parts[end]));
+                if (next->type != OBJ_STRING || length + objectLength(next) >= ROPE_MIN_LENGTH) break;
+                length += objectLength(next);
+                end++;
+            }
+
+            if (end > i + 1) {
+                if (result != NULL) pushRoot(vm, OBJ_VAL(result));
+                ObjString* run = reserveString(vm, length);
+                char* chars = run->bytes;
+                for (int j = i; j < end; ++j) {
+                    ObjString* string = (ObjString*)settledString(AS_OBJ(parts[j]));
+                    memcpy(chars, string->chars, string->length);
+                    chars += string->length;
+                }
+                piece = (Obj*)takeString(vm, run);
+                if (result != NULL) popRoot(vm);
+            }
+        }
+        i = end;
+
+        if (result == NULL) {
+            result = piece;
+            continue;
+        }
+        pushRoot(vm, OBJ_VAL(result));
+        pushRoot(vm, OBJ_VAL(piece));
+        result = concatenateStrings(vm, result, piece);
+        popRoot(vm);
+        popRoot(vm);
+    }
+    return result;
+}
+
+ObjString* flattenString(VM* vm, Value value) {
+    if (IS_STRING(value)) return AS_STRING(value);
+    ObjRope* rope = AS_ROPE(value);
+    if (rope->flat != NULL) return rope->flat;
+
+    // fills the buffer from the end, right sides first: the left-deep rope
+    // of an append loop never has more than two nodes pending. The stack
+    // comes first, running out of memory frees the arena but would leak
+    // a reservation.
+    pushRoot(vm, value);
+    Obj* local_pending[FLATTEN_LOCAL_PENDING];
+    Arena arena;
+    initArena(vm, &arena, MEMORY_SCRATCH);
+    Obj** pending = rope->pending <= FLATTEN_LOCAL_PENDING ?
+        local_pending : ARENA_ALLOCATE(&arena, Obj*, rope->pending);
+
+    ObjString* flat = reserveString(vm, rope->length);
+    char* chars = flat->bytes;
+    int count = 0;
+    pending[count++] = (Obj*)rope;
+    int end = rope->length;
+    while (count > 0) {
+        Obj* node = settledString(pending[--count]);
+        if (node->type == OBJ_STRING) {
+            ObjString* string = (ObjString*)node;
+            end -= string->length;
+            memcpy(chars + end, string->chars, string->length);
+            continue;
+        }
+
+        pending[count++] = ((ObjRope*)node)->left;
+        pending[count++] = ((ObjRope*)node)->right;
+    }
+    freeArena(&arena);
+
+    ObjString* result = takeString(vm, flat);
+    writeBarrier(vm, (Obj*)rope, (Obj*)result);
+    rope->flat = result;
+    rope->left = NULL;
+    rope->right = NULL;
+    popRoot(vm);
+    return rope->flat;
+}
+
+int stringLength(Value value) {
+    return objectLength(AS_OBJ(value));
+}
+
+bool stringsEqual(VM* vm, Value a, Value b) {
+    if (AS_OBJ(a) == AS_OBJ(b)) return true;
+    // a rope equals the string it flattens to, only flatten when the
+    // lengths leave any doubt
+    if (stringLength(a) != stringLength(b)) return false;
+
+    // callers may have popped both already and flattening either can
+    // collect; a rooted rope keeps its flat copy alive
+    pushRoot(vm, a);
+    pushRoot(vm, b);
+    ObjString* flat_a = flattenString(vm, a);
+    ObjString* flat_b = flattenString(vm, b);
+    popRoot(vm);
+    popRoot(vm);
+    if (flat_a == flat_b) return true;
+
+    // interned strings are equal only when they are the same, strings
+    // built at runtime are not interned
+    if (flat_a->is_interned && flat_b->is_interned) return false;
+    return memcmp(flat_a->chars, flat_b->chars, flat_a->length) == 0;
+}
+
+size_t objectSize(Obj* object) {
+    switch (object->type) {
+    case OBJ_STRING: {
+        ObjString* string = (ObjString*)object;
+        return sizeof(ObjString) + (string->is_constant ? 0 : string->length + 1);
+    }
+    case OBJ_ROPE: return sizeof(ObjRope);
+    default: return 0; // unreachable
+    }
+}
+
+Obj* promoteObject(VM* vm, Obj* object) {
+    if (object->type == OBJ_STRING) {
+        ObjString* young = (ObjString*)object;
+        ObjString* string = reserveOldString(vm, young->length);
+        memcpy(string->bytes, young->chars, young->length);
+        return (Obj*)takeString(vm, string);
+    }
+
+    Obj* rope = (Obj*)reallocate(vm, NULL, 0, sizeof(ObjRope), MEMORY_STRINGS);
+    memcpy(rope, object, sizeof(ObjRope));
+    rope->next = vm->objects;
+    vm->objects = rope;
+    return rope;
+}
+
+void printObject(VM* vm, FILE* out, Value value) {
     switch (OBJ_TYPE(value)) {
     case OBJ_STRING: {
         ObjString* string = AS_STRING(value);
-        printf("%.*s", string->length, string->chars);
+        fprintf(out, "%.*s", string->length, string->chars);
+    } break;
+    case OBJ_ROPE: {
+        ObjString* string = flattenString(vm, value);
+        fprintf(out, "%.*s", string->length, string->chars);
     } break;
     default:
         break;
@@ -7,30 +7,88 @@
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 typedef enum {
-    OBJ_STRING
+    OBJ_STRING,
+    OBJ_ROPE
 } ObjType;
 
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+// either representation of a Lox string
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 
+// concatenations shorter than this are copied right away, a rope node
+// would only cost more when it is flattened
+#define ROPE_MIN_LENGTH 64
+
 struct Obj {
     ObjType type;
+    bool is_marked;
     struct Obj* next;
 };
 
+// Heap strings are one allocation, their characters follow the header in
+// bytes. Constant strings are the other kind: they point chars into the
+// source that outlives them and have no bytes of their own.
+// Constant strings are interned right away, strings built at runtime only
+// when internString() asks for them; hash is set once a string is interned.
+// A VM that shares strings (see shareStrings()) gets constants that belong
+// to the shared table instead, and so do the VMs it shares them with.
 struct ObjString {
     Obj obj;
     int length;
     bool is_constant;
-    char* chars;
+    bool is_interned;
     uint32_t hash;
+    const char* chars;  // bytes for heap strings
+    char bytes[];
 };
 
-ObjString* takeString(char* chars, int length);
-ObjString* constantString(const char* chars, int length);
-void printObject(Value value);
+// A concatenation that has not been copied yet. Both sides are an
+// ObjString or another ObjRope. The first print or comparison flattens it
+// into an ObjString that is kept in flat, after which the sides
+// are dropped. Appending to a string in a loop only allocates nodes until
+// then, so building a string of n bytes costs O(n) instead of O(n^2).
+typedef struct {
+    Obj obj;
+    int length;
+    int pending; // stack slots flattening the rope takes at most
+    Obj* left;
+    Obj* right;
+    ObjString* flat;
+} ObjRope;
+
+// Heap strings are built in place: reserve one, write its length bytes
+// and hand it to takeString. Until then the string is not an object of
+// the VM. Both live in the nursery while it has room. The string is
+// neither hashed nor interned, equality compares it by its characters.
+ObjString* reserveString(VM* vm, int length);
+ObjString* takeString(VM* vm, ObjString* string);
+// an interned constant that points into chars, which must outlive the VM
+ObjString* constantString(VM* vm, const char* chars, int length);
+// an interned constant with bytes of its own, for chars that go away first
+ObjString* copyString(VM* vm, const char* chars, int length);
+// the interned string equal to string, the caller keeps string alive.
+// Tables compare keys by identity, so only interned strings are keys.
+ObjString* internString(VM* vm, ObjString* string);
+// a and b are strings or ropes the caller keeps alive
+Obj* concatenateStrings(VM* vm, Obj* a, Obj* b);
+// parts are count strings or ropes the caller keeps alive, joined left
+// to right
+Obj* concatenateMany(VM* vm, Value* parts, int count);
+// the string a string or rope value stands for
+ObjString* flattenString(VM* vm, Value value);
+int stringLength(Value value);
+// a and b are strings or ropes, compared by their characters
+bool stringsEqual(VM* vm, Value a, Value b);
+// bytes of the object's allocation
+size_t objectSize(Obj* object);
+// copies a young object into the old generation
+Obj* promoteObject(VM* vm, Obj* object);
+void printObject(VM* vm, FILE* out, Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
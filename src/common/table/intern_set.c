@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include "common/memory/memory.h"
+#include "common/object/object.h"
+#include "intern_set.h"
+
+// linear probing degrades quickly past this
+#define INTERN_SET_MAX_LOAD(capacity) ((capacity) / 4 * 3)
+#define INTERN_SET_MIN_CAPACITY 64
+
+void initInternSet(InternSet* set) {
+    set->count = 0;
+    set->capacity = 0;
+    set->entries = NULL;
+}
+
+void freeInternSet(VM* vm, InternSet* set) {
+    FREE_ARRAY(vm, InternEntry, set->entries, set->capacity, MEMORY_TABLES);
+    initInternSet(set);
+}
+
+ObjString* internSetFind(InternSet* set, const char* chars, int length, uint32_t hash) {
+    if (set->count == 0) return NULL;
+
+    uint32_t mask = (uint32_t)set->capacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        InternEntry* entry = &set->entries[index];
+        if (entry->string == NULL) return NULL;
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(entry->string->chars, chars, length) == 0)
+        {
+            return entry->string;
+        }
+    }
+}
+
+static void insertEntry(InternEntry* entries, int capacity, InternEntry entry) {
+    uint32_t mask = (uint32_t)capacity - 1;
+    uint32_t index = entry.hash & mask;
+    while (entries[index].string != NULL) index = (index + 1) & mask;
+    entries[index] = entry;
+}
+
+// the cached hashes place the entries without touching their strings
+static void adjustCapacity(VM* vm, InternSet* set, int capacity) {
+    InternEntry* entries = ALLOCATE(vm, InternEntry, capacity, MEMORY_TABLES);
+    for (int i = 0; i < capacity; ++i) entries[i].string = NULL;
+
+    for (int i = 0; i < set->capacity; ++i) {
+        if (set->entries[i].string != NULL) insertEntry(entries, capacity, set->entries[i]);
+    }
+
+    FREE_ARRAY(vm, InternEntry, set->entries, set->capacity, MEMORY_TABLES);
+    set->entries = entries;
+    set->capacity = capacity;
+}
+
+void internSetAdd(VM* vm, InternSet* set, ObjString* string) {
+    if (set->count + 1 > INTERN_SET_MAX_LOAD(set->capacity)) {
+        int capacity = set->capacity < INTERN_SET_MIN_CAPACITY ?
+            INTERN_SET_MIN_CAPACITY : set->capacity * 2;
+        adjustCapacity(vm, set, capacity);
+    }
+
+    insertEntry(set->entries, set->capacity, (InternEntry){string, string->hash, string->length});
+    set->count++;
+}
+
+// Moves every later entry of the run that may live in the hole into it,
+// so no probe ever stops short of its string.
+static void removeEntry(InternSet* set, uint32_t index) {
+    uint32_t mask = (uint32_t)set->capacity - 1;
+    uint32_t hole = index;
+    for (uint32_t i = (index + 1) & mask; set->entries[i].string != NULL; i = (i + 1) & mask) {
+        // an entry can't move in front of its home slot
+        uint32_t home = set->entries[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            set->entries[hole] = set->entries[i];
+            hole = i;
+        }
+    }
+    set->entries[hole].string = NULL;
+    set->count--;
+}
+
+// entries only move back by the shift, what moves into the current slot
+// is checked again and what wraps around to the end is checked again later
+void internSetRemoveWhite(InternSet* set) {
+    for (int i = 0; i < set->capacity;) {
+        ObjString* string = set->entries[i].string;
+        if (string != NULL && !string->obj.is_marked) {
+            removeEntry(set, (uint32_t)i);
+        }
+        else {
+            ++i;
+        }
+    }
+}
\ No newline at end of file
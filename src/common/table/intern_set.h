@@ -0,0 +1,32 @@
+#ifndef clox_intern_set_h
+#define clox_intern_set_h
+
+#include "common/common.h"
+#include "common/value/value.h"
+
+typedef struct {
+    ObjString* string; // NULL for an empty slot
+    uint32_t hash;
+    int length;
+} InternEntry;
+
+// The set of interned strings behind vm->strings. Unlike a Table it keeps
+// no values, and every entry caches the hash and length of its string so
+// that a probe only reads the string whose entry matches both. Linear
+// probing over a power of two capacity, removal shifts the entries after
+// the hole back instead of leaving tombstones.
+typedef struct {
+    int count;
+    int capacity;
+    InternEntry* entries;
+} InternSet;
+
+void initInternSet(InternSet* set);
+void freeInternSet(VM* vm, InternSet* set);
+ObjString* internSetFind(InternSet* set, const char* chars, int length, uint32_t hash);
+// string must not be in the set, its hash has to be set already
+void internSetAdd(VM* vm, InternSet* set, ObjString* string);
+// removes the strings the collector did not mark
+void internSetRemoveWhite(InternSet* set);
+
+#endif // !clox_intern_set_h
\ No newline at end of file
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/object/object.h"
+#include "shared_strings.h"
+
+#define SHARED_STRINGS_MIN_CAPACITY 64
+#define SHARED_STRINGS_MAX_CAPACITY (1 << 30)
+
+bool initSharedStrings(SharedStrings* shared, int capacity, uint64_t hash_state) {
+    int rounded = SHARED_STRINGS_MIN_CAPACITY;
+    while (rounded < capacity && rounded < SHARED_STRINGS_MAX_CAPACITY) rounded *= 2;
+
+    shared->hash_state = hash_state;
+    shared->capacity = rounded;
+    shared->max_count = rounded / 4 * 3;
+    atomic_init(&shared->count, 0);
+    shared->slots = (SharedSlot*)malloc(sizeof(SharedSlot) * rounded);
+    if (shared->slots == NULL) return false;
+    for (int i = 0; i < rounded; ++i) {
+        atomic_init(&shared->slots[i].string, NULL);
+        atomic_init(&shared->slots[i].hash, 0);
+    }
+    return true;
+}
+
+void freeSharedStrings(SharedStrings* shared) {
+    for (int i = 0; i < shared->capacity; ++i) {
+        free(atomic_load_explicit(&shared->slots[i].string, memory_order_relaxed));
+    }
+    free(shared->slots);
+    shared->slots = NULL;
+    shared->capacity = 0;
+}
+
+// the hash of a slot only rules strings out, it may not be stored yet
+static bool isString(SharedSlot* slot, ObjString* string, const char* chars, int length, uint32_t hash) {
+    uint32_t slot_hash = atomic_load_explicit(&slot->hash, memory_order_relaxed);
+    if (slot_hash != 0 && slot_hash != hash) return false;
+    return string->hash == hash && string->length == length &&
+        memcmp(string->chars, chars, length) == 0;
+}
+
+ObjString* sharedStringsFind(SharedStrings* shared, const char* chars, int length, uint32_t hash) {
+    uint32_t mask = (uint32_t)shared->capacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        SharedSlot* slot = &shared->slots[index];
+        ObjString* string = atomic_load_explicit(&slot->string, memory_order_acquire);
+        if (string == NULL) return NULL;
+        if (isString(slot, string, chars, length, hash)) return string;
+    }
+}
+
+// marked for good, so that no collector frees it or walks past it
+static ObjString* newSharedString(const char* chars, int length, uint32_t hash) {
+    ObjString* string = (ObjString*)malloc(sizeof(ObjString) + length + 1);
+    if (string == NULL) return NULL;
+
+    string->obj.type = OBJ_STRING;
+    string->obj.is_marked = true;
+    string->obj.next = NULL;
+    string->length = length;
+    string->is_constant = false;
+    string->is_interned = true;
+    string->hash = hash;
+    string->chars = string->bytes;
+    memcpy(string->bytes, chars, length);
+    string->bytes[length] = '\0';
+    return string;
+}
+
+// The string is made before it is published, the swap releases its bytes
+// to the acquiring loads of other threads. A count of the strings made,
+// not of the slots filled, keeps the table below max_count and every
+// probe ends at an empty slot.
+ObjString* sharedStringsIntern(SharedStrings* shared, const char* chars, int length, uint32_t hash) {
+    ObjString* made = NULL;
+    uint32_t mask = (uint32_t)shared->capacity - 1;
+    for (uint32_t index = hash & mask;; index = (index + 1) & mask) {
+        SharedSlot* slot = &shared->slots[index];
+        ObjString* string = atomic_load_explicit(&slot->string, memory_order_acquire);
+        if (string == NULL) {
+            if (made == NULL) {
+                if (atomic_fetch_add_explicit(&shared->count, 1, memory_order_relaxed) >= shared->max_count ||
+                    (made = newSharedString(chars, length, hash)) == NULL)
+                {
+                    atomic_fetch_sub_explicit(&shared->count, 1, memory_order_relaxed);
+                    return NULL;
+                }
+            }
+            if (atomic_compare_exchange_strong_explicit(&slot->string, &string, made,
+                memory_order_acq_rel, memory_order_acquire))
+            {
+                atomic_store_explicit(&slot->hash, hash, memory_order_relaxed);
+                return made;
+            }
+            // another thread claimed the slot, string is what it put there
+        }
+
+        if (isString(slot, string, chars, length, hash)) {
+            if (made != NULL) {
+                // it added the same string first
+                free(made);
+                atomic_fetch_sub_explicit(&shared->count, 1, memory_order_relaxed);
+            }
+            return string;
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#ifndef clox_shared_strings_h
+#define clox_shared_strings_h
+
+#include <stdatomic.h>
+
+#include "common/common.h"
+#include "common/value/value.h"
+
+// A process-wide intern table that VMs on any thread may share, see
+// shareStrings() in vm/vm.h. Strings only ever go in: a slot is claimed
+// once with a compare-and-swap and never changes again, so a lookup is a
+// probe of plain loads without a lock. The strings it holds own their
+// bytes, were allocated with malloc rather than by a VM and live until the
+// table is freed. A VM's collector finds them marked already and never
+// frees them, and being outside every nursery they never move.
+//
+// Linear probing over a fixed power of two capacity. A table that is 3/4
+// full takes no more strings, interning then falls back to the VM's own
+// vm->strings.
+typedef struct {
+    _Atomic(ObjString*) string; // NULL for an empty slot
+    // the string's hash, stored after the string by the thread that put it
+    // there; 0 until then, when a probe has to read the string itself
+    atomic_uint hash;
+} SharedSlot;
+
+typedef struct {
+    // every string of the table is hashed with this, a VM that shares the
+    // table hashes with it too
+    uint64_t hash_state;
+    int capacity;
+    int max_count;
+    atomic_int count;   // slots claimed or about to be
+    SharedSlot* slots;
+} SharedStrings;
+
+// capacity is rounded up to a power of two, false when out of memory
+bool initSharedStrings(SharedStrings* shared, int capacity, uint64_t hash_state);
+// frees every string of the table, no VM may still use one
+void freeSharedStrings(SharedStrings* shared);
+ObjString* sharedStringsFind(SharedStrings* shared, const char* chars, int length, uint32_t hash);
+// the string equal to chars, added by this call or an earlier one on any
+// thread; NULL when the table is full or out of memory
+ObjString* sharedStringsIntern(SharedStrings* shared, const char* chars, int length, uint32_t hash);
+
+#endif // !clox_shared_strings_h
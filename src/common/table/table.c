@@ -1,115 +1,203 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
 #include "common/memory/memory.h"
 #include "common/object/object.h"
 #include "table.h"
 
-#define TABLE_MAX_LOAD 0.75
+// used and deleted slots together stay below 7/8 of the capacity
+#define TABLE_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// a bit per slot of a group
+typedef uint32_t GroupMask;
 
 void initTable(Table* table) {
     table->count = 0;
+    table->deleted = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->control = NULL;
 }
 
-void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+static size_t tableBytes(int capacity) {
+    return (sizeof(Entry) + sizeof(int8_t)) * (size_t)capacity;
+}
+
+void freeTable(VM* vm, Table* table) {
+    FREE_ARRAY(vm, uint8_t, table->entries, tableBytes(table->capacity), MEMORY_TABLES);
     initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-    uint32_t index = key->hash % capacity;
-    Entry* tombstone = NULL;
+// The hash picks the first group with its high bits and the control byte
+// with its low 7. Groups are then probed 1, 2, 3, ... groups apart, which
+// visits every group of a power of two count. The load factor keeps empty
+// slots around, and a group with one ends the probe: no key was placed
+// past it.
+typedef struct {
+    uint32_t group;
+    uint32_t step;
+    uint32_t mask;
+} Probe;
+
+static int8_t hashFragment(uint32_t hash) {
+    return (int8_t)(hash & 0x7f);
+}
+static Probe startProbe(uint32_t hash, int capacity) {
+    uint32_t mask = (uint32_t)capacity / TABLE_GROUP_SIZE - 1;
+    return (Probe){(hash >> 7) & mask, 0, mask};
+}
+static int probeBase(Probe* probe) {
+    return (int)probe->group * TABLE_GROUP_SIZE;
+}
+static void nextGroup(Probe* probe) {
+    probe->step++;
+    probe->group = (probe->group + probe->step) & probe->mask;
+}
 
-    for (;;) {
-        Entry* entry = &entries[index];
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // empty entry
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else {
-                // found a tombstone
-                if (tombstone == NULL) tombstone = entry;
-            }
-        }
-        else if (entry->key == key) {
-            // found the key
-            return entry;
+#ifdef __SSE2__
+static GroupMask matchByte(const int8_t* group, int8_t byte) {
+    __m128i control = _mm_loadu_si128((const __m128i*)group);
+    return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+}
+// empty and deleted slots are the control bytes with the high bit set
+static GroupMask matchFree(const int8_t* group) {
+    return (GroupMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#else
+static GroupMask matchByte(const int8_t* group, int8_t byte) {
+    GroupMask mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; ++i) {
+        if (group[i] == byte) mask |= (GroupMask)1 << i;
+    }
+    return mask;
+}
+static GroupMask matchFree(const int8_t* group) {
+    GroupMask mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; ++i) {
+        if (group[i] < 0) mask |= (GroupMask)1 << i;
+    }
+    return mask;
+}
+#endif // __SSE2__
+
+static int lowestSlot(GroupMask mask) {
+    return __builtin_ctz(mask);
+}
+
+// index of key's slot or -1
+static int findSlot(Table* table, ObjString* key) {
+    if (table->count == 0) return -1;
+
+    int8_t fragment = hashFragment(key->hash);
+    for (Probe probe = startProbe(key->hash, table->capacity);; nextGroup(&probe)) {
+        int base = probeBase(&probe);
+        const int8_t* group = table->control + base;
+        for (GroupMask match = matchByte(group, fragment); match != 0; match &= match - 1) {
+            int index = base + lowestSlot(match);
+            if (table->entries[index].key == key) return index;
         }
+        if (matchByte(group, TABLE_EMPTY) != 0) return -1;
+    }
+}
+
+// first empty or deleted slot of hash's probe sequence
+static int findFreeSlot(int8_t* control, int capacity, uint32_t hash) {
+    for (Probe probe = startProbe(hash, capacity);; nextGroup(&probe)) {
+        int base = probeBase(&probe);
+        GroupMask free = matchFree(control + base);
+        if (free != 0) return base + lowestSlot(free);
+    }
+}
 
-        index = (index + 1) % capacity;
+// a slot whose group still has an empty slot was never probed past, it
+// can become empty again instead of a tombstone
+static void clearSlot(Table* table, int index) {
+    int base = index - index % TABLE_GROUP_SIZE;
+    if (matchByte(table->control + base, TABLE_EMPTY) != 0) {
+        table->control[index] = TABLE_EMPTY;
     }
+    else {
+        table->control[index] = TABLE_DELETED;
+        table->deleted++;
+    }
+    table->count--;
 }
 
 // deletion with tombstones
 bool tableDelete(Table* table, ObjString* key) {
-    if (table->count == 0) return false;
-
-    // find the entry
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = findSlot(table, key);
+    if (index == -1) return false;
 
-    // place a tombstone in the entry
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    clearSlot(table, index);
     return true;
 }
 
 bool tableGet(Table* table, ObjString* key, Value* value) {
-    if (table->count == 0) return false;
-
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = findSlot(table, key);
+    if (index == -1) return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
-static void adjustCapacity(Table* table, int capacity) {
-    Entry* entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; ++i) {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
+// Entries and control bytes are one allocation, running out of memory
+// leaves the table as it was. Tombstones are dropped on the way.
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+    Entry* entries = (Entry*)ALLOCATE(vm, uint8_t, tableBytes(capacity), MEMORY_TABLES);
+    int8_t* control = (int8_t*)(entries + capacity);
+    memset(control, TABLE_EMPTY, capacity);
 
-    table->count = 0;
     for (int i = 0; i < table->capacity; ++i) {
-        Entry* entry = &table->entries[i];
-        if (entry->key == NULL) continue;
+        if (!isTableSlotUsed(table, i)) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        Entry* entry = &table->entries[i];
+        int index = findFreeSlot(control, capacity, entry->hash);
+        control[index] = table->control[i];
+        entries[index] = *entry;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, uint8_t, table->entries, tableBytes(table->capacity), MEMORY_TABLES);
     table->entries = entries;
+    table->control = control;
     table->capacity = capacity;
+    table->deleted = 0;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
+    int index = findSlot(table, key);
+    if (index != -1) {
+        table->entries[index].value = value;
+        return false;
     }
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
-    if (is_new_key && IS_NIL(entry->value)) table->count++;
+    if (table->count + table->deleted + 1 > TABLE_MAX_LOAD(table->capacity)) {
+        // mostly tombstones only need a rehash in place
+        int capacity = table->capacity;
+        if (capacity == 0) {
+            capacity = TABLE_GROUP_SIZE;
+        }
+        else if (table->count + 1 > TABLE_MAX_LOAD(capacity) / 2) {
+            capacity *= 2;
+        }
+        adjustCapacity(vm, table, capacity);
+    }
 
-    entry->key = key;
-    entry->value = value;
-    return is_new_key;
+    index = findFreeSlot(table->control, table->capacity, key->hash);
+    if (table->control[index] == TABLE_DELETED) table->deleted--;
+    table->control[index] = hashFragment(key->hash);
+    table->entries[index] = (Entry){key, key->hash, value};
+    table->count++;
+    return true;
 }
 
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(VM* vm, Table* from, Table* to) {
     for (int i = 0; i < from->capacity; ++i) {
-        Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+        if (isTableSlotUsed(from, i)) {
+            tableSet(vm, to, from->entries[i].key, from->entries[i].value);
         }
     }
 }
@@ -117,21 +205,20 @@ void tableAddAll(Table* from, Table* to) {
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash) {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash % table->capacity;
-    for (;;) {
-        Entry* entry = &table->entries[index];
-        if (entry->key == NULL) {
-            // stop if we find an empty non-tombstone entry
-            if (IS_NIL(entry->value)) return NULL;
-        }
-        else if (entry->key->length == length &&
-            entry->key->hash == hash &&
-            memcmp(entry->key->chars, chars, length) == 0)
-        {
-            // found it
-            return entry->key;
+    int8_t fragment = hashFragment(hash);
+    for (Probe probe = startProbe(hash, table->capacity);; nextGroup(&probe)) {
+        int base = probeBase(&probe);
+        const int8_t* group = table->control + base;
+        for (GroupMask match = matchByte(group, fragment); match != 0; match &= match - 1) {
+            Entry* entry = &table->entries[base + lowestSlot(match)];
+            if (entry->hash == hash && entry->key->length == length &&
+                memcmp(entry->key->chars, chars, length) == 0)
+            {
+                // found it
+                return entry->key;
+            }
         }
-
-        index = (index + 1) % table->capacity;
+        // stop at a group with an empty slot
+        if (matchByte(group, TABLE_EMPTY) != 0) return NULL;
     }
 }
\ No newline at end of file
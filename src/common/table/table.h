@@ -4,23 +4,43 @@
 #include "common/common.h"
 #include "common/value/value.h"
 
+// slots are probed a group at a time
+#define TABLE_GROUP_SIZE 16
+
+// control bytes, a used slot holds the low 7 bits of its key's hash
+#define TABLE_EMPTY ((int8_t)-128)
+#define TABLE_DELETED ((int8_t)-2)
+
 typedef struct {
     ObjString* key;
+    // key's hash, a resize or a lookup by characters reads no keys for it
+    uint32_t hash;
     Value value;
 } Entry;
 
+// Open addressing over groups of TABLE_GROUP_SIZE slots. Every slot has a
+// control byte that says whether it is empty, deleted or used, and for a
+// used one which hash fragment its key has, so a probe compares a whole
+// group of control bytes at once and only reads the entries they match.
+// The capacity is 0 or a power of two that is at least one group.
 typedef struct {
-    int count;
+    int count;      // used slots
+    int deleted;    // tombstones
     int capacity;
-    Entry* entries;
+    Entry* entries; // capacity entries, followed by capacity control bytes
+    int8_t* control;
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(VM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
+static inline bool isTableSlotUsed(Table* table, int index) {
+    return table->control[index] >= 0;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,154 @@
+#include <stdlib.h>
+
+#include "task_pool.h"
+
+// what take and steal return when they got no task
+#define TASK_NONE -1
+// a steal that lost the race for the top task, worth retrying
+#define TASK_RETRY -2
+
+static bool initDeque(TaskDeque* deque, long capacity) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    deque->capacity = capacity > 0 ? capacity : 1;
+    deque->tasks = (atomic_int*)malloc(sizeof(atomic_int) * deque->capacity);
+    return deque->tasks != NULL;
+}
+
+static void freeDeque(TaskDeque* deque) {
+    free(deque->tasks);
+    deque->tasks = NULL;
+}
+
+// owner only, the capacity is never exceeded since every task is pushed
+// once before the workers start
+static void pushTask(TaskDeque* deque, int task) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    atomic_store_explicit(&deque->tasks[bottom % deque->capacity], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+// owner only, newest task first
+static int takeTask(TaskDeque* deque) {
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        // empty, undo the reservation
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return TASK_NONE;
+    }
+
+    int task = atomic_load_explicit(&deque->tasks[bottom % deque->capacity], memory_order_relaxed);
+    if (top == bottom) {
+        // the last task, a thief may be after it too
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        {
+            task = TASK_NONE;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+// any thread, oldest task first
+static int stealTask(TaskDeque* deque) {
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) return TASK_NONE;
+
+    int task = atomic_load_explicit(&deque->tasks[top % deque->capacity], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+        memory_order_seq_cst, memory_order_relaxed))
+    {
+        return TASK_RETRY;
+    }
+    return task;
+}
+
+// No task is added once the workers run, so a worker that finds every
+// deque empty is done.
+static int nextTask(TaskPool* pool, int worker) {
+    int task = takeTask(&pool->deques[worker]);
+    while (task == TASK_NONE) {
+        bool contended = false;
+        for (int i = 1; i < pool->worker_count; ++i) {
+            task = stealTask(&pool->deques[(worker + i) % pool->worker_count]);
+            if (task >= 0) return task;
+            if (task == TASK_RETRY) contended = true;
+        }
+        if (!contended) return TASK_NONE;
+        task = TASK_NONE;
+    }
+    return task;
+}
+
+static void* runWorker(void* argument) {
+    TaskWorker* worker = (TaskWorker*)argument;
+    TaskPool* pool = worker->pool;
+    for (int task = nextTask(pool, worker->index); task != TASK_NONE;
+        task = nextTask(pool, worker->index))
+    {
+        pool->task(pool->context, worker->index, task);
+    }
+    return NULL;
+}
+
+static void freeTaskPool(TaskPool* pool) {
+    if (pool->deques != NULL) {
+        for (int i = 0; i < pool->worker_count; ++i) freeDeque(&pool->deques[i]);
+    }
+    free(pool->deques);
+    free(pool->workers);
+    pool->deques = NULL;
+    pool->workers = NULL;
+}
+
+bool startTaskPool(TaskPool* pool, int worker_count, int task_count, TaskFn task, void* context) {
+    pool->task = task;
+    pool->context = context;
+    pool->worker_count = worker_count;
+    pool->started = 0;
+    pool->workers = (TaskWorker*)malloc(sizeof(TaskWorker) * worker_count);
+    pool->deques = (TaskDeque*)calloc(worker_count, sizeof(TaskDeque));
+    if (pool->workers == NULL || pool->deques == NULL) {
+        freeTaskPool(pool);
+        return false;
+    }
+
+    // contiguous runs keep neighbouring tasks on one worker until it steals
+    long per_worker = (task_count + worker_count - 1) / worker_count;
+    for (int i = 0; i < worker_count; ++i) {
+        if (!initDeque(&pool->deques[i], per_worker)) {
+            freeTaskPool(pool);
+            return false;
+        }
+    }
+    for (int i = task_count - 1; i >= 0; --i) {
+        // pushed backwards so that each worker takes its run in order
+        pushTask(&pool->deques[i / per_worker], i);
+    }
+
+    for (int i = 0; i < worker_count; ++i) {
+        pool->workers[i] = (TaskWorker){ pool, i, 0 };
+        if (pthread_create(&pool->workers[i].thread, NULL, runWorker, &pool->workers[i]) != 0) break;
+        pool->started++;
+    }
+    if (pool->started == 0) {
+        freeTaskPool(pool);
+        return false;
+    }
+    return true;
+}
+
+void joinTaskPool(TaskPool* pool) {
+    for (int i = 0; i < pool->started; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    freeTaskPool(pool);
+}
@@ -0,0 +1,48 @@
+#ifndef clox_task_pool_h
+#define clox_task_pool_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "common/common.h"
+
+// Runs task(context, worker, index) once for every index below a count on
+// a fixed set of worker threads. Each worker owns a work-stealing deque:
+// it takes indices from the bottom of its own and, once that is empty,
+// steals from the top of the others, so a worker stuck on a long task
+// does not hold up the ones queued behind it. worker says which thread a
+// call runs on, state the task keeps per worker is indexed by it.
+typedef void (*TaskFn)(void* context, int worker, int index);
+
+// Chase-Lev deque of task indices with a fixed capacity
+typedef struct {
+    atomic_long top;    // thieves take here
+    atomic_long bottom; // the owner pushes and takes here
+    atomic_int* tasks;
+    long capacity;
+} TaskDeque;
+
+typedef struct TaskPool TaskPool;
+
+typedef struct {
+    TaskPool* pool;
+    int index;
+    pthread_t thread;
+} TaskWorker;
+
+struct TaskPool {
+    TaskFn task;
+    void* context;
+    TaskWorker* workers;
+    TaskDeque* deques;
+    int worker_count;
+    int started;
+};
+
+// spreads the indices over the deques and starts the workers, false when
+// none could start; when only some do, they steal the tasks of the rest
+bool startTaskPool(TaskPool* pool, int worker_count, int task_count, TaskFn task, void* context);
+// waits until every task ran
+void joinTaskPool(TaskPool* pool);
+
+#endif // !clox_task_pool_h
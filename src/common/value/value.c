@@ -11,35 +11,52 @@ void initValueArray(ValueArray* array) {
     array->count = 0;
 }
 
-void writeValueArray(ValueArray* array, Value value) {
+void writeValueArray(VM* vm, ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
-        uint32_t old_capacity = array->capacity;
-        array->capacity = GROW_CAPACITY(old_capacity);
-        array->values = GROW_ARRAY(Value, array->values,
-            old_capacity, array->capacity);
+        int old_capacity = array->capacity;
+        int capacity = GROW_CAPACITY(old_capacity);
+        array->values = GROW_ARRAY(vm, Value, array->values,
+            old_capacity, capacity, MEMORY_CONSTANTS);
+        array->capacity = capacity;
     }
 
     array->values[array->count] = value;
     array->count++;
 }
 
-void freeValueArray(ValueArray* array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray* array) {
+    FREE_ARRAY(vm, Value, array->values, array->capacity, MEMORY_CONSTANTS);
     initValueArray(array);
 }
 
-void printValue(Value value) {
-    switch (value.type) { 
-    case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
-    case VAL_NIL: printf("nil"); break;
-    case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-    case VAL_OBJ: printObject(value); break;
-    default:
-        return; // unreachable
+void printValue(VM* vm, Value value) {
+    fprintValue(vm, stdout, value);
+}
+void fprintValue(VM* vm, FILE* out, Value value) {
+    if (IS_BOOL(value)) {
+        fprintf(out, AS_BOOL(value) ? "true" : "false");
+    }
+    else if (IS_NIL(value)) {
+        fprintf(out, "nil");
+    }
+    else if (IS_NUMBER(value)) {
+        fprintf(out, "%g", AS_NUMBER(value));
+    }
+    else if (IS_OBJ(value)) {
+        printObject(vm, out, value);
     }
 }
 
-bool valuesEqual(Value a, Value b) {
+bool valuesEqual(VM* vm, Value a, Value b) {
+    if (IS_ANY_STRING(a) && IS_ANY_STRING(b)) return stringsEqual(vm, a, b);
+
+#ifdef CLOX_NAN_BOXING
+    // compare numbers as doubles so that NaN != NaN
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b;
+#else
     if (a.type != b.type) return false;
     switch (a.type) {
     case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
@@ -48,4 +65,5 @@ bool valuesEqual(Value a, Value b) {
     case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
     default: return false; // unreachable
     }
+#endif // CLOX_NAN_BOXING
 }
\ No newline at end of file
@@ -3,20 +3,16 @@
 #include <string.h>
 
 #include "compiler.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "common/memory/memory.h"
 #include "common/object/object.h"
+#include "vm/vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug/debug.h"
 #endif // DEBUG_PRINT_CODE
 
-typedef struct {
-    Token current;
-    Token previous;
-    bool had_error;
-    bool panic_mode;
-} Parser;
-
 typedef enum {
     PREC_NONE,
     PREC_ASSIGNMENT, // =
@@ -31,7 +27,9 @@ typedef enum {
     PREC_PRIMARY
 } Precedence;
 
-typedef void(*ParseFn)(bool can_assign);
+typedef struct Parser Parser;
+
+typedef void(*ParseFn)(Parser* parser, bool can_assign);
 
 typedef struct {
     ParseFn prefix;
@@ -48,202 +46,224 @@ typedef struct {
     Local locals[UINT8_COUNT];
     int local_count;
     int scope_depth;
+    // first byte of the left operand of the infix rule being compiled
+    int operand_start;
+    // highest offset a forward jump has been patched to, code before it
+    // can be rewritten without breaking any jump
+    int last_jump_target;
 } Compiler;
 
-static Parser parser;
-static Compiler* current = NULL;
-static Chunk* compiling_chunk;
+// everything one compile works on, compiles of different VMs can run at
+// the same time
+struct Parser {
+    VM* vm;
+    Scanner scanner;
+    Token current;
+    Token previous;
+    bool had_error;
+    bool panic_mode;
+    Compiler* compiler;
+    Chunk* chunk;
+    bool copy_strings;
+};
 
-static Chunk* currentChunk() {
-    return compiling_chunk;
+// interns characters of the source, see compile()
+static ObjString* sourceString(Parser* parser, const char* chars, int length) {
+    if (parser->copy_strings) return copyString(parser->vm, chars, length);
+    return constantString(parser->vm, chars, length);
 }
 
-static void errorAt(Token* token, const char* message) {
-    if (parser.panic_mode) return;
-    parser.panic_mode = true;
+static Chunk* currentChunk(Parser* parser) {
+    return parser->chunk;
+}
+
+static void errorAt(Parser* parser, Token* token, const char* message) {
+    if (parser->panic_mode) return;
+    parser->panic_mode = true;
 
-    fprintf(stderr, "[line %d] Error", token->line);
+    fprintf(parser->vm->err, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
+        fprintf(parser->vm->err, " at end");
     }
     else if (token->type == TOKEN_ERROR) {
         // nothing
     }
     else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(parser->vm->err, " at '%.*s'", token->length, token->start);
     }
 
-    fprintf(stderr, ": %s\n", message);
-    parser.had_error = true;
+    fprintf(parser->vm->err, ": %s\n", message);
+    parser->had_error = true;
 }
-static void error(const char* message) {
-    errorAt(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+    errorAt(parser, &parser->previous, message);
 }
-static void errorAtCurrent(const char* message) {
-    errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+    errorAt(parser, &parser->current, message);
 }
 
-static void advance() {
-    parser.previous = parser.current;
+static void advance(Parser* parser) {
+    parser->previous = parser->current;
 
     for (;;) {
-        parser.current = scanToken();
-        if (parser.current.type != TOKEN_ERROR) break;
+        parser->current = scanToken(&parser->scanner);
+        if (parser->current.type != TOKEN_ERROR) break;
 
-        errorAtCurrent(parser.current.start);
+        errorAtCurrent(parser, parser->current.start);
     }
 }
 
-static void consume(TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+    if (parser->current.type == type) {
+        advance(parser);
         return;
     }
 
-    errorAtCurrent(message);
+    errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type) {
-    return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+    return parser->current.type == type;
 }
 
-static bool match(TokenType type) {
-    if (!check(type)) return false;
-    advance();
+static bool match(Parser* parser, TokenType type) {
+    if (!check(parser, type)) return false;
+    advance(parser);
     return true;
 }
 
-static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+    writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
+}
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+    emitByte(parser, byte1);
+    emitByte(parser, byte2);
 }
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-    emitByte(byte1);
-    emitByte(byte2);
+static void emitShort(Parser* parser, uint16_t value) {
+    emitByte(parser, (value >> 8) & 0xff);
+    emitByte(parser, value & 0xff);
 }
-static void emitLoop(int loop_start) {
-    emitByte(OP_LOOP);
+static void emitLoop(Parser* parser, int loop_start) {
+    emitByte(parser, OP_LOOP);
 
-    int offset = currentChunk()->count - loop_start + 2;
-    if (offset > UINT16_MAX) error("Loop body too large.");
+    int offset = currentChunk(parser)->count - loop_start + 2;
+    if (offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-    emitByte((offset >> 8) & 0xff);
-    emitByte(offset & 0xff);
+    emitByte(parser, (offset >> 8) & 0xff);
+    emitByte(parser, offset & 0xff);
 }
-static int emitJump(uint8_t instruction) {
-    emitByte(instruction);
-    emitByte(0xff);
-    emitByte(0xff);
-    return currentChunk()->count - 2;
+static int emitJump(Parser* parser, uint8_t instruction) {
+    emitByte(parser, instruction);
+    emitByte(parser, 0xff);
+    emitByte(parser, 0xff);
+    return currentChunk(parser)->count - 2;
 }
 
-static void emitReturn() {
-    emitByte(OP_RETURN);
+static void emitReturn(Parser* parser) {
+    emitByte(parser, OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
-    uint16_t constant_id = addConstant(currentChunk(), value);
-    if (constant_id > UINT8_MAX) {
-        error("Too many constants in one chunk.");
+static uint16_t makeConstantLong(Parser* parser, Value value) {
+    if (currentChunk(parser)->constants.count == UINT16_COUNT) {
+        error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant_id;
-}
-static uint16_t makeConstantLong(Value value) {
-    uint16_t constant_id = addConstant(currentChunk(), value);
-    if (constant_id > UINT16_MAX) {
-        error("Too many constants in one chunk.");
-        return 0;
-    }
-
-    return constant_id;
+    return addConstant(parser->vm, currentChunk(parser), value);
 }
 
-static void emitConstant(Value value) {
-    uint16_t constant_id = makeConstantLong(value);
+static void emitConstant(Parser* parser, Value value) {
+    uint16_t constant_id = makeConstantLong(parser, value);
     if (constant_id <= UINT8_MAX) {
-        emitByte(OP_CONSTANT);
-        emitByte((uint8_t)constant_id);
+        emitByte(parser, OP_CONSTANT);
+        emitByte(parser, (uint8_t)constant_id);
     }
-    else if (constant_id < UINT16_MAX) {
-        emitByte(OP_CONSTANT_LONG);
+    else {
+        emitByte(parser, OP_CONSTANT_LONG);
         uint8_t* bytes = (uint8_t*)&constant_id;
-        emitByte(bytes[0]);
-        emitByte(bytes[1]);
+        emitByte(parser, bytes[0]);
+        emitByte(parser, bytes[1]);
     }
 }
 
-static void patchJump(int offset) {
+static void patchJump(Parser* parser, int offset) {
     // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = currentChunk()->count - offset - 2;
+    int jump = currentChunk(parser)->count - offset - 2;
 
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        error(parser, "Too much code to jump over.");
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset + 1] = jump & 0xff;
+    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+    currentChunk(parser)->code[offset + 1] = jump & 0xff;
+    parser->compiler->last_jump_target = currentChunk(parser)->count;
 }
 
-static void initCompiler(Compiler* compiler) {
+static void initCompiler(Parser* parser, Compiler* compiler) {
     compiler->local_count = 0;
     compiler->scope_depth = 0;
-    current = compiler;
+    compiler->operand_start = 0;
+    compiler->last_jump_target = -1;
+    parser->compiler = compiler;
 }
 
-static void endCompiler() {
-    emitReturn();
+static void endCompiler(Parser* parser) {
+    emitReturn(parser);
+
+    if (!parser->had_error) {
+        optimizeChunk(parser->vm, currentChunk(parser), parser->vm->optimize_level);
+    }
 
 #ifdef DEBUG_PRINT_CODE
-    if (!parser.had_error) {
-        disassebleChunk(currentChunk(), "code");
+    if (!parser->had_error) {
+        disassebleChunk(parser->vm, currentChunk(parser), "code");
     }
 #endif // DEBUG_PRINT_CODE
 }
 
-static void beginScope() {
-    current->scope_depth++;
+static void beginScope(Parser* parser) {
+    parser->compiler->scope_depth++;
 }
-static void endScope() {
-    current->scope_depth--;
+static void endScope(Parser* parser) {
+    parser->compiler->scope_depth--;
 
-    while (current->local_count > 0 &&
-        current->locals[current->local_count - 1].depth > current->scope_depth)
+    while (parser->compiler->local_count > 0 &&
+        parser->compiler->locals[parser->compiler->local_count - 1].depth > parser->compiler->scope_depth)
     {
-        emitByte(OP_POP);
-        current->local_count--;
+        emitByte(parser, OP_POP);
+        parser->compiler->local_count--;
     }
 }
 
-static void parsePrecedence(Precedence precedence);
-static void expression();
-static uint8_t identifierConstant(Token* name);
+static void parsePrecedence(Parser* parser, Precedence precedence);
+static void expression(Parser* parser);
+static uint16_t identifierSlot(Parser* parser, Token* name);
 static bool identifiersEqual(Token* a, Token* b);
-static void statement();
-static void declaration();
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
 
-static void grouping(bool can_assign) {
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool can_assign) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool can_assign) {
-    double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool can_assign) {
+    double value = strtod(parser->previous.start, NULL);
+    emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void string(bool can_assign) {
-    emitConstant(OBJ_VAL(constantString(parser.previous.start + 1, parser.previous.length - 2)));
+static void string(Parser* parser, bool can_assign) {
+    emitConstant(parser, OBJ_VAL(sourceString(parser, parser->previous.start + 1, parser->previous.length - 2)));
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
     for (int i = compiler->local_count - 1; i >= 0; i--) {
         Local* local = &compiler->locals[i];
         if (identifiersEqual(name, &local->name)) {
             if (local->depth == -1) {
-                error("Can't read local variable in its own initializer.");
+                error(parser, "Can't read local variable in its own initializer.");
             }
             return i;
         }
@@ -252,93 +272,405 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1;
 }
 
-static void namedVariable(Token name, bool can_assign) {
+static void namedVariable(Parser* parser, Token name, bool can_assign) {
     uint8_t get_op, set_op;
-    int arg = resolveLocal(current, &name);
+    bool is_global = false;
+    int arg = resolveLocal(parser, parser->compiler, &name);
     if (arg != -1) {
         get_op = OP_GET_LOCAL;
         set_op = OP_SET_LOCAL;
     }
     else {
-        arg = identifierConstant(&name);
+        arg = identifierSlot(parser, &name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
+        is_global = true;
     }
 
-    if (can_assign && match(TOKEN_EQUAL)) {
-        expression();
-        emitBytes(set_op, (uint8_t)arg);
+    uint8_t op = get_op;
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        expression(parser);
+        op = set_op;
+    }
+
+    // global slots are 16 bit wide, local slots fit in a byte
+    emitByte(parser, op);
+    if (is_global) {
+        emitShort(parser, (uint16_t)arg);
     }
     else {
-        emitBytes(get_op, (uint8_t)arg);
+        emitByte(parser, (uint8_t)arg);
+    }
+}
+
+static void variable(Parser* parser, bool can_assign) {
+    namedVariable(parser, parser->previous, can_assign);
+}
+
+// Constant folding works on the code just emitted: an operand that
+// compiled to a single constant load in [start, end) is read back, and
+// the operator's result replaces the operands' code.
+
+static bool constantOperand(Parser* parser, int start, int end, Value* value) {
+    Chunk* chunk = currentChunk(parser);
+    if (start >= end || start + instructionSize(chunk, start) != end) {
+        return false;
+    }
+
+    switch (chunk->code[start]) {
+    case OP_CONSTANT:
+        *value = chunk->constants.values[chunk->code[start + 1]];
+        return true;
+    case OP_CONSTANT_LONG: {
+        uint16_t constant_id;
+        uint8_t* bytes = (uint8_t*)&constant_id;
+        bytes[0] = chunk->code[start + 1];
+        bytes[1] = chunk->code[start + 2];
+        *value = chunk->constants.values[constant_id];
+        return true;
+    }
+    case OP_NIL: *value = NIL_VAL; return true;
+    case OP_TRUE: *value = BOOL_VAL(true); return true;
+    case OP_FALSE: *value = BOOL_VAL(false); return true;
+    default: return false;
+    }
+}
+
+// gives the constant pool slot of a folded operand back if nothing
+// was added after it
+static void releaseConstant(Parser* parser, int start) {
+    Chunk* chunk = currentChunk(parser);
+    int constant_id = -1;
+    if (chunk->code[start] == OP_CONSTANT) {
+        constant_id = chunk->code[start + 1];
+    }
+    else if (chunk->code[start] == OP_CONSTANT_LONG) {
+        uint16_t long_id;
+        uint8_t* bytes = (uint8_t*)&long_id;
+        bytes[0] = chunk->code[start + 1];
+        bytes[1] = chunk->code[start + 2];
+        constant_id = long_id;
+    }
+
+    if (constant_id != -1 && constant_id == chunk->constants.count - 1) {
+        chunk->constants.count--;
+    }
+}
+
+static void emitFolded(Parser* parser, int start, Value value) {
+    truncateChunk(currentChunk(parser), start);
+
+    if (IS_NIL(value)) {
+        emitByte(parser, OP_NIL);
+    }
+    else if (IS_BOOL(value)) {
+        emitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    }
+    else {
+        emitConstant(parser, value);
+    }
+}
+
+// offset of the last instruction in [start, end), the one whose result
+// the range leaves on the stack unless a jump lands at end
+static int lastInstruction(Parser* parser, int start, int end) {
+    int last = -1;
+    for (int offset = start; offset < end;
+        offset += instructionSize(currentChunk(parser), offset))
+    {
+        last = offset;
+    }
+    return last;
+}
+
+static bool isFalseyConstant(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool foldUnary(Parser* parser, TokenType operator_type, int operand_start) {
+    int end = currentChunk(parser)->count;
+
+    Value operand;
+    if (constantOperand(parser, operand_start, end, &operand)) {
+        if (operator_type == TOKEN_MINUS && !IS_NUMBER(operand)) return false;
+
+        if (operator_type == TOKEN_BANG) {
+            releaseConstant(parser, operand_start);
+            emitFolded(parser, operand_start, BOOL_VAL(isFalseyConstant(operand)));
+        }
+        else {
+            releaseConstant(parser, operand_start);
+            emitFolded(parser, operand_start, NUMBER_VAL(-AS_NUMBER(operand)));
+        }
+        return true;
+    }
+
+    // !!x and --x cancel out when x is known to be a bool or a number
+    uint8_t inner_op = operator_type == TOKEN_BANG ? OP_NOT : OP_NEGATE;
+    int inner = lastInstruction(parser, operand_start, end);
+    if (inner == -1 || currentChunk(parser)->code[inner] != inner_op) return false;
+
+    int producer = lastInstruction(parser, operand_start, inner);
+    if (producer == -1 || parser->compiler->last_jump_target > producer) return false;
+
+    switch (currentChunk(parser)->code[producer]) {
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT:
+        if (operator_type != TOKEN_BANG) return false;
+        break;
+    case OP_SUBTRACT:
+    case OP_MULTILPY:
+    case OP_DIVIDE:
+    case OP_NEGATE:
+        if (operator_type != TOKEN_MINUS) return false;
+        break;
+    default:
+        return false;
+    }
+
+    truncateChunk(currentChunk(parser), inner);
+    return true;
+}
+
+static ObjString* concatenateConstants(Parser* parser, ObjString* a, ObjString* b) {
+    ObjString* result = reserveString(parser->vm, a->length + b->length);
+    memcpy(result->bytes, a->chars, a->length);
+    memcpy(result->bytes + a->length, b->chars, b->length);
+    return takeString(parser->vm, result);
+}
+
+static bool foldBinary(Parser* parser, TokenType operator_type, int lhs_start, int rhs_start) {
+    Value a, b;
+    if (!constantOperand(parser, lhs_start, rhs_start, &a) ||
+        !constantOperand(parser, rhs_start, currentChunk(parser)->count, &b))
+    {
+        return false;
     }
+
+    Value result;
+    bool numbers = IS_NUMBER(a) && IS_NUMBER(b);
+    switch (operator_type) {
+    case TOKEN_BANG_EQUAL: result = BOOL_VAL(!valuesEqual(parser->vm, a, b)); break;
+    case TOKEN_EQUAL_EQUAL: result = BOOL_VAL(valuesEqual(parser->vm, a, b)); break;
+    case TOKEN_PLUS:
+        if (numbers) {
+            result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+        }
+        else if (IS_STRING(a) && IS_STRING(b)) {
+            result = OBJ_VAL(concatenateConstants(parser, AS_STRING(a), AS_STRING(b)));
+        }
+        else {
+            return false;
+        }
+        break;
+    default: {
+        // the rest only accept numbers, leave type errors to the runtime
+        if (!numbers) return false;
+
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        switch (operator_type) {
+        case TOKEN_GREATER: result = BOOL_VAL(x > y); break;
+        case TOKEN_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;
+        case TOKEN_LESS: result = BOOL_VAL(x < y); break;
+        case TOKEN_LESS_EQUAL: result = BOOL_VAL(!(x > y)); break;
+        case TOKEN_MINUS: result = NUMBER_VAL(x - y); break;
+        case TOKEN_STAR: result = NUMBER_VAL(x * y); break;
+        case TOKEN_SLASH: result = NUMBER_VAL(x / y); break;
+        default: return false; // unreachable
+        }
+    } break;
+    }
+
+    releaseConstant(parser, rhs_start);
+    releaseConstant(parser, lhs_start);
+    emitFolded(parser, lhs_start, result);
+    return true;
 }
 
-static void variable(bool can_assign) {
-    namedVariable(parser.previous, can_assign);
+// local + constant and local - constant become one instruction
+static bool fuseLocalConstant(Parser* parser, TokenType operator_type, int lhs_start, int rhs_start) {
+    if (operator_type != TOKEN_PLUS && operator_type != TOKEN_MINUS) return false;
+
+    Chunk* chunk = currentChunk(parser);
+    if (chunk->code[lhs_start] != OP_GET_LOCAL || lhs_start + 2 != rhs_start ||
+        chunk->code[rhs_start] != OP_CONSTANT || rhs_start + 2 != chunk->count)
+    {
+        return false;
+    }
+
+    uint8_t slot = chunk->code[lhs_start + 1];
+    uint8_t constant = chunk->code[rhs_start + 1];
+    truncateChunk(chunk, lhs_start);
+    emitByte(parser, operator_type == TOKEN_PLUS ? OP_ADD_LOCAL_CONSTANT : OP_SUBTRACT_LOCAL_CONSTANT);
+    emitBytes(parser, slot, constant);
+    return true;
 }
 
-static void unary(bool can_assign) {
-    TokenType operator_type = parser.previous.type;
+// Emits the jump over a statement guarded by the condition compiled from
+// condition_start. A comparison that ends the condition is fused into
+// the jump, which then consumes its operands. Otherwise the condition
+// stays on the stack for OP_JUMP_IF_FALSE and is popped on both paths.
+static int emitConditionJump(Parser* parser, int condition_start) {
+    Chunk* chunk = currentChunk(parser);
+    int comparison = lastInstruction(parser, condition_start, chunk->count);
+    bool negated = false;
+    if (comparison != -1 && chunk->code[comparison] == OP_NOT) {
+        comparison = lastInstruction(parser, condition_start, comparison);
+        negated = true;
+    }
+
+    int fused = -1;
+    if (comparison != -1 && parser->compiler->last_jump_target <= comparison) {
+        switch (chunk->code[comparison]) {
+        case OP_LESS: fused = negated ? OP_JUMP_IF_LESS : OP_JUMP_IF_NOT_LESS; break;
+        case OP_GREATER: fused = negated ? OP_JUMP_IF_GREATER : OP_JUMP_IF_NOT_GREATER; break;
+        case OP_EQUAL: fused = negated ? OP_JUMP_IF_EQUAL : OP_JUMP_IF_NOT_EQUAL; break;
+        default: break;
+        }
+    }
+
+    if (fused != -1) {
+        truncateChunk(chunk, comparison);
+        return emitJump(parser, (uint8_t)fused);
+    }
+
+    int jump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    return jump;
+}
+
+static void patchConditionJump(Parser* parser, int offset) {
+    patchJump(parser, offset);
+    if (currentChunk(parser)->code[offset - 1] == OP_JUMP_IF_FALSE) {
+        emitByte(parser, OP_POP);
+    }
+}
+
+// pops the value of an expression statement, a store that ends the
+// expression takes the pop over
+static void emitExpressionPop(Parser* parser, int expression_start) {
+    Chunk* chunk = currentChunk(parser);
+    int last = lastInstruction(parser, expression_start, chunk->count);
+    if (last != -1 && parser->compiler->last_jump_target <= last) {
+        if (chunk->code[last] == OP_SET_LOCAL) {
+            chunk->code[last] = OP_SET_LOCAL_POP;
+            return;
+        }
+        if (chunk->code[last] == OP_SET_GLOBAL) {
+            chunk->code[last] = OP_SET_GLOBAL_POP;
+            return;
+        }
+    }
+
+    emitByte(parser, OP_POP);
+}
+
+static void unary(Parser* parser, bool can_assign) {
+    TokenType operator_type = parser->previous.type;
+    int operand_start = currentChunk(parser)->count;
 
     // compile the operand
-    parsePrecedence(PREC_UNARY);
+    parsePrecedence(parser, PREC_UNARY);
+
+    if (foldUnary(parser, operator_type, operand_start)) return;
 
     // emit the operator instruction
     switch (operator_type) {
-    case TOKEN_BANG: emitByte(OP_NOT); break;
-    case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+    case TOKEN_BANG: emitByte(parser, OP_NOT); break;
+    case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
     default: return; // unreachable
     }
 }
 
-static void binary(bool can_assign) {
-    TokenType operator_type = parser.previous.type;
+// A chain of + leaves all its operands on the stack and adds them with
+// one OP_ADD_MANY. Only the first two can still be folded or fused, after
+// that the left operand is a sum that is not known yet.
+static void addChain(Parser* parser, int lhs_start, int rhs_start) {
+    int operands = 2;
+    for (;;) {
+        if (operands == 2 && (foldBinary(parser, TOKEN_PLUS, lhs_start, rhs_start) ||
+            fuseLocalConstant(parser, TOKEN_PLUS, lhs_start, rhs_start)))
+        {
+            operands = 1;
+        }
+        if (operands == ADD_MANY_MAX) {
+            emitBytes(parser, OP_ADD_MANY, (uint8_t)operands);
+            operands = 1;
+        }
+        if (!match(parser, TOKEN_PLUS)) break;
+
+        rhs_start = currentChunk(parser)->count;
+        parsePrecedence(parser, PREC_FACTOR);
+        operands++;
+    }
+
+    if (operands == 2) {
+        emitByte(parser, OP_ADD);
+    }
+    else if (operands > 2) {
+        emitBytes(parser, OP_ADD_MANY, (uint8_t)operands);
+    }
+}
+
+static void binary(Parser* parser, bool can_assign) {
+    TokenType operator_type = parser->previous.type;
+    int lhs_start = parser->compiler->operand_start;
+    int rhs_start = currentChunk(parser)->count;
     ParseRule* rule = getRule(operator_type);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+
+    if (operator_type == TOKEN_PLUS) {
+        addChain(parser, lhs_start, rhs_start);
+        return;
+    }
+    if (foldBinary(parser, operator_type, lhs_start, rhs_start)) return;
+    if (fuseLocalConstant(parser, operator_type, lhs_start, rhs_start)) return;
 
     switch (operator_type) {
-    case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
-    case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
-    case TOKEN_GREATER: emitByte(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-    case TOKEN_LESS: emitByte(OP_LESS); break;
-    case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
-    case TOKEN_PLUS: emitByte(OP_ADD); break;
-    case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-    case TOKEN_STAR: emitByte(OP_MULTILPY); break;
-    case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
+    case TOKEN_BANG_EQUAL: emitBytes(parser, OP_EQUAL, OP_NOT); break;
+    case TOKEN_EQUAL_EQUAL: emitByte(parser, OP_EQUAL); break;
+    case TOKEN_GREATER: emitByte(parser, OP_GREATER); break;
+    case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LESS, OP_NOT); break;
+    case TOKEN_LESS: emitByte(parser, OP_LESS); break;
+    case TOKEN_LESS_EQUAL: emitBytes(parser, OP_GREATER, OP_NOT); break;
+    case TOKEN_PLUS: emitByte(parser, OP_ADD); break;
+    case TOKEN_MINUS: emitByte(parser, OP_SUBTRACT); break;
+    case TOKEN_STAR: emitByte(parser, OP_MULTILPY); break;
+    case TOKEN_SLASH: emitByte(parser, OP_DIVIDE); break;
     default: return; // unreachable
     }
 }
 
-static void literal(bool can_assign) {
-    switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;
-    case TOKEN_TRUE: emitByte(OP_TRUE); break;
+static void literal(Parser* parser, bool can_assign) {
+    switch (parser->previous.type) {
+    case TOKEN_FALSE: emitByte(parser, OP_FALSE); break;
+    case TOKEN_NIL: emitByte(parser, OP_NIL); break;
+    case TOKEN_TRUE: emitByte(parser, OP_TRUE); break;
     default: return; // unreachable
     }
 }
 
-static void and_(bool can_assign) {
-    int end_jump = emitJump(OP_JUMP_IF_FALSE);
+static void and_(Parser* parser, bool can_assign) {
+    int end_jump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-    emitByte(OP_POP);
-    parsePrecedence(PREC_AND);
+    emitByte(parser, OP_POP);
+    parsePrecedence(parser, PREC_AND);
 
-    patchJump(end_jump);
+    patchJump(parser, end_jump);
 }
 
-static void or_(bool can_assign) {
-    int else_jump = emitJump(OP_JUMP_IF_FALSE);
-    int end_jump = emitJump(OP_JUMP);
+static void or_(Parser* parser, bool can_assign) {
+    int else_jump = emitJump(parser, OP_JUMP_IF_FALSE);
+    int end_jump = emitJump(parser, OP_JUMP);
 
-    patchJump(else_jump);
-    emitByte(OP_POP);
+    patchJump(parser, else_jump);
+    emitByte(parser, OP_POP);
 
-    parsePrecedence(PREC_OR);
-    patchJump(end_jump);
+    parsePrecedence(parser, PREC_OR);
+    patchJump(parser, end_jump);
 }
 
 static ParseRule rules[] = {
@@ -364,7 +696,7 @@ static ParseRule rules[] = {
     [TOKEN_IDENTIFIER] = { variable, NULL, PREC_NONE },
     [TOKEN_STRING] = { string, NULL, PREC_NONE },
     [TOKEN_NUMBER] = { number, NULL, PREC_NONE },
-    [TOKEN_AND] = { NULL, and_, PREC_NONE },
+    [TOKEN_AND] = { NULL, and_, PREC_AND },
     [TOKEN_CLASS] = { NULL, NULL, PREC_NONE },
     [TOKEN_ELSE] = { NULL, NULL, PREC_NONE },
     [TOKEN_FALSE] = { literal, NULL, PREC_NONE },
@@ -372,7 +704,7 @@ static ParseRule rules[] = {
     [TOKEN_FUN] = { NULL, NULL, PREC_NONE },
     [TOKEN_IF] = { NULL, NULL, PREC_NONE },
     [TOKEN_NIL] = { literal, NULL, PREC_NONE },
-    [TOKEN_OR] = { NULL, or_, PREC_NONE },
+    [TOKEN_OR] = { NULL, or_, PREC_OR },
     [TOKEN_PRINT] = { NULL, NULL, PREC_NONE },
     [TOKEN_RETURN] = { NULL, NULL, PREC_NONE },
     [TOKEN_SUPER] = { NULL, NULL, PREC_NONE },
@@ -384,30 +716,41 @@ static ParseRule rules[] = {
     [TOKEN_EOF] = { NULL, NULL, PREC_NONE },
 };
 
-void parsePrecedence(Precedence precedence) {
-    advance();
-    ParseFn prefix_rule = getRule(parser.previous.type)->prefix;
+void parsePrecedence(Parser* parser, Precedence precedence) {
+    int start = currentChunk(parser)->count;
+    advance(parser);
+    ParseFn prefix_rule = getRule(parser->previous.type)->prefix;
     if (prefix_rule == NULL) {
-        error("Expect expression.");
+        error(parser, "Expect expression.");
         return;
     }
 
     bool can_assign = precedence <= PREC_ASSIGNMENT;
-    prefix_rule(can_assign);
+    prefix_rule(parser, can_assign);
 
-    while (precedence <= getRule(parser.current.type)->precedence) {
-        advance();
-        ParseFn infix_rule = getRule(parser.previous.type)->infix;
-        infix_rule(can_assign);
+    while (precedence <= getRule(parser->current.type)->precedence) {
+        advance(parser);
+        ParseFn infix_rule = getRule(parser->previous.type)->infix;
+        parser->compiler->operand_start = start;
+        infix_rule(parser, can_assign);
     }
 
-    if (can_assign && match(TOKEN_EQUAL)) {
-        error("Invalid assignment target.");
+    if (can_assign && match(parser, TOKEN_EQUAL)) {
+        error(parser, "Invalid assignment target.");
     }
 }
 
-uint8_t identifierConstant(Token* name) {
-    return makeConstant(OBJ_VAL(constantString(name->start, name->length)));
+// resolves a global name to its slot in vm->global_values
+uint16_t identifierSlot(Parser* parser, Token* name) {
+    ObjString* string = sourceString(parser, name->start, name->length);
+    if (parser->vm->global_count == UINT16_COUNT) {
+        Value existing;
+        if (!tableGet(&parser->vm->global_slots, string, &existing)) {
+            error(parser, "Too many global variables.");
+            return 0;
+        }
+    }
+    return (uint16_t)globalSlot(parser->vm, string);
 }
 
 bool identifiersEqual(Token* a, Token* b) {
@@ -415,191 +758,188 @@ bool identifiersEqual(Token* a, Token* b) {
     return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static void addLocal(Token name) {
-    if (current->local_count == UINT8_COUNT) {
-        error("Too many local variables in function");
+static void addLocal(Parser* parser, Token name) {
+    if (parser->compiler->local_count == UINT8_COUNT) {
+        error(parser, "Too many local variables in function");
         return;
     }
 
-    Local* local = &current->locals[current->local_count++];
+    Local* local = &parser->compiler->locals[parser->compiler->local_count++];
     local->name = name;
     local->depth = -1;
 }
 
-static void markInitialized() {
-    current->locals[current->local_count - 1].depth = current->scope_depth;
+static void markInitialized(Parser* parser) {
+    parser->compiler->locals[parser->compiler->local_count - 1].depth = parser->compiler->scope_depth;
 }
 
-static void declareVariable() {
-    if (current->scope_depth == 0) {
+static void declareVariable(Parser* parser) {
+    if (parser->compiler->scope_depth == 0) {
         return;
     }
 
-    Token* name = &parser.previous;
-    for (int i = current->local_count - 1; i >= 0; i--) {
-        Local* local = &current->locals[i];
-        if (local->depth != -1 && local->depth < current->scope_depth) {
+    Token* name = &parser->previous;
+    for (int i = parser->compiler->local_count - 1; i >= 0; i--) {
+        Local* local = &parser->compiler->locals[i];
+        if (local->depth != -1 && local->depth < parser->compiler->scope_depth) {
             break;
         }
 
         if (identifiersEqual(name, &local->name)) {
-            error("Already a variable with this name in this scope.");
+            error(parser, "Already a variable with this name in this scope.");
         }
     }
 
-    addLocal(*name);
+    addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* error_message) {
-    consume(TOKEN_IDENTIFIER, error_message);
+static uint16_t parseVariable(Parser* parser, const char* error_message) {
+    consume(parser, TOKEN_IDENTIFIER, error_message);
 
-    declareVariable();
-    if (current->scope_depth > 0) {
+    declareVariable(parser);
+    if (parser->compiler->scope_depth > 0) {
         return 0;
     }
 
-    return identifierConstant(&parser.previous);
+    return identifierSlot(parser, &parser->previous);
 }
 
-static void defineVariable(uint8_t global) {
-    if (current->scope_depth > 0) {
-        markInitialized();
+static void defineVariable(Parser* parser, uint16_t global) {
+    if (parser->compiler->scope_depth > 0) {
+        markInitialized(parser);
         return;
     }
 
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitByte(parser, OP_DEFINE_GLOBAL);
+    emitShort(parser, global);
 }
 
 ParseRule* getRule(TokenType type) {
     return &rules[type];
 }
 
-void expression() {
-    parsePrecedence(PREC_ASSIGNMENT);
+void expression(Parser* parser) {
+    parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block() {
-    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-        declaration();
+static void block(Parser* parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
 
-    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void varDeclaration() {
-    uint8_t global = parseVariable("Expect variable name");
+static void varDeclaration(Parser* parser) {
+    uint16_t global = parseVariable(parser, "Expect variable name");
 
-    if (match(TOKEN_EQUAL)) {
-        expression();
+    if (match(parser, TOKEN_EQUAL)) {
+        expression(parser);
     }
     else {
-        emitByte(OP_NIL);
+        emitByte(parser, OP_NIL);
     }
 
-    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration");
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration");
 
-    defineVariable(global);
+    defineVariable(parser, global);
 }
 
-static void expressionStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after expression");
-    emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+    int start = currentChunk(parser)->count;
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression");
+    emitExpressionPop(parser, start);
 }
 
-static void ifStatement() {
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void ifStatement(Parser* parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    int condition_start = currentChunk(parser)->count;
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int then_jump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
+    int then_jump = emitConditionJump(parser, condition_start);
+    statement(parser);
 
-    int else_jump = emitJump(OP_JUMP);
+    int else_jump = emitJump(parser, OP_JUMP);
 
-    patchJump(then_jump);
-    emitByte(OP_POP);
+    patchConditionJump(parser, then_jump);
 
-    if (match(TOKEN_ELSE)) statement();
-    patchJump(else_jump);
+    if (match(parser, TOKEN_ELSE)) statement(parser);
+    patchJump(parser, else_jump);
 }
 
-static void forStatement() {
-    beginScope();
+static void forStatement(Parser* parser) {
+    beginScope(parser);
 
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-    if (match(TOKEN_SEMICOLON)) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    if (match(parser, TOKEN_SEMICOLON)) {
         // no initializer
     }
-    else if (match(TOKEN_VAR)) {
-        varDeclaration();
+    else if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     }
     else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 
-    int loop_start = currentChunk()->count;
+    int loop_start = currentChunk(parser)->count;
     int exit_jump = -1;
-    if (!match(TOKEN_SEMICOLON)) {
-        expression();
-        consume(TOKEN_SEMICOLON, "Expect ';'.");
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';'.");
 
         // jump out of the loop if the condition is false
-        exit_jump = emitJump(OP_JUMP_IF_FALSE);
-        emitByte(OP_POP);
+        exit_jump = emitConditionJump(parser, loop_start);
     }
 
-    if (!match(TOKEN_RIGHT_PAREN)) {
-        int body_jump = emitJump(OP_JUMP);
-        int increment_start = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int body_jump = emitJump(parser, OP_JUMP);
+        int increment_start = currentChunk(parser)->count;
+        expression(parser);
+        emitExpressionPop(parser, increment_start);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-        emitLoop(loop_start);
+        emitLoop(parser, loop_start);
         loop_start = increment_start;
-        patchJump(body_jump);
+        patchJump(parser, body_jump);
     }
 
-    statement();
-    emitLoop(loop_start);
+    statement(parser);
+    emitLoop(parser, loop_start);
 
     if (exit_jump != -1) {
-        patchJump(exit_jump);
-        emitByte(OP_POP); // condition
+        patchConditionJump(parser, exit_jump);
     }
 
-    endScope();
+    endScope(parser);
 }
 
-static void whileStatement() {
-    int loop_start = currentChunk()->count;
-    consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-    expression();
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void whileStatement(Parser* parser) {
+    int loop_start = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int exit_jump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
-    statement();
-    emitLoop(loop_start);
+    int exit_jump = emitConditionJump(parser, loop_start);
+    statement(parser);
+    emitLoop(parser, loop_start);
 
-    patchJump(exit_jump);
-    emitByte(OP_POP);
+    patchConditionJump(parser, exit_jump);
 }
 
-static void printStatement() {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after value");
-    emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after value");
+    emitByte(parser, OP_PRINT);
 }
 
-static void synchronize() {
-    parser.panic_mode = false;
+static void synchronize(Parser* parser) {
+    parser->panic_mode = false;
 
-    while (parser.current.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMICOLON) return;
-        switch (parser.current.type) {
+    while (parser->current.type != TOKEN_EOF) {
+        if (parser->previous.type == TOKEN_SEMICOLON) return;
+        switch (parser->current.type) {
         case TOKEN_CLASS:
         case TOKEN_FUN:
         case TOKEN_VAR:
@@ -613,60 +953,67 @@ static void synchronize() {
             ;
         }
 
-        advance();
+        advance(parser);
     }
 }
 
-void declaration() {
-    if (match(TOKEN_VAR)) {
-        varDeclaration();
+void declaration(Parser* parser) {
+    if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
     }
     else {
-        statement();
+        statement(parser);
     }
 
-    if (parser.panic_mode) synchronize();
+    if (parser->panic_mode) synchronize(parser);
 }
 
-void statement() {
-    if (match(TOKEN_PRINT)) {
-        printStatement();
+void statement(Parser* parser) {
+    if (match(parser, TOKEN_PRINT)) {
+        printStatement(parser);
     }
-    else if (match(TOKEN_IF)) {
-        ifStatement();
+    else if (match(parser, TOKEN_IF)) {
+        ifStatement(parser);
     }
-    else if (match(TOKEN_FOR)) {
-        forStatement();
+    else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);
     }
-    else if (match(TOKEN_WHILE)) {
-        whileStatement();
+    else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
     }
-    else if (match(TOKEN_LEFT_BRACE)) {
-        beginScope();
-        block();
-        endScope();
+    else if (match(parser, TOKEN_LEFT_BRACE)) {
+        beginScope(parser);
+        block(parser);
+        endScope(parser);
     }
     else {
-        expressionStatement();
+        expressionStatement(parser);
     }
 }
 
-bool compile(const char* source, Chunk* chunk) {
-    initScanner(source);
+bool compile(VM* vm, const char* source, Chunk* chunk, bool copy_strings) {
+    Parser context;
+    Parser* parser = &context;
+    parser->vm = vm;
+    parser->copy_strings = copy_strings;
+    initScanner(&parser->scanner, source);
     Compiler compiler;
-    initCompiler(&compiler);
-    compiling_chunk = chunk;
+    initCompiler(parser, &compiler);
+    parser->chunk = chunk;
+    // constants stay alive while the rest of the source compiles
+    pushChunkRoot(vm, chunk);
 
-    parser.had_error = false;
-    parser.panic_mode = false;
+    parser->had_error = false;
+    parser->panic_mode = false;
 
-    advance();
+    advance(parser);
 
-    while (!match(TOKEN_EOF)) {
-        declaration();
+    while (!match(parser, TOKEN_EOF)) {
+        declaration(parser);
     }
 
-    endCompiler();
+    endCompiler(parser);
+    popChunkRoot(vm);
 
-    return !parser.had_error;
+    return !parser->had_error;
 }
\ No newline at end of file
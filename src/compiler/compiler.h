@@ -4,6 +4,8 @@
 #include "common/common.h"
 #include "common/chunk/chunk.h"
 
-bool compile(const char* source, Chunk* chunk);
+// String literals and global names point into source, which then has to
+// outlive vm; copy_strings gives them bytes of their own instead.
+bool compile(VM* vm, const char* source, Chunk* chunk, bool copy_strings);
 
 #endif // !clox_compiler_h
@@ -0,0 +1,498 @@
+#include <stdlib.h>
+
+#include "optimizer.h"
+#include "common/memory/arena.h"
+#include "common/memory/memory.h"
+
+// The optimizer decodes the chunk into an instruction list, runs its
+// passes over a control flow graph built from that list and then emits
+// the surviving instructions with recomputed jumps and line info.
+//
+// Passes never move instructions, they only retarget jumps, rewrite
+// opcodes in place and mark instructions dead. A dead instruction
+// that is still a jump target forwards to the next live one.
+
+#define MAX_PASSES 8
+
+typedef struct {
+    uint8_t op;
+    int offset; // in the chunk before optimization
+    int size;
+    int line;
+    int target; // instruction a jump goes to, -1 for everything else
+    bool is_live;
+} Instruction;
+
+typedef struct {
+    int first;
+    int last;
+    int successors[2];
+    int successor_count;
+    bool is_reachable;
+} BasicBlock;
+
+typedef struct {
+    Chunk* chunk;
+    Arena arena;  // every array below, freed with the graph
+    int capacity; // chunk size when decoded, bounds every array below
+    Instruction* code;
+    int count;
+    BasicBlock* blocks;
+    int block_count;
+    int* block_of; // instruction -> basic block, -1 when dead
+} ControlFlowGraph;
+
+static bool isConditionalJump(uint8_t op) {
+    switch (op) {
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return true;
+    default:
+        return false;
+    }
+}
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || isConditionalJump(op);
+}
+static bool endsBlock(uint8_t op) {
+    return isJump(op) || op == OP_RETURN;
+}
+static bool isPush(uint8_t op) {
+    switch (op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int nextLive(ControlFlowGraph* cfg, int index) {
+    while (index < cfg->count && !cfg->code[index].is_live) index++;
+    return index;
+}
+static int previousLive(ControlFlowGraph* cfg, int index) {
+    while (index >= 0 && !cfg->code[index].is_live) index--;
+    return index;
+}
+
+static void decodeChunk(VM* vm, ControlFlowGraph* cfg, Chunk* chunk) {
+    cfg->chunk = chunk;
+    initArena(vm, &cfg->arena, MEMORY_SCRATCH);
+    cfg->capacity = chunk->count;
+    cfg->code = ARENA_ALLOCATE(&cfg->arena, Instruction, chunk->count);
+    cfg->count = 0;
+    cfg->blocks = ARENA_ALLOCATE(&cfg->arena, BasicBlock, chunk->count);
+    cfg->block_count = 0;
+    cfg->block_of = ARENA_ALLOCATE(&cfg->arena, int, chunk->count);
+
+    int* index_of = ARENA_ALLOCATE(&cfg->arena, int, chunk->count + 1);
+    LinesInfo* lines = &chunk->lines_info;
+    int run = 0;
+    int run_end = lines->count > 0 ? lines->counts[0] : 0;
+
+    for (int offset = 0; offset < chunk->count;) {
+        while (offset >= run_end && run + 1 < lines->count) {
+            run_end += lines->counts[++run];
+        }
+
+        Instruction* instruction = &cfg->code[cfg->count];
+        instruction->op = chunk->code[offset];
+        instruction->offset = offset;
+        instruction->size = instructionSize(chunk, offset);
+        instruction->line = lines->lines[run];
+        instruction->target = -1;
+        instruction->is_live = true;
+
+        index_of[offset] = cfg->count++;
+        offset += instruction->size;
+    }
+    index_of[chunk->count] = cfg->count;
+
+    for (int i = 0; i < cfg->count; ++i) {
+        Instruction* instruction = &cfg->code[i];
+        if (!isJump(instruction->op)) continue;
+
+        uint8_t* operand = &chunk->code[instruction->offset + 1];
+        int jump = (operand[0] << 8) | operand[1];
+        int after = instruction->offset + instruction->size;
+        instruction->target = index_of[
+            instruction->op == OP_LOOP ? after - jump : after + jump];
+    }
+}
+
+static void freeControlFlowGraph(ControlFlowGraph* cfg) {
+    freeArena(&cfg->arena);
+}
+
+static void buildBlocks(ControlFlowGraph* cfg) {
+    // block_of doubles as the leader mark until the blocks are laid out
+    for (int i = 0; i < cfg->count; ++i) {
+        cfg->block_of[i] = -1;
+    }
+
+    bool at_leader = true;
+    for (int i = 0; i < cfg->count; ++i) {
+        Instruction* instruction = &cfg->code[i];
+        if (!instruction->is_live) continue;
+
+        if (at_leader) cfg->block_of[i] = 0;
+        at_leader = endsBlock(instruction->op);
+        if (isJump(instruction->op)) {
+            int target = nextLive(cfg, instruction->target);
+            if (target < cfg->count) cfg->block_of[target] = 0;
+        }
+    }
+
+    cfg->block_count = 0;
+    BasicBlock* block = NULL;
+    for (int i = 0; i < cfg->count; ++i) {
+        if (!cfg->code[i].is_live) continue;
+
+        if (block == NULL || cfg->block_of[i] == 0) {
+            block = &cfg->blocks[cfg->block_count++];
+            block->first = i;
+            block->successor_count = 0;
+            block->is_reachable = false;
+        }
+        block->last = i;
+        cfg->block_of[i] = cfg->block_count - 1;
+    }
+
+    for (int b = 0; b < cfg->block_count; ++b) {
+        block = &cfg->blocks[b];
+        Instruction* last = &cfg->code[block->last];
+        int next = nextLive(cfg, block->last + 1);
+
+        if (last->op != OP_RETURN && last->op != OP_JUMP &&
+            last->op != OP_LOOP && next < cfg->count)
+        {
+            block->successors[block->successor_count++] = cfg->block_of[next];
+        }
+        if (isJump(last->op)) {
+            int target = nextLive(cfg, last->target);
+            if (target < cfg->count) {
+                block->successors[block->successor_count++] = cfg->block_of[target];
+            }
+        }
+    }
+}
+
+static void markReachable(ControlFlowGraph* cfg) {
+    if (cfg->block_count == 0) return;
+
+    int* worklist = ARENA_ALLOCATE(&cfg->arena, int, cfg->block_count);
+    int worklist_count = 0;
+
+    cfg->blocks[0].is_reachable = true;
+    worklist[worklist_count++] = 0;
+    while (worklist_count > 0) {
+        BasicBlock* block = &cfg->blocks[worklist[--worklist_count]];
+        for (int i = 0; i < block->successor_count; ++i) {
+            BasicBlock* successor = &cfg->blocks[block->successors[i]];
+            if (successor->is_reachable) continue;
+
+            successor->is_reachable = true;
+            worklist[worklist_count++] = block->successors[i];
+        }
+    }
+}
+
+// Follows jumps that land on unconditional jumps. OP_JUMP_IF_FALSE can
+// also pass through another OP_JUMP_IF_FALSE since the condition it leaves
+// on the stack is just as falsey there. Conditional jumps only go forward.
+static bool threadJumps(ControlFlowGraph* cfg) {
+    bool changed = false;
+
+    for (int i = 0; i < cfg->count; ++i) {
+        Instruction* instruction = &cfg->code[i];
+        if (!instruction->is_live || !isJump(instruction->op)) continue;
+
+        int target = nextLive(cfg, instruction->target);
+        for (int hops = 0; hops < cfg->count && target < cfg->count; ++hops) {
+            Instruction* destination = &cfg->code[target];
+            if (isConditionalJump(destination->op)) {
+                // the fused compare-and-jumps test operands of their own
+                if (destination->op != OP_JUMP_IF_FALSE || instruction->op != OP_JUMP_IF_FALSE) break;
+            }
+            else if (!isJump(destination->op)) {
+                break;
+            }
+
+            int next = nextLive(cfg, destination->target);
+            if (next == target) break;
+            if (isConditionalJump(instruction->op) && next <= i) break;
+            target = next;
+        }
+
+        if (target != nextLive(cfg, instruction->target)) {
+            instruction->target = target;
+            changed = true;
+        }
+
+        if (target >= cfg->count) continue;
+        if (!isConditionalJump(instruction->op) &&
+            cfg->code[target].op == OP_RETURN)
+        {
+            // jumping to a return can just return
+            instruction->op = OP_RETURN;
+            instruction->size = 1;
+            instruction->target = -1;
+            changed = true;
+        }
+        else if (target == nextLive(cfg, i + 1) &&
+            (instruction->op == OP_JUMP || instruction->op == OP_JUMP_IF_FALSE))
+        {
+            // jump to the very next instruction, fused compare-and-jumps
+            // still have operands to pop
+            instruction->is_live = false;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static bool knownFalsey(ControlFlowGraph* cfg, Instruction* instruction, bool* is_falsey) {
+    Chunk* chunk = cfg->chunk;
+    Value value;
+    switch (instruction->op) {
+    case OP_NIL:
+    case OP_FALSE:
+        *is_falsey = true;
+        return true;
+    case OP_TRUE:
+        *is_falsey = false;
+        return true;
+    case OP_CONSTANT:
+        value = chunk->constants.values[chunk->code[instruction->offset + 1]];
+        break;
+    case OP_CONSTANT_LONG: {
+        uint16_t constant_id;
+        uint8_t* bytes = (uint8_t*)&constant_id;
+        bytes[0] = chunk->code[instruction->offset + 1];
+        bytes[1] = chunk->code[instruction->offset + 2];
+        value = chunk->constants.values[constant_id];
+    } break;
+    default:
+        return false;
+    }
+
+    *is_falsey = IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+    return true;
+}
+
+// A conditional jump right after a constant always goes the same way:
+// it either becomes a plain jump or disappears.
+static bool foldConstantBranches(ControlFlowGraph* cfg) {
+    bool changed = false;
+
+    for (int i = 0; i < cfg->count; ++i) {
+        Instruction* instruction = &cfg->code[i];
+        if (!instruction->is_live || instruction->op != OP_JUMP_IF_FALSE) continue;
+
+        int previous = previousLive(cfg, i - 1);
+        if (previous < 0 || cfg->block_of[previous] != cfg->block_of[i]) continue;
+
+        bool is_falsey;
+        if (!knownFalsey(cfg, &cfg->code[previous], &is_falsey)) continue;
+
+        if (is_falsey) {
+            instruction->op = OP_JUMP;
+        }
+        else {
+            instruction->is_live = false;
+        }
+        changed = true;
+    }
+
+    return changed;
+}
+
+static bool removeDeadCode(ControlFlowGraph* cfg) {
+    bool changed = false;
+    markReachable(cfg);
+
+    for (int b = 0; b < cfg->block_count; ++b) {
+        BasicBlock* block = &cfg->blocks[b];
+        if (block->is_reachable) continue;
+
+        for (int i = block->first; i <= block->last; ++i) {
+            cfg->code[i].is_live = false;
+        }
+        changed = true;
+    }
+
+    return changed;
+}
+
+static bool sameOperands(ControlFlowGraph* cfg, Instruction* a, Instruction* b) {
+    if (a->size != b->size) return false;
+    for (int i = 1; i < a->size; ++i) {
+        if (cfg->chunk->code[a->offset + i] != cfg->chunk->code[b->offset + i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Drops a value pushed only to be popped, and a pop followed by reading
+// back the variable that was just stored. A fused store-and-pop followed
+// by the same read becomes a plain store.
+static bool removeStackNoise(ControlFlowGraph* cfg) {
+    bool changed = false;
+
+    for (int i = 0; i < cfg->count; ++i) {
+        Instruction* first = &cfg->code[i];
+        if (!first->is_live) continue;
+
+        int j = nextLive(cfg, i + 1);
+        if (j >= cfg->count || cfg->block_of[j] != cfg->block_of[i]) continue;
+        Instruction* second = &cfg->code[j];
+
+        if ((first->op == OP_SET_LOCAL_POP && second->op == OP_GET_LOCAL) ||
+            (first->op == OP_SET_GLOBAL_POP && second->op == OP_GET_GLOBAL))
+        {
+            if (!sameOperands(cfg, first, second)) continue;
+
+            first->op = first->op == OP_SET_LOCAL_POP ? OP_SET_LOCAL : OP_SET_GLOBAL;
+            second->is_live = false;
+            changed = true;
+            continue;
+        }
+
+        if (second->op != OP_POP) continue;
+
+        if (isPush(first->op)) {
+            first->is_live = false;
+            second->is_live = false;
+            changed = true;
+            continue;
+        }
+
+        uint8_t get_op;
+        if (first->op == OP_SET_LOCAL) get_op = OP_GET_LOCAL;
+        else if (first->op == OP_SET_GLOBAL) get_op = OP_GET_GLOBAL;
+        else continue;
+
+        int k = nextLive(cfg, j + 1);
+        if (k >= cfg->count || cfg->block_of[k] != cfg->block_of[i]) continue;
+        Instruction* third = &cfg->code[k];
+        if (third->op != get_op || !sameOperands(cfg, first, third)) continue;
+
+        second->is_live = false;
+        third->is_live = false;
+        changed = true;
+    }
+
+    return changed;
+}
+
+// swaps the chunk's code and line info for the live instructions, leaves
+// the chunk as it was if a rewritten jump no longer fits in 16 bits
+static bool emitChunk(VM* vm, ControlFlowGraph* cfg) {
+    int* new_offset = ARENA_ALLOCATE(&cfg->arena, int, cfg->count + 1);
+    int size = 0;
+    for (int i = 0; i < cfg->count; ++i) {
+        // dead instructions get the offset of the next live one
+        new_offset[i] = size;
+        if (cfg->code[i].is_live) size += cfg->code[i].size;
+    }
+    new_offset[cfg->count] = size;
+
+    Chunk* chunk = cfg->chunk;
+    uint8_t* code = ALLOCATE(vm, uint8_t, size, MEMORY_CODE);
+    LinesInfo lines_info;
+    initLinesInfo(&lines_info);
+
+    HeapGuard guard;
+    if (setjmp(guard.jump) != 0) {
+        // neither is the chunk's yet
+        FREE_ARRAY(vm, uint8_t, code, size, MEMORY_CODE);
+        freeLinesInfo(vm, &lines_info);
+        raiseOutOfMemory(vm);
+    }
+    pushHeapGuard(vm, &guard);
+
+    bool fits = true;
+    for (int i = 0; i < cfg->count; ++i) {
+        Instruction* instruction = &cfg->code[i];
+        if (!instruction->is_live) continue;
+
+        int at = new_offset[i];
+        code[at] = instruction->op;
+        if (isJump(instruction->op)) {
+            int after = at + instruction->size;
+            int destination = new_offset[instruction->target];
+            int jump = destination - after;
+            if (!isConditionalJump(instruction->op)) {
+                // threading can turn a forward jump into a backward one
+                code[at] = jump >= 0 ? OP_JUMP : OP_LOOP;
+                if (jump < 0) jump = -jump;
+            }
+            if (jump > UINT16_MAX) fits = false;
+
+            code[at + 1] = (jump >> 8) & 0xff;
+            code[at + 2] = jump & 0xff;
+        }
+        else {
+            for (int b = 1; b < instruction->size; ++b) {
+                code[at + b] = chunk->code[instruction->offset + b];
+            }
+        }
+
+        for (int b = 0; b < instruction->size; ++b) {
+            writeLinesInfo(vm, &lines_info, instruction->line);
+        }
+    }
+    popHeapGuard(vm, &guard);
+
+    if (!fits) {
+        FREE_ARRAY(vm, uint8_t, code, size, MEMORY_CODE);
+        freeLinesInfo(vm, &lines_info);
+        return false;
+    }
+
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity, MEMORY_CODE);
+    freeLinesInfo(vm, &chunk->lines_info);
+    chunk->code = code;
+    chunk->count = size;
+    chunk->capacity = size;
+    chunk->lines_info = lines_info;
+    return true;
+}
+
+void optimizeChunk(VM* vm, Chunk* chunk, int level) {
+    if (level <= 0 || chunk->count == 0) return;
+
+    ControlFlowGraph cfg;
+    decodeChunk(vm, &cfg, chunk);
+
+    bool changed = true;
+    for (int pass = 0; changed && pass < MAX_PASSES; ++pass) {
+        changed = threadJumps(&cfg);
+
+        buildBlocks(&cfg);
+        changed |= foldConstantBranches(&cfg);
+
+        buildBlocks(&cfg);
+        changed |= removeDeadCode(&cfg);
+
+        if (level >= 2) {
+            buildBlocks(&cfg);
+            changed |= removeStackNoise(&cfg);
+        }
+    }
+
+    emitChunk(vm, &cfg);
+    freeControlFlowGraph(&cfg);
+}
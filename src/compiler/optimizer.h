@@ -0,0 +1,15 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "common/common.h"
+#include "common/chunk/chunk.h"
+
+// -O levels:
+//  0 - code is left as the compiler emitted it
+//  1 - jump threading, constant branches and dead code elimination
+//  2 - everything from 1 plus removal of redundant push/pop pairs
+#define OPTIMIZE_MAX_LEVEL 2
+
+void optimizeChunk(VM* vm, Chunk* chunk, int level);
+
+#endif // !clox_optimizer_h
@@ -0,0 +1,572 @@
+#include <stdlib.h>
+
+#include "register_emitter.h"
+#include "common/memory/arena.h"
+#include "common/memory/memory.h"
+#include "vm/vm.h"
+
+// The emitter walks the stack chunk once and keeps a virtual stack of
+// operands in place of the values the stack VM would hold. An operand is
+// either a register or a value that has not been loaded yet: a constant
+// or one of nil, true and false. A register operand is "home" when it
+// names the register of its own stack slot; any other register operand
+// is a deferred read of a local.
+//
+// Invariants the lowering relies on:
+//  - an operand only ever reads a register below its own slot, so
+//    writing the result of an instruction into the slot of its first
+//    operand clobbers nothing that is still pending;
+//  - before a local is stored to, every operand still reading it is
+//    loaded into its home register;
+//  - at jumps and jump targets every operand is home, so all paths into
+//    a target agree on where each value is.
+
+// room above the frame for the scratch pushes of string concatenation
+#define FRAME_SCRATCH 2
+
+typedef enum {
+    OPERAND_REGISTER,
+    OPERAND_CONSTANT,
+    OPERAND_NIL,
+    OPERAND_TRUE,
+    OPERAND_FALSE
+} OperandType;
+
+typedef struct {
+    OperandType type;
+    int index; // register or constant
+} Operand;
+
+typedef struct {
+    int at;     // offset of the jump operand in the register code
+    int after;  // register offset right after the jump
+    int target; // offset of the destination in the stack code
+} JumpFixup;
+
+typedef struct {
+    VM* vm;
+    Chunk* source;
+    Chunk* code;
+    int line;
+    Operand stack[STACK_MAX];
+    int depth;
+    int frame_size;
+    int offset;      // of the stack instruction being lowered
+    int result_at;   // last instruction whose A operand is a destination
+    int result_end;
+    bool is_reachable;
+    bool failed;
+    Arena arena;     // the arrays below live until the chunk is lowered
+    bool* is_target;
+    int* depth_at;  // stack offset -> depth on entry, -1 until known
+    int* offset_of; // stack offset -> register offset
+    JumpFixup* fixups;
+    int fixup_count;
+    int fixup_capacity;
+} RegisterEmitter;
+
+static void emitByte(RegisterEmitter* emitter, uint8_t byte) {
+    writeChunk(emitter->vm, emitter->code, byte, emitter->line);
+}
+static void emitShort(RegisterEmitter* emitter, uint16_t value) {
+    emitByte(emitter, (value >> 8) & 0xff);
+    emitByte(emitter, value & 0xff);
+}
+static void emitRegisters(RegisterEmitter* emitter, uint8_t op, int a, int b) {
+    emitByte(emitter, op);
+    emitByte(emitter, (uint8_t)a);
+    emitByte(emitter, (uint8_t)b);
+}
+// call right after emitting an instruction that writes R[A]
+static void markResult(RegisterEmitter* emitter, int at) {
+    emitter->result_at = at;
+    emitter->result_end = emitter->code->count;
+}
+
+static Operand* top(RegisterEmitter* emitter, int distance) {
+    return &emitter->stack[emitter->depth - 1 - distance];
+}
+static void pushOperand(RegisterEmitter* emitter, OperandType type, int index) {
+    if (emitter->depth == STACK_MAX - FRAME_SCRATCH) {
+        emitter->failed = true;
+        return;
+    }
+    emitter->stack[emitter->depth++] = (Operand){ type, index };
+    if (emitter->depth > emitter->frame_size) emitter->frame_size = emitter->depth;
+}
+static void pushHome(RegisterEmitter* emitter) {
+    pushOperand(emitter, OPERAND_REGISTER, emitter->depth);
+}
+
+static bool isHome(RegisterEmitter* emitter, int slot) {
+    Operand* operand = &emitter->stack[slot];
+    return operand->type == OPERAND_REGISTER && operand->index == slot;
+}
+
+// loads the operand in slot into its home register
+static void materialize(RegisterEmitter* emitter, int slot) {
+    if (isHome(emitter, slot)) return;
+
+    Operand* operand = &emitter->stack[slot];
+    int at = emitter->code->count;
+    switch (operand->type) {
+    case OPERAND_REGISTER:
+        emitRegisters(emitter, OP_REG_MOVE, slot, operand->index);
+        break;
+    case OPERAND_CONSTANT:
+        emitByte(emitter, OP_REG_LOAD_CONSTANT);
+        emitByte(emitter, (uint8_t)slot);
+        emitShort(emitter, (uint16_t)operand->index);
+        break;
+    case OPERAND_NIL:
+        emitByte(emitter, OP_REG_LOAD_NIL);
+        emitByte(emitter, (uint8_t)slot);
+        break;
+    case OPERAND_TRUE:
+        emitByte(emitter, OP_REG_LOAD_TRUE);
+        emitByte(emitter, (uint8_t)slot);
+        break;
+    case OPERAND_FALSE:
+        emitByte(emitter, OP_REG_LOAD_FALSE);
+        emitByte(emitter, (uint8_t)slot);
+        break;
+    }
+    markResult(emitter, at);
+    *operand = (Operand){ OPERAND_REGISTER, slot };
+}
+static void materializeBelow(RegisterEmitter* emitter, int depth) {
+    for (int slot = 0; slot < depth; ++slot) {
+        materialize(emitter, slot);
+    }
+}
+// loads every operand that still reads reg, ahead of a store to it
+static void materializeReaders(RegisterEmitter* emitter, int reg) {
+    for (int slot = reg + 1; slot < emitter->depth; ++slot) {
+        Operand* operand = &emitter->stack[slot];
+        if (operand->type == OPERAND_REGISTER && operand->index == reg) {
+            materialize(emitter, slot);
+        }
+    }
+}
+
+static bool hasReaders(RegisterEmitter* emitter, int reg) {
+    for (int slot = reg + 1; slot < emitter->depth; ++slot) {
+        Operand* operand = &emitter->stack[slot];
+        if (operand->type == OPERAND_REGISTER && operand->index == reg) return true;
+    }
+    return false;
+}
+
+// register that holds the operand in slot, loading it if it is a value
+static int operandRegister(RegisterEmitter* emitter, int slot) {
+    if (emitter->stack[slot].type != OPERAND_REGISTER) materialize(emitter, slot);
+    return emitter->stack[slot].index;
+}
+
+static void emitJump(RegisterEmitter* emitter, int target) {
+    if (emitter->fixup_capacity < emitter->fixup_count + 1) {
+        int old_capacity = emitter->fixup_capacity;
+        emitter->fixup_capacity = GROW_CAPACITY(old_capacity);
+        emitter->fixups = ARENA_GROW_ARRAY(&emitter->arena, JumpFixup, emitter->fixups,
+            old_capacity, emitter->fixup_capacity);
+    }
+
+    JumpFixup* fixup = &emitter->fixups[emitter->fixup_count++];
+    fixup->at = emitter->code->count;
+    fixup->after = emitter->code->count + 2;
+    fixup->target = target;
+    emitShort(emitter, 0xffff);
+    if (emitter->depth_at[target] != emitter->depth) emitter->failed = true;
+}
+static void emitLoop(RegisterEmitter* emitter, int target) {
+    if (emitter->depth_at[target] != emitter->depth) emitter->failed = true;
+    emitByte(emitter, OP_REG_LOOP);
+    int jump = emitter->code->count + 2 - emitter->offset_of[target];
+    if (jump > UINT16_MAX) emitter->failed = true;
+    emitShort(emitter, (uint16_t)jump);
+}
+
+static void storeLocal(RegisterEmitter* emitter, int slot) {
+    if (slot >= emitter->depth - 1) {
+        emitter->failed = true;
+        return;
+    }
+
+    Operand* value = top(emitter, 0);
+    if (value->type == OPERAND_REGISTER && value->index == emitter->depth - 1 &&
+        emitter->result_end == emitter->code->count &&
+        emitter->code->code[emitter->result_at + 1] == value->index &&
+        !emitter->is_target[emitter->offset] && !hasReaders(emitter, slot))
+    {
+        // the temporary was just computed, compute it into the local instead
+        emitter->code->code[emitter->result_at + 1] = (uint8_t)slot;
+        emitter->stack[slot] = (Operand){ OPERAND_REGISTER, slot };
+    }
+    else if (value->type != OPERAND_REGISTER || value->index != slot) {
+        materializeReaders(emitter, slot);
+        Operand stored = *value;
+        emitter->stack[slot] = stored;
+        if (stored.type == OPERAND_REGISTER) {
+            emitRegisters(emitter, OP_REG_MOVE, slot, stored.index);
+            emitter->stack[slot].index = slot;
+            markResult(emitter, emitter->code->count - 3);
+        }
+        else {
+            materialize(emitter, slot);
+        }
+    }
+    *top(emitter, 0) = (Operand){ OPERAND_REGISTER, slot };
+}
+static void storeGlobal(RegisterEmitter* emitter, uint8_t op, uint16_t slot) {
+    int value = operandRegister(emitter, emitter->depth - 1);
+    emitByte(emitter, op);
+    emitByte(emitter, (uint8_t)value);
+    emitShort(emitter, slot);
+}
+
+static void emitBinary(RegisterEmitter* emitter, uint8_t op) {
+    int a_slot = emitter->depth - 2;
+    int b_slot = emitter->depth - 1;
+    Operand* b = &emitter->stack[b_slot];
+
+    int at;
+    if ((op == OP_REG_ADD || op == OP_REG_SUBTRACT) && b->type == OPERAND_CONSTANT) {
+        int constant = b->index;
+        int a = operandRegister(emitter, a_slot);
+        at = emitter->code->count;
+        emitRegisters(emitter, op == OP_REG_ADD ? OP_REG_ADD_CONSTANT : OP_REG_SUBTRACT_CONSTANT,
+            a_slot, a);
+        emitShort(emitter, (uint16_t)constant);
+    }
+    else {
+        int a = operandRegister(emitter, a_slot);
+        int b_register = operandRegister(emitter, b_slot);
+        at = emitter->code->count;
+        emitRegisters(emitter, op, a_slot, a);
+        emitByte(emitter, (uint8_t)b_register);
+    }
+    markResult(emitter, at);
+
+    emitter->depth -= 2;
+    pushHome(emitter);
+}
+// the operands are loaded into their home registers, which are consecutive
+static void emitAddMany(RegisterEmitter* emitter, int count) {
+    int first = emitter->depth - count;
+    for (int slot = first; slot < emitter->depth; ++slot) {
+        materialize(emitter, slot);
+    }
+    int at = emitter->code->count;
+    emitRegisters(emitter, OP_REG_ADD_MANY, first, first);
+    emitByte(emitter, (uint8_t)count);
+    markResult(emitter, at);
+
+    emitter->depth -= count;
+    pushHome(emitter);
+}
+static void emitUnary(RegisterEmitter* emitter, uint8_t op) {
+    int slot = emitter->depth - 1;
+    int operand = operandRegister(emitter, slot);
+    emitRegisters(emitter, op, slot, operand);
+    markResult(emitter, emitter->code->count - 3);
+    emitter->stack[slot] = (Operand){ OPERAND_REGISTER, slot };
+}
+static void emitCompareJump(RegisterEmitter* emitter, uint8_t op, int target) {
+    int a_slot = emitter->depth - 2;
+    int b_slot = emitter->depth - 1;
+    materializeBelow(emitter, a_slot);
+    int a = operandRegister(emitter, a_slot);
+    int b = operandRegister(emitter, b_slot);
+    emitter->depth -= 2;
+
+    emitRegisters(emitter, op, a, b);
+    emitJump(emitter, target);
+}
+static void emitLocalConstant(RegisterEmitter* emitter, uint8_t op, int slot, int constant) {
+    materialize(emitter, slot);
+    pushHome(emitter);
+    emitRegisters(emitter, op, emitter->depth - 1, slot);
+    emitShort(emitter, (uint16_t)constant);
+    markResult(emitter, emitter->code->count - 5);
+}
+
+static bool isConditionalStackJump(uint8_t op) {
+    switch (op) {
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return true;
+    default:
+        return false;
+    }
+}
+static bool isStackJump(uint8_t op) {
+    switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool reachDepth(RegisterEmitter* emitter, int* worklist, int* count,
+    int offset, int depth)
+{
+    if (emitter->depth_at[offset] == -1) {
+        emitter->depth_at[offset] = depth;
+        worklist[(*count)++] = offset;
+        return true;
+    }
+    return emitter->depth_at[offset] == depth;
+}
+
+// Stack depth on entry to every reachable instruction. Code can be
+// reached by a backward jump alone, like the increment of a for loop,
+// so the depths are propagated along the jumps before anything is lowered.
+static bool computeDepths(RegisterEmitter* emitter) {
+    Chunk* chunk = emitter->source;
+    int* worklist = ARENA_ALLOCATE(&emitter->arena, int, chunk->count + 1);
+    int count = 0;
+    bool consistent = chunk->count == 0 || reachDepth(emitter, worklist, &count, 0, 0);
+
+    while (consistent && count > 0) {
+        int offset = worklist[--count];
+        uint8_t op = chunk->code[offset];
+        int depth = emitter->depth_at[offset] + stackEffect(chunk, offset);
+        if (depth < 0) {
+            consistent = false;
+            break;
+        }
+
+        if (isStackJump(op)) {
+            consistent = reachDepth(emitter, worklist, &count, jumpTarget(chunk, offset), depth);
+        }
+        if (consistent && op != OP_RETURN && (!isStackJump(op) || isConditionalStackJump(op))) {
+            int next = offset + instructionSize(chunk, offset);
+            consistent = next < chunk->count && reachDepth(emitter, worklist, &count, next, depth);
+        }
+    }
+
+    return consistent;
+}
+
+static void lowerInstruction(RegisterEmitter* emitter, int offset) {
+    uint8_t* code = &emitter->source->code[offset];
+    uint16_t operand16 = instructionSize(emitter->source, offset) == 3 ?
+        (uint16_t)((code[1] << 8) | code[2]) : 0;
+
+    switch (code[0]) {
+    case OP_CONSTANT:
+        pushOperand(emitter, OPERAND_CONSTANT, code[1]);
+        break;
+    case OP_CONSTANT_LONG: {
+        // the only little-endian operand of the stack set
+        pushOperand(emitter, OPERAND_CONSTANT, code[1] | (code[2] << 8));
+        break;
+    }
+    case OP_NIL: pushOperand(emitter, OPERAND_NIL, 0); break;
+    case OP_TRUE: pushOperand(emitter, OPERAND_TRUE, 0); break;
+    case OP_FALSE: pushOperand(emitter, OPERAND_FALSE, 0); break;
+    case OP_POP: emitter->depth--; break;
+    case OP_GET_LOCAL:
+        materialize(emitter, code[1]);
+        pushOperand(emitter, OPERAND_REGISTER, code[1]);
+        break;
+    case OP_SET_LOCAL:
+        storeLocal(emitter, code[1]);
+        break;
+    case OP_SET_LOCAL_POP:
+        storeLocal(emitter, code[1]);
+        emitter->depth--;
+        break;
+    case OP_GET_GLOBAL:
+        pushHome(emitter);
+        emitByte(emitter, OP_REG_GET_GLOBAL);
+        emitByte(emitter, (uint8_t)(emitter->depth - 1));
+        emitShort(emitter, operand16);
+        markResult(emitter, emitter->code->count - 4);
+        break;
+    case OP_DEFINE_GLOBAL:
+        storeGlobal(emitter, OP_REG_DEFINE_GLOBAL, operand16);
+        emitter->depth--;
+        break;
+    case OP_SET_GLOBAL:
+        storeGlobal(emitter, OP_REG_SET_GLOBAL, operand16);
+        break;
+    case OP_SET_GLOBAL_POP:
+        storeGlobal(emitter, OP_REG_SET_GLOBAL, operand16);
+        emitter->depth--;
+        break;
+    case OP_EQUAL: emitBinary(emitter, OP_REG_EQUAL); break;
+    case OP_GREATER: emitBinary(emitter, OP_REG_GREATER); break;
+    case OP_LESS: emitBinary(emitter, OP_REG_LESS); break;
+    case OP_ADD: emitBinary(emitter, OP_REG_ADD); break;
+    case OP_SUBTRACT: emitBinary(emitter, OP_REG_SUBTRACT); break;
+    case OP_MULTILPY: emitBinary(emitter, OP_REG_MULTIPLY); break;
+    case OP_DIVIDE: emitBinary(emitter, OP_REG_DIVIDE); break;
+    case OP_ADD_MANY: emitAddMany(emitter, code[1]); break;
+    case OP_NOT: emitUnary(emitter, OP_REG_NOT); break;
+    case OP_NEGATE: emitUnary(emitter, OP_REG_NEGATE); break;
+    case OP_PRINT: {
+        int value = operandRegister(emitter, emitter->depth - 1);
+        emitByte(emitter, OP_REG_PRINT);
+        emitByte(emitter, (uint8_t)value);
+        emitter->depth--;
+        break;
+    }
+    case OP_JUMP:
+        materializeBelow(emitter, emitter->depth);
+        emitByte(emitter, OP_REG_JUMP);
+        emitJump(emitter, jumpTarget(emitter->source, offset));
+        emitter->is_reachable = false;
+        break;
+    case OP_LOOP:
+        materializeBelow(emitter, emitter->depth);
+        emitLoop(emitter, jumpTarget(emitter->source, offset));
+        emitter->is_reachable = false;
+        break;
+    case OP_JUMP_IF_FALSE:
+        materializeBelow(emitter, emitter->depth);
+        emitByte(emitter, OP_REG_JUMP_IF_FALSE);
+        emitByte(emitter, (uint8_t)(emitter->depth - 1));
+        emitJump(emitter, jumpTarget(emitter->source, offset));
+        break;
+    case OP_JUMP_IF_NOT_LESS:
+        emitCompareJump(emitter, OP_REG_JUMP_IF_NOT_LESS, jumpTarget(emitter->source, offset));
+        break;
+    case OP_JUMP_IF_LESS:
+        emitCompareJump(emitter, OP_REG_JUMP_IF_LESS, jumpTarget(emitter->source, offset));
+        break;
+    case OP_JUMP_IF_NOT_GREATER:
+        emitCompareJump(emitter, OP_REG_JUMP_IF_NOT_GREATER, jumpTarget(emitter->source, offset));
+        break;
+    case OP_JUMP_IF_GREATER:
+        emitCompareJump(emitter, OP_REG_JUMP_IF_GREATER, jumpTarget(emitter->source, offset));
+        break;
+    case OP_JUMP_IF_NOT_EQUAL:
+        emitCompareJump(emitter, OP_REG_JUMP_IF_NOT_EQUAL, jumpTarget(emitter->source, offset));
+        break;
+    case OP_JUMP_IF_EQUAL:
+        emitCompareJump(emitter, OP_REG_JUMP_IF_EQUAL, jumpTarget(emitter->source, offset));
+        break;
+    case OP_ADD_LOCAL_CONSTANT:
+        emitLocalConstant(emitter, OP_REG_ADD_CONSTANT, code[1], code[2]);
+        break;
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+        emitLocalConstant(emitter, OP_REG_SUBTRACT_CONSTANT, code[1], code[2]);
+        break;
+    case OP_RETURN:
+        emitByte(emitter, OP_REG_RETURN);
+        emitter->is_reachable = false;
+        break;
+    default:
+        emitter->failed = true;
+        break;
+    }
+}
+
+static void patchJumps(RegisterEmitter* emitter) {
+    for (int i = 0; i < emitter->fixup_count; ++i) {
+        JumpFixup* fixup = &emitter->fixups[i];
+        int jump = emitter->offset_of[fixup->target] - fixup->after;
+        if (jump < 0 || jump > UINT16_MAX) {
+            emitter->failed = true;
+            return;
+        }
+        emitter->code->code[fixup->at] = (jump >> 8) & 0xff;
+        emitter->code->code[fixup->at + 1] = jump & 0xff;
+    }
+}
+
+bool emitRegisterChunk(VM* vm, Chunk* chunk, RegisterChunk* registers) {
+    initChunk(&registers->code);
+    registers->frame_size = 0;
+    for (int i = 0; i < chunk->constants.count; ++i) {
+        writeValueArray(vm, &registers->code.constants, chunk->constants.values[i]);
+    }
+
+    RegisterEmitter emitter;
+    emitter.vm = vm;
+    emitter.source = chunk;
+    emitter.code = &registers->code;
+    emitter.line = 0;
+    emitter.depth = 0;
+    emitter.frame_size = 0;
+    emitter.offset = 0;
+    emitter.result_at = -1;
+    emitter.result_end = -1;
+    emitter.is_reachable = true;
+    emitter.failed = false;
+    initArena(vm, &emitter.arena, MEMORY_SCRATCH);
+    emitter.is_target = ARENA_ALLOCATE(&emitter.arena, bool, chunk->count + 1);
+    emitter.depth_at = ARENA_ALLOCATE(&emitter.arena, int, chunk->count + 1);
+    emitter.offset_of = ARENA_ALLOCATE(&emitter.arena, int, chunk->count + 1);
+    emitter.fixups = NULL;
+    emitter.fixup_count = 0;
+    emitter.fixup_capacity = 0;
+
+    for (int offset = 0; offset <= chunk->count; ++offset) {
+        emitter.is_target[offset] = false;
+        emitter.depth_at[offset] = -1;
+    }
+    for (int offset = 0; offset < chunk->count; offset += instructionSize(chunk, offset)) {
+        if (isStackJump(chunk->code[offset])) {
+            emitter.is_target[jumpTarget(chunk, offset)] = true;
+        }
+    }
+
+    if (!computeDepths(&emitter)) emitter.failed = true;
+
+    LinesInfo* lines = &chunk->lines_info;
+    int run = 0;
+    int run_end = lines->count > 0 ? lines->counts[0] : 0;
+
+    for (int offset = 0; offset < chunk->count && !emitter.failed;
+        offset += instructionSize(chunk, offset))
+    {
+        while (offset >= run_end && run + 1 < lines->count) {
+            run_end += lines->counts[++run];
+        }
+        if (lines->count > 0) emitter.line = lines->lines[run];
+
+        if (!emitter.is_reachable && emitter.depth_at[offset] != -1) {
+            // only reached by jumps, every operand arrives home
+            emitter.is_reachable = true;
+            emitter.depth = 0;
+            while (emitter.depth < emitter.depth_at[offset]) pushHome(&emitter);
+        }
+        else if (emitter.is_reachable && emitter.is_target[offset]) {
+            materializeBelow(&emitter, emitter.depth);
+        }
+
+        emitter.offset = offset;
+        emitter.offset_of[offset] = emitter.code->count;
+        if (emitter.is_reachable) lowerInstruction(&emitter, offset);
+    }
+    emitter.offset_of[chunk->count] = emitter.code->count;
+
+    if (!emitter.failed) patchJumps(&emitter);
+    registers->frame_size = emitter.frame_size;
+
+    freeArena(&emitter.arena);
+
+    if (emitter.failed) freeRegisterChunk(vm, registers);
+    return !emitter.failed;
+}
+
+void freeRegisterChunk(VM* vm, RegisterChunk* registers) {
+    freeChunk(vm, &registers->code);
+    registers->frame_size = 0;
+}
\ No newline at end of file
@@ -0,0 +1,23 @@
+#ifndef clox_register_emitter_h
+#define clox_register_emitter_h
+
+#include "common/common.h"
+#include "common/chunk/chunk.h"
+
+// Register code for the --registers backend. The emitter lowers a
+// finished stack chunk: every stack slot becomes a register, locals keep
+// their slot and temporaries live in the register of the depth they were
+// pushed at. Reads of locals and constants are deferred until an
+// instruction consumes them, so most pushes disappear into the operands
+// of three-address instructions.
+typedef struct {
+    Chunk code; // RegisterOpCode instructions, constants share the stack chunk's indices
+    int frame_size;
+} RegisterChunk;
+
+// Returns false when the chunk needs more registers than a frame has,
+// the caller runs the stack code then.
+bool emitRegisterChunk(VM* vm, Chunk* chunk, RegisterChunk* registers);
+void freeRegisterChunk(VM* vm, RegisterChunk* registers);
+
+#endif // !clox_register_emitter_h
\ No newline at end of file
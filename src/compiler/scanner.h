@@ -30,7 +30,14 @@ typedef struct {
     int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+// where a compile is in its source, see compiler.c
+typedef struct {
+    const char* start;
+    const char* current;
+    int line;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif // !clox_scanner_h
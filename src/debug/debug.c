@@ -1,13 +1,15 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "common/common.h"
 #include "debug.h"
+#include "vm/vm.h"
 
-void disassebleChunk(Chunk* chunk, const char* name) {
+void disassebleChunk(VM* vm, Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
     
     for (int offset = 0; offset < chunk->count;) {
-        offset = disassembleInstruction(chunk, offset);        
+        offset = disassembleInstruction(vm, chunk, offset);        
     }
 }
 
@@ -28,14 +30,33 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
         offset + 3 + sign * jump);
     return offset + 3;
 }
-static int constantInstruction(const char* name, Chunk* chunk, int offset) {
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+    uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+    slot |= chunk->code[offset + 2];
+
+    printf("%-16s %4d '", name, slot);
+    if (slot < vm->global_count) {
+        printValue(vm, OBJ_VAL(vm->global_names[slot]));
+    }
+    printf("'\n");
+    return offset + 3;
+}
+static int constantInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
+    printValue(vm, chunk->constants.values[constant]);
     printf("'\n");
     return offset + 2;
 }
-static int longConstantInstruction(const char* name, Chunk* chunk, int offset) {
+static int localConstantInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '", name, slot, constant);
+    printValue(vm, chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+static int longConstantInstruction(VM* vm, const char* name, Chunk* chunk, int offset) {
     uint8_t* constant_code = &chunk->code[offset + 1];
     uint16_t constant = 0;
     uint8_t* constant_bytes = (uint8_t*)&constant;
@@ -43,12 +64,12 @@ static int longConstantInstruction(const char* name, Chunk* chunk, int offset) {
     constant_bytes[1] = constant_code[1];
 
     printf("%-16s %4d '", name, constant);
-    printValue(chunk->constants.values[constant]);
+    printValue(vm, chunk->constants.values[constant]);
     printf("'\n");
     return offset + 3;
 }
 
-int disassembleInstruction(Chunk* chunk, int offset) {
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset) {
     printf("%04d ", offset);
     if (offset > 0 && 
         getLine(&chunk->lines_info, offset) == getLine(&chunk->lines_info, offset - 1)) 
@@ -62,9 +83,9 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     uint8_t instruction = chunk->code[offset];
     switch (instruction) {
     case OP_CONSTANT:
-        return constantInstruction("OP_CONSTANT", chunk, offset);
+        return constantInstruction(vm, "OP_CONSTANT", chunk, offset);
     case OP_CONSTANT_LONG:
-        return longConstantInstruction("OP_CONSTANT_LONG", chunk, offset);
+        return longConstantInstruction(vm, "OP_CONSTANT_LONG", chunk, offset);
     case OP_NIL:
         return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:
@@ -78,11 +99,11 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_SET_LOCAL:
         return byteInstruction("OP_SET_LOCAL", chunk, offset);
     case OP_GET_GLOBAL:
-        return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+        return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset);
     case OP_SET_GLOBAL:
-        return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset);
     case OP_EQUAL:
         return simpleInstruction("OP_EQUAL", offset);
     case OP_GREATER:
@@ -111,9 +132,283 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         return jumpInstruction("OP_LOOP", -1, chunk, offset);
     case OP_RETURN:
         return simpleInstruction("OP_RETURN", offset);
+    case OP_JUMP_IF_NOT_LESS:
+        return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+    case OP_JUMP_IF_LESS:
+        return jumpInstruction("OP_JUMP_IF_LESS", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER:
+        return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+    case OP_JUMP_IF_GREATER:
+        return jumpInstruction("OP_JUMP_IF_GREATER", 1, chunk, offset);
+    case OP_JUMP_IF_NOT_EQUAL:
+        return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+    case OP_JUMP_IF_EQUAL:
+        return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+    case OP_ADD_LOCAL_CONSTANT:
+        return localConstantInstruction(vm, "OP_ADD_LOCAL_CONSTANT", chunk, offset);
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+        return localConstantInstruction(vm, "OP_SUBTRACT_LOCAL_CONSTANT", chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return byteInstruction("OP_SET_LOCAL_POP", chunk, offset);
+    case OP_SET_GLOBAL_POP:
+        return globalInstruction(vm, "OP_SET_GLOBAL_POP", chunk, offset);
+    case OP_ADD_MANY:
+        return byteInstruction("OP_ADD_MANY", chunk, offset);
     
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
     }
-}
\ No newline at end of file
+}
+
+void disassembleRegisterChunk(VM* vm, Chunk* chunk, const char* name) {
+    printf("== %s ==\n", name);
+
+    for (int offset = 0; offset < chunk->count;) {
+        offset = disassembleRegisterInstruction(vm, chunk, offset);
+    }
+}
+
+static uint16_t readShort(Chunk* chunk, int offset) {
+    return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+static void printConstant(VM* vm, Chunk* chunk, uint16_t constant) {
+    printf(" '");
+    printValue(vm, chunk->constants.values[constant]);
+    printf("'");
+}
+
+int disassembleRegisterInstruction(VM* vm, Chunk* chunk, int offset) {
+    printf("%04d ", offset);
+    if (offset > 0 &&
+        getLine(&chunk->lines_info, offset) == getLine(&chunk->lines_info, offset - 1))
+    {
+        printf("   | ");
+    }
+    else {
+        printf("%04d ", getLine(&chunk->lines_info, offset));
+    }
+
+    uint8_t instruction = chunk->code[offset];
+    uint8_t* operands = &chunk->code[offset + 1];
+    int size = registerInstructionSize(chunk, offset);
+    printf("%-28s", opcodeName(instruction));
+
+    switch (instruction) {
+    case OP_REG_LOAD_NIL:
+    case OP_REG_LOAD_TRUE:
+    case OP_REG_LOAD_FALSE:
+    case OP_REG_PRINT:
+        printf(" r%d", operands[0]);
+        break;
+    case OP_REG_MOVE:
+    case OP_REG_NOT:
+    case OP_REG_NEGATE:
+        printf(" r%d r%d", operands[0], operands[1]);
+        break;
+    case OP_REG_LOAD_CONSTANT: {
+        uint16_t constant = readShort(chunk, offset + 2);
+        printf(" r%d k%d", operands[0], constant);
+        printConstant(vm, chunk, constant);
+        break;
+    }
+    case OP_REG_GET_GLOBAL:
+    case OP_REG_DEFINE_GLOBAL:
+    case OP_REG_SET_GLOBAL: {
+        uint16_t slot = readShort(chunk, offset + 2);
+        printf(" r%d g%d '", operands[0], slot);
+        if (slot < vm->global_count) {
+            printValue(vm, OBJ_VAL(vm->global_names[slot]));
+        }
+        printf("'");
+        break;
+    }
+    case OP_REG_EQUAL:
+    case OP_REG_GREATER:
+    case OP_REG_LESS:
+    case OP_REG_ADD:
+    case OP_REG_SUBTRACT:
+    case OP_REG_MULTIPLY:
+    case OP_REG_DIVIDE:
+        printf(" r%d r%d r%d", operands[0], operands[1], operands[2]);
+        break;
+    case OP_REG_ADD_MANY:
+        printf(" r%d r%d %d", operands[0], operands[1], operands[2]);
+        break;
+    case OP_REG_ADD_CONSTANT:
+    case OP_REG_SUBTRACT_CONSTANT: {
+        uint16_t constant = readShort(chunk, offset + 3);
+        printf(" r%d r%d k%d", operands[0], operands[1], constant);
+        printConstant(vm, chunk, constant);
+        break;
+    }
+    case OP_REG_JUMP:
+        printf(" -> %d", offset + size + readShort(chunk, offset + 1));
+        break;
+    case OP_REG_LOOP:
+        printf(" -> %d", offset + size - readShort(chunk, offset + 1));
+        break;
+    case OP_REG_JUMP_IF_FALSE:
+        printf(" r%d -> %d", operands[0], offset + size + readShort(chunk, offset + 2));
+        break;
+    case OP_REG_JUMP_IF_NOT_LESS:
+    case OP_REG_JUMP_IF_LESS:
+    case OP_REG_JUMP_IF_NOT_GREATER:
+    case OP_REG_JUMP_IF_GREATER:
+    case OP_REG_JUMP_IF_NOT_EQUAL:
+    case OP_REG_JUMP_IF_EQUAL:
+        printf(" r%d r%d -> %d", operands[0], operands[1],
+            offset + size + readShort(chunk, offset + 3));
+        break;
+    case OP_REG_RETURN:
+        break;
+    default:
+        printf(" unknown opcode %d\n", instruction);
+        return offset + 1;
+    }
+    printf("\n");
+    return offset + size;
+}
+
+static const char* opcode_names[UINT8_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTILPY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_LESS] = "OP_JUMP_IF_LESS",
+    [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+    [OP_JUMP_IF_GREATER] = "OP_JUMP_IF_GREATER",
+    [OP_JUMP_IF_NOT_EQUAL] = "OP_JUMP_IF_NOT_EQUAL",
+    [OP_JUMP_IF_EQUAL] = "OP_JUMP_IF_EQUAL",
+    [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+    [OP_SUBTRACT_LOCAL_CONSTANT] = "OP_SUBTRACT_LOCAL_CONSTANT",
+    [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+    [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+    [OP_ADD_MANY] = "OP_ADD_MANY",
+    [OP_REG_MOVE] = "OP_REG_MOVE",
+    [OP_REG_LOAD_CONSTANT] = "OP_REG_LOAD_CONSTANT",
+    [OP_REG_LOAD_NIL] = "OP_REG_LOAD_NIL",
+    [OP_REG_LOAD_TRUE] = "OP_REG_LOAD_TRUE",
+    [OP_REG_LOAD_FALSE] = "OP_REG_LOAD_FALSE",
+    [OP_REG_GET_GLOBAL] = "OP_REG_GET_GLOBAL",
+    [OP_REG_DEFINE_GLOBAL] = "OP_REG_DEFINE_GLOBAL",
+    [OP_REG_SET_GLOBAL] = "OP_REG_SET_GLOBAL",
+    [OP_REG_EQUAL] = "OP_REG_EQUAL",
+    [OP_REG_GREATER] = "OP_REG_GREATER",
+    [OP_REG_LESS] = "OP_REG_LESS",
+    [OP_REG_ADD] = "OP_REG_ADD",
+    [OP_REG_SUBTRACT] = "OP_REG_SUBTRACT",
+    [OP_REG_MULTIPLY] = "OP_REG_MULTIPLY",
+    [OP_REG_DIVIDE] = "OP_REG_DIVIDE",
+    [OP_REG_ADD_CONSTANT] = "OP_REG_ADD_CONSTANT",
+    [OP_REG_SUBTRACT_CONSTANT] = "OP_REG_SUBTRACT_CONSTANT",
+    [OP_REG_NOT] = "OP_REG_NOT",
+    [OP_REG_NEGATE] = "OP_REG_NEGATE",
+    [OP_REG_PRINT] = "OP_REG_PRINT",
+    [OP_REG_JUMP] = "OP_REG_JUMP",
+    [OP_REG_LOOP] = "OP_REG_LOOP",
+    [OP_REG_JUMP_IF_FALSE] = "OP_REG_JUMP_IF_FALSE",
+    [OP_REG_JUMP_IF_NOT_LESS] = "OP_REG_JUMP_IF_NOT_LESS",
+    [OP_REG_JUMP_IF_LESS] = "OP_REG_JUMP_IF_LESS",
+    [OP_REG_JUMP_IF_NOT_GREATER] = "OP_REG_JUMP_IF_NOT_GREATER",
+    [OP_REG_JUMP_IF_GREATER] = "OP_REG_JUMP_IF_GREATER",
+    [OP_REG_JUMP_IF_NOT_EQUAL] = "OP_REG_JUMP_IF_NOT_EQUAL",
+    [OP_REG_JUMP_IF_EQUAL] = "OP_REG_JUMP_IF_EQUAL",
+    [OP_REG_RETURN] = "OP_REG_RETURN",
+    [OP_REG_ADD_MANY] = "OP_REG_ADD_MANY",
+};
+
+const char* opcodeName(uint8_t instruction) {
+    return opcode_names[instruction] != NULL ? opcode_names[instruction] : "OP_UNKNOWN";
+}
+
+#ifdef CLOX_PROFILE_OPCODES
+
+#define PROFILE_TOP_PAIRS 24
+
+typedef struct {
+    uint8_t first;
+    uint8_t second;
+    uint64_t count;
+} OpcodePair;
+
+static uint64_t opcode_counts[UINT8_COUNT];
+static uint64_t opcode_pair_counts[UINT8_COUNT][UINT8_COUNT];
+static int previous_instruction = -1;
+
+void profileInstruction(uint8_t instruction) {
+    opcode_counts[instruction]++;
+    if (previous_instruction != -1) {
+        opcode_pair_counts[previous_instruction][instruction]++;
+    }
+    previous_instruction = instruction;
+}
+
+static int comparePairs(const void* a, const void* b) {
+    uint64_t count_a = ((const OpcodePair*)a)->count;
+    uint64_t count_b = ((const OpcodePair*)b)->count;
+    return count_a < count_b ? 1 : count_a > count_b ? -1 : 0;
+}
+
+// Dynamic opcode and opcode pair frequencies, the data superinstructions
+// are picked from.
+void printOpcodeProfile() {
+    uint64_t total = 0;
+    for (int i = 0; i < UINT8_COUNT; ++i) {
+        total += opcode_counts[i];
+    }
+    if (total == 0) return;
+
+    fprintf(stderr, "== opcode profile: %llu instructions ==\n",
+        (unsigned long long)total);
+    for (int i = 0; i < UINT8_COUNT; ++i) {
+        if (opcode_counts[i] == 0) continue;
+        fprintf(stderr, "%-28s %12llu %6.2f%%\n", opcodeName((uint8_t)i),
+            (unsigned long long)opcode_counts[i], 100.0 * opcode_counts[i] / total);
+    }
+
+    OpcodePair* pairs = malloc(sizeof(OpcodePair) * UINT8_COUNT * UINT8_COUNT);
+    if (pairs == NULL) return;
+
+    int pair_count = 0;
+    for (int first = 0; first < UINT8_COUNT; ++first) {
+        for (int second = 0; second < UINT8_COUNT; ++second) {
+            uint64_t count = opcode_pair_counts[first][second];
+            if (count == 0) continue;
+            pairs[pair_count++] = (OpcodePair){ (uint8_t)first, (uint8_t)second, count };
+        }
+    }
+    qsort(pairs, pair_count, sizeof(OpcodePair), comparePairs);
+
+    fprintf(stderr, "== top opcode pairs ==\n");
+    for (int i = 0; i < pair_count && i < PROFILE_TOP_PAIRS; ++i) {
+        fprintf(stderr, "%-20s -> %-20s %12llu %6.2f%%\n",
+            opcodeName(pairs[i].first), opcodeName(pairs[i].second),
+            (unsigned long long)pairs[i].count, 100.0 * pairs[i].count / total);
+    }
+    free(pairs);
+}
+
+#endif // CLOX_PROFILE_OPCODES
\ No newline at end of file
@@ -3,7 +3,15 @@
 
 #include "common/chunk/chunk.h"
 
-void disassebleChunk(Chunk* chunk, const char* name);
-int disassembleInstruction(Chunk* chunk, int offset);
+void disassebleChunk(VM* vm, Chunk* chunk, const char* name);
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset);
+void disassembleRegisterChunk(VM* vm, Chunk* chunk, const char* name);
+int disassembleRegisterInstruction(VM* vm, Chunk* chunk, int offset);
+const char* opcodeName(uint8_t instruction);
+
+#ifdef CLOX_PROFILE_OPCODES
+void profileInstruction(uint8_t instruction);
+void printOpcodeProfile();
+#endif // CLOX_PROFILE_OPCODES
 
 #endif
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "common/common.h"
 #include "common/memory/memory.h"
@@ -11,9 +12,9 @@ void initLinesInfo(LinesInfo* lines_info) {
     lines_info->lines = NULL;
     lines_info->counts = NULL;
 }
-void freeLinesInfo(LinesInfo* lines_info) {
-    FREE_ARRAY(int, lines_info->lines, lines_info->capacity);
-    FREE_ARRAY(int, lines_info->counts, lines_info->capacity);
+// lines and counts share one allocation, counts start at lines + capacity
+void freeLinesInfo(VM* vm, LinesInfo* lines_info) {
+    FREE_ARRAY(vm, int, lines_info->lines, 2 * lines_info->capacity, MEMORY_LINES);
     initLinesInfo(lines_info);
 }
 
@@ -26,30 +27,50 @@ static bool checkSameLine(LinesInfo* lines_info, int line) {
     int last_line = lines_info->lines[last_line_idx];
     return last_line == line;
 }
-static void updateLinesInfoSize(LinesInfo* lines_info, int line) {
+static void updateLinesInfoSize(VM* vm, LinesInfo* lines_info, int line) {
     if (lines_info->capacity >= lines_info->count + 1) {
         return;
     }
 
+    // one allocation, so running out of memory leaves both arrays as they were
     int old_capacity = lines_info->capacity;
-    lines_info->capacity = GROW_CAPACITY(old_capacity);
-    lines_info->counts = GROW_ARRAY(int, lines_info->counts,
-        old_capacity, lines_info->capacity);
-    lines_info->lines = GROW_ARRAY(int, lines_info->lines,
-        old_capacity, lines_info->capacity);
+    int capacity = GROW_CAPACITY(old_capacity);
+    int* lines = ALLOCATE(vm, int, 2 * capacity, MEMORY_LINES);
+    int* counts = lines + capacity;
+    if (lines_info->count > 0) {
+        memcpy(lines, lines_info->lines, sizeof(int) * lines_info->count);
+        memcpy(counts, lines_info->counts, sizeof(int) * lines_info->count);
+    }
+    FREE_ARRAY(vm, int, lines_info->lines, 2 * old_capacity, MEMORY_LINES);
+    lines_info->lines = lines;
+    lines_info->counts = counts;
+    lines_info->capacity = capacity;
 }
-void writeLinesInfo(LinesInfo* lines_info, int line) {
+void writeLinesInfo(VM* vm, LinesInfo* lines_info, int line) {
     if (checkSameLine(lines_info, line)) {
         lines_info->counts[lines_info->count - 1]++;
         return;
     }
     
-    updateLinesInfoSize(lines_info, line);
+    updateLinesInfoSize(vm, lines_info, line);
 
     lines_info->lines[lines_info->count] = line;
     lines_info->counts[lines_info->count] = 1;
     lines_info->count++;
 }
+// drops the runs of the last drop_count bytes, walking from the end since
+// the compiler only ever takes back what it just emitted
+void dropLinesInfo(LinesInfo* lines_info, int drop_count) {
+    while (drop_count > 0 && lines_info->count > 0) {
+        int last = lines_info->count - 1;
+        if (drop_count < lines_info->counts[last]) {
+            lines_info->counts[last] -= drop_count;
+            return;
+        }
+        drop_count -= lines_info->counts[last];
+        lines_info->count--;
+    }
+}
 int getLine(LinesInfo* lines_info, int byte_idx) {
     int idx = 0;
     for (int i = 0; i < lines_info->count; ++i) {
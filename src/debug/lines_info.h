@@ -9,8 +9,9 @@ typedef struct {
 } LinesInfo;
 
 void initLinesInfo(LinesInfo* lines_info);
-void freeLinesInfo(LinesInfo* lines_info);
-void writeLinesInfo(LinesInfo* lines_info, int line);
+void freeLinesInfo(VM* vm, LinesInfo* lines_info);
+void writeLinesInfo(VM* vm, LinesInfo* lines_info, int line);
+void dropLinesInfo(LinesInfo* lines_info, int drop_count);
 int getLine(LinesInfo* lines_info, int byte_idx);
 
 #endif
\ No newline at end of file
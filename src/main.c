@@ -1,10 +1,52 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "common/chunk/chunk_file.h"
+#include "common/hash/hash.h"
+#include "common/memory/memory.h"
+#include "common/task/task_pool.h"
+#include "compiler/optimizer.h"
 #include "vm/vm.h"
 
-static void repl() {
+// command line settings, every VM main() sets up gets them
+static int optimize_level = 0;
+static bool use_registers = false;
+static bool use_jit = true;
+// directory of compiled chunks keyed by source hash, NULL when not caching
+static const char* cache_dir = NULL;
+// bytes a script may hold, 0 for no limit
+static size_t heap_limit = 0;
+static bool heap_stats = false;
+// --hash-seed, otherwise every VM picks a random one
+static bool has_hash_seed = false;
+static uint64_t hash_seed = 0;
+// --share-strings, one intern table for the string constants of every VM
+#define SHARED_STRINGS_CAPACITY (64 * 1024)
+static bool share_strings = false;
+static SharedStrings shared_strings;
+
+static void setUpVM(VM* vm) {
+    initVM(vm, NULL);
+    vm->heap.limit = heap_limit;
+    vm->optimize_level = optimize_level;
+    vm->use_registers = use_registers;
+    vm->jit_enabled = vm->jit_enabled && use_jit;
+    // no string is hashed yet
+    if (has_hash_seed) vm->hash_state = hashState(hash_seed);
+    if (share_strings) shareStrings(vm, &shared_strings);
+}
+
+// atexit, once no VM runs anymore
+static void freeSharedStringsAtExit() {
+    freeSharedStrings(&shared_strings);
+}
+
+static void repl(VM* vm) {
     char line[1024];
     for (;;) {
         printf("> ");
@@ -13,15 +55,16 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        interpret(vm, line);
     }
 }
 
-static char* readFile(const char* path) {
+// NULL after reporting the error to err
+static char* readFile(const char* path, FILE* err) {
     FILE* file = fopen(path, "rb");
     if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+        fprintf(err, "Could not open file \"%s\".\n", path);
+        return NULL;
     }
 
     fseek(file, 0L, SEEK_END);
@@ -30,44 +73,477 @@ static char* readFile(const char* path) {
 
     char* buffer = (char*)malloc(fileSize + 1);
     if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+        fprintf(err, "Not enough memory to read \"%s\".\n", path);
+        fclose(file);
+        return NULL;
     }
     
     size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    fclose(file);
     if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+        fprintf(err, "Could not read file \"%s\".\n", path);
+        free(buffer);
+        return NULL;
     }
     buffer[bytesRead] = '\0';
-
-    fclose(file);
     return buffer;
 }
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
+
+static bool hasExtension(const char* path, const char* extension) {
+    size_t length = strlen(path);
+    size_t extension_length = strlen(extension);
+    return length > extension_length &&
+        strcmp(path + length - extension_length, extension) == 0;
+}
+
+// creates every missing directory on the way to path
+static bool makeDirectories(const char* path) {
+    char* partial = (char*)malloc(strlen(path) + 1);
+    strcpy(partial, path);
+    for (char* at = partial + 1; ; ++at) {
+        if (*at != '/' && *at != '\0') continue;
+
+        char separator = *at;
+        *at = '\0';
+        struct stat info;
+        if (stat(partial, &info) != 0 && mkdir(partial, 0755) != 0) {
+            free(partial);
+            return false;
+        }
+        *at = separator;
+        if (separator == '\0') break;
+    }
+    free(partial);
+    return true;
+}
+
+// Looks the source up in cache_dir and runs the stored chunk, which skips
+// the scanner and the compiler. A miss compiles as usual and stores the
+// chunk for the next run.
+static InterpretResult interpretCached(VM* vm, const char* source) {
+    ChunkFileKey key = chunkFileKey(source, optimize_level);
+    size_t path_length = strlen(cache_dir) + 48;
+    char* path = (char*)malloc(path_length);
+    snprintf(path, path_length, "%s/%016llx-O%d.loxc", cache_dir,
+        (unsigned long long)key.source_hash, optimize_level);
+
+    InterpretResult result;
+    LoadedChunk loaded;
+    if (loadChunkFile(vm, path, &key, &loaded) == CHUNK_FILE_OK) {
+        result = interpretChunk(vm, &loaded.chunk);
+        freeLoadedChunk(vm, &loaded);
+    }
+    else {
+        Chunk chunk;
+        initChunk(&chunk);
+        result = compileSource(vm, source, &chunk, false);
+        if (result == INTERPRET_OK) {
+            if (makeDirectories(cache_dir)) writeChunkFile(vm, &chunk, key, path);
+            result = interpretChunk(vm, &chunk);
+        }
+        freeChunk(vm, &chunk);
+    }
+
+    free(path);
+    return result;
+}
+
+// the exit status of a run
+static int exitStatus(InterpretResult result) {
+    switch (result) {
+    case INTERPRET_COMPILE_ERROR: return 65;
+    case INTERPRET_RUNTIME_ERROR: return 70;
+    default: return 0;
+    }
+}
+
+static int runChunkFile(VM* vm, const char* path) {
+    LoadedChunk loaded;
+    ChunkFileResult loaded_result = loadChunkFile(vm, path, NULL, &loaded);
+    if (loaded_result == CHUNK_FILE_IO_ERROR) {
+        fprintf(vm->err, "Could not open file \"%s\".\n", path);
+        return 74;
+    }
+    if (loaded_result != CHUNK_FILE_OK) {
+        fprintf(vm->err, "\"%s\" is not a chunk file of this clox version.\n", path);
+        return 65;
+    }
+
+    InterpretResult result = interpretChunk(vm, &loaded.chunk);
+    freeLoadedChunk(vm, &loaded);
+    if (heap_stats) printHeapStats(vm, vm->err);
+    return exitStatus(result);
+}
+
+// runs a script or a .loxc file, errors go to vm->err
+static int runFile(VM* vm, const char* path) {
+    if (hasExtension(path, ".loxc")) return runChunkFile(vm, path);
+
+    char* source = readFile(path, vm->err);
+    if (source == NULL) return 74;
+    InterpretResult result = cache_dir != NULL ? interpretCached(vm, source) : interpret(vm, source);
+    free(source);
+    if (heap_stats) printHeapStats(vm, vm->err);
+    return exitStatus(result);
+}
+
+// --compile, writes the chunk of path to out_path without running it
+static void compileFile(VM* vm, const char* path, const char* out_path) {
+    char* source = readFile(path, stderr);
+    if (source == NULL) exit(74);
+    Chunk chunk;
+    initChunk(&chunk);
+    InterpretResult compiled = compileSource(vm, source, &chunk, false);
+    bool written = compiled == INTERPRET_OK &&
+        writeChunkFile(vm, &chunk, chunkFileKey(source, optimize_level), out_path);
+    freeChunk(vm, &chunk);
+    free(source);
+
+    if (compiled != INTERPRET_OK) exit(exitStatus(compiled));
+    if (!written) {
+        fprintf(stderr, "Could not write file \"%s\".\n", out_path);
+        exit(74);
+    }
+}
+
+// Runs the script on the interpreter and again with every loop compiled on
+// its first back-edge, then compares what the two runs printed.
+static void runDifferential(const char* path) {
+    char* source = readFile(path, stderr);
+    if (source == NULL) exit(74);
+    char* outputs[2];
+    size_t sizes[2];
+    InterpretResult results[2];
+
+    for (int i = 0; i < 2; ++i) {
+        VM vm;
+        setUpVM(&vm);
+        bool with_jit = i == 1;
+        vm.jit_enabled = vm.jit_enabled && with_jit;
+        vm.jit_threshold = 1;
+        vm.out = open_memstream(&outputs[i], &sizes[i]);
+        if (vm.out == NULL) {
+            fprintf(stderr, "Could not capture the output of \"%s\".\n", path);
+            exit(74);
+        }
+
+        results[i] = interpret(&vm, source);
+        fclose(vm.out);
+        if (with_jit && !vm.jit_enabled) {
+            fprintf(stderr, "This build has no JIT, both runs used the interpreter.\n");
+        }
+        freeVM(&vm);
+    }
     free(source);
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    fwrite(outputs[0], 1, sizes[0], stdout);
+    bool same = results[0] == results[1] && sizes[0] == sizes[1] &&
+        memcmp(outputs[0], outputs[1], sizes[0]) == 0;
+    if (!same) {
+        size_t at = 0;
+        while (at < sizes[0] && at < sizes[1] && outputs[0][at] == outputs[1][at]) at++;
+        fprintf(stderr, "JIT and interpreter differ at output byte %zu "
+            "(results %d and %d).\n", at, results[0], results[1]);
+    }
+    free(outputs[0]);
+    free(outputs[1]);
+
+    if (!same) exit(1);
+    if (results[0] != INTERPRET_OK) exit(exitStatus(results[0]));
+}
+
+// one script of a --jobs or --manifest run
+typedef struct {
+    const char* path;
+    char* out;      // what it printed
+    size_t out_size;
+    char* err;      // its errors and heap stats
+    size_t err_size;
+    int status;     // what running it alone would exit with
+    double seconds;
+    bool is_done;
+} BatchScript;
+
+typedef struct {
+    BatchScript* scripts;
+    VM* vms;        // one per worker
+    pthread_mutex_t lock;
+    pthread_cond_t script_done;
+} Batch;
+
+static double monotonicSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static void runBatchScript(void* context, int worker, int index) {
+    Batch* batch = (Batch*)context;
+    BatchScript* script = &batch->scripts[index];
+    double start = monotonicSeconds();
+
+    FILE* out = open_memstream(&script->out, &script->out_size);
+    FILE* err = open_memstream(&script->err, &script->err_size);
+    if (out == NULL || err == NULL) {
+        script->status = 74;
+    }
+    else {
+        // set up again for every script so that no globals carry over
+        VM* vm = &batch->vms[worker];
+        setUpVM(vm);
+        vm->out = out;
+        vm->err = err;
+        script->status = runFile(vm, script->path);
+        freeVM(vm);
+    }
+    if (out != NULL) fclose(out);
+    if (err != NULL) fclose(err);
+    script->seconds = monotonicSeconds() - start;
+
+    pthread_mutex_lock(&batch->lock);
+    script->is_done = true;
+    pthread_cond_broadcast(&batch->script_done);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+// Runs the scripts on a pool of worker threads. Their output is printed
+// in the order given as each finishes, one script's in one piece, followed
+// by a line with its exit status and run time. Returns the status of the
+// first script that failed.
+static int runBatch(const char** paths, int count, int jobs) {
+    Batch batch;
+    batch.scripts = (BatchScript*)calloc(count > 0 ? count : 1, sizeof(BatchScript));
+    batch.vms = (VM*)malloc(sizeof(VM) * jobs);
+    if (batch.scripts == NULL || batch.vms == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(71);
+    }
+    for (int i = 0; i < count; ++i) batch.scripts[i].path = paths[i];
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.script_done, NULL);
+
+    double start = monotonicSeconds();
+    TaskPool pool;
+    if (!startTaskPool(&pool, jobs, count, runBatchScript, &batch)) {
+        fprintf(stderr, "Could not start worker threads.\n");
+        exit(71);
+    }
+
+    int status = 0;
+    int failed = 0;
+    for (int i = 0; i < count; ++i) {
+        BatchScript* script = &batch.scripts[i];
+        pthread_mutex_lock(&batch.lock);
+        while (!script->is_done) pthread_cond_wait(&batch.script_done, &batch.lock);
+        pthread_mutex_unlock(&batch.lock);
+
+        if (script->out_size > 0) fwrite(script->out, 1, script->out_size, stdout);
+        fflush(stdout);
+        if (script->err_size > 0) fwrite(script->err, 1, script->err_size, stderr);
+        fprintf(stderr, "%s: exit %d in %.3f ms\n", script->path, script->status, script->seconds * 1e3);
+        if (script->status != 0) {
+            failed++;
+            if (status == 0) status = script->status;
+        }
+        free(script->out);
+        free(script->err);
+    }
+    joinTaskPool(&pool);
+    fprintf(stderr, "%d scripts, %d failed, %.3f s on %d workers\n",
+        count, failed, monotonicSeconds() - start, jobs);
+
+    pthread_cond_destroy(&batch.script_done);
+    pthread_mutex_destroy(&batch.lock);
+    free(batch.vms);
+    free(batch.scripts);
+    return status;
+}
+
+// appends the paths listed in a manifest, one per line, skipping blank
+// lines and # comments; the paths point into the returned buffer
+static char* readManifest(const char* path, const char*** paths, int* count) {
+    char* text = readFile(path, stderr);
+    if (text == NULL) exit(74);
+
+    for (char* line = text; *line != '\0';) {
+        char* end = line + strcspn(line, "\r\n");
+        char* next = end + strspn(end, "\r\n");
+        *end = '\0';
+        while (*line == ' ' || *line == '\t') line++;
+        if (*line != '\0' && *line != '#') {
+            *paths = (const char**)realloc(*paths, sizeof(const char*) * (*count + 1));
+            if (*paths == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(71);
+            }
+            (*paths)[(*count)++] = line;
+        }
+        line = next;
+    }
+    return text;
+}
+
+// a byte count with an optional k, m or g suffix, 0 when it is not one
+static size_t parseSize(const char* text) {
+    char* end;
+    unsigned long long size = strtoull(text, &end, 10);
+    if (end == text) return 0;
+
+    int shift = 0;
+    switch (*end) {
+    case 'k': shift = 10; end++; break;
+    case 'm': shift = 20; end++; break;
+    case 'g': shift = 30; end++; break;
+    default: break;
+    }
+    if (*end != '\0' || size > (SIZE_MAX >> shift)) return 0;
+    return (size_t)size << shift;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [-O<level>] [--registers] [--no-jit] [--differential] "
+        "[--cache[=dir]] [--heap-limit=size[k|m|g]] [--heap-stats] [--hash-seed=n] "
+        "[--share-strings] [--compile path [-o out]] [--jobs n] [--manifest list] [path...]\n");
+    exit(64);
 }
 
 int main(int argc, const char* argv[]) {
-    initVM();
+    bool differential = false;
+    const char* compile_path = NULL;
+    const char* out_path = NULL;
+    const char* manifest_path = NULL;
+    int jobs = 0;
+    const char** paths = (const char**)malloc(sizeof(const char*) * argc);
+    int path_count = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strncmp(argv[i], "-O", 2) == 0) {
+            char* end;
+            long level = strtol(argv[i] + 2, &end, 10);
+            if (argv[i][2] == '\0') level = 1;
+            else if (*end != '\0' || level < 0) usage();
+            optimize_level = level > OPTIMIZE_MAX_LEVEL ? OPTIMIZE_MAX_LEVEL : (int)level;
+        }
+        else if (strcmp(argv[i], "--registers") == 0) {
+            use_registers = true;
+        }
+        else if (strcmp(argv[i], "--no-jit") == 0) {
+            use_jit = false;
+        }
+        else if (strcmp(argv[i], "--differential") == 0) {
+            differential = true;
+        }
+        else if (strcmp(argv[i], "--cache") == 0) {
+            const char* home = getenv("HOME");
+            static char default_dir[1024];
+            snprintf(default_dir, sizeof(default_dir), "%s/.cache/clox", home != NULL ? home : ".");
+            cache_dir = default_dir;
+        }
+        else if (strncmp(argv[i], "--cache=", 8) == 0 && argv[i][8] != '\0') {
+            cache_dir = argv[i] + 8;
+        }
+        else if (strncmp(argv[i], "--heap-limit=", 13) == 0) {
+            heap_limit = parseSize(argv[i] + 13);
+            if (heap_limit == 0) usage();
+        }
+        else if (strcmp(argv[i], "--heap-stats") == 0) {
+            heap_stats = true;
+        }
+        else if (strncmp(argv[i], "--hash-seed=", 12) == 0) {
+            char* end;
+            unsigned long long seed = strtoull(argv[i] + 12, &end, 0);
+            if (argv[i][12] == '\0' || *end != '\0') usage();
+            hash_seed = seed;
+            has_hash_seed = true;
+        }
+        else if (strcmp(argv[i], "--share-strings") == 0) {
+            share_strings = true;
+        }
+        else if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+            compile_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            char* end;
+            long count = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || count < 1 || count > 1024) usage();
+            jobs = (int)count;
+        }
+        else if (strcmp(argv[i], "--manifest") == 0 && i + 1 < argc) {
+            manifest_path = argv[++i];
+        }
+        else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            usage();
+        }
+        else {
+            paths[path_count++] = argv[i];
+        }
+    }
+    const char* path = path_count > 0 ? paths[0] : NULL;
+
+    if (share_strings) {
+        uint64_t seed = has_hash_seed ? hash_seed : randomHashSeed();
+        if (!initSharedStrings(&shared_strings, SHARED_STRINGS_CAPACITY, hashState(seed))) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(71);
+        }
+        atexit(freeSharedStringsAtExit);
+    }
+
+    if (compile_path != NULL) {
+        if (path != NULL || differential || jobs > 0 || manifest_path != NULL) usage();
+        char default_out[1024];
+        if (out_path == NULL) {
+            int stem = (int)strlen(compile_path) - (hasExtension(compile_path, ".lox") ? 4 : 0);
+            snprintf(default_out, sizeof(default_out), "%.*s.loxc", stem, compile_path);
+            out_path = default_out;
+        }
 
-    if (argc == 1) {
-        runFile("input.txt");
-        //repl();
+        VM vm;
+        setUpVM(&vm);
+        compileFile(&vm, compile_path, out_path);
+        free(paths);
+        freeVM(&vm);
+        return 0;
     }
-    else if (argc == 2) {
-        runFile(argv[1]);
+    if (out_path != NULL) usage();
+
+    if (jobs > 0 || manifest_path != NULL) {
+        if (differential) usage();
+        char* manifest = NULL;
+        if (manifest_path != NULL) manifest = readManifest(manifest_path, &paths, &path_count);
+        if (jobs == 0) {
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+            jobs = cores > 0 ? (int)cores : 1;
+        }
+        // no point in threads that only find empty deques
+        if (jobs > path_count) jobs = path_count > 0 ? path_count : 1;
+
+        int status = runBatch(paths, path_count, jobs);
+        free(manifest);
+        free(paths);
+        return status;
+    }
+    if (path_count > 1) usage();
+    free(paths);
+
+    if (differential) {
+        runDifferential(path != NULL ? path : "input.txt");
+        return 0;
+    }
+
+    VM vm;
+    setUpVM(&vm);
+    int status;
+    if (path == NULL) {
+        status = runFile(&vm, "input.txt");
+        //repl(&vm);
     }
     else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        status = runFile(&vm, path);
     }
 
-    freeVM();
-    return 0;
+    freeVM(&vm);
+    return status;
 }
\ No newline at end of file
@@ -0,0 +1,968 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "jit.h"
+#include "common/memory/arena.h"
+#include "common/memory/memory.h"
+#include "vm.h"
+
+// Native code keeps no state of its own between instructions. Every value
+// stays in its vm->stack slot, and since the stack depth at each
+// instruction is known when the loop is compiled, so is each slot's
+// address. That makes every instruction boundary a place where control
+// can go back to run(): an exit only has to say where to resume and how
+// deep the stack is there.
+//
+// A compiled loop covers the bytecode from its header to its OP_LOOP,
+// widened to the headers of any back-edges inside it. Jumps that leave
+// the region exit to the interpreter, and so does every instruction the
+// JIT does not translate.
+
+typedef enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7, R12 = 12, R13 = 13
+} Register;
+
+typedef enum {
+    XMM0 = 0, XMM1 = 1, XMM2 = 2
+} XmmRegister;
+
+// condition codes of jcc and setcc, -1 stands for an unconditional jmp
+typedef enum {
+    CC_ALWAYS = -1,
+    CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_P = 0xa, CC_NP = 0xb, CC_LE = 0xe
+} Condition;
+
+// native code keeps vm->stack in rbx, vm->global_values in r12 and
+// vm->budget_countdown in r13
+#define STACK RBX
+#define GLOBALS R12
+#define BUDGET R13
+#define SLOT(index) ((int)((index) * sizeof(Value)))
+
+typedef uint64_t (*JitFunction)(Value* stack, Value* globals, int entry);
+
+// what native code returns: where run() resumes, the stack depth there
+// and whether a guard failed
+#define EXIT_CODE(offset, depth, is_guard) \
+    ((uint64_t)(offset) | ((uint64_t)(depth) << 32) | ((uint64_t)(is_guard) << 63))
+#define EXIT_OFFSET(code) ((int)((code) & 0xffffffff))
+#define EXIT_DEPTH(code) ((int)(((code) >> 32) & 0x7fffffff))
+#define EXIT_IS_GUARD(code) (((code) >> 63) != 0)
+
+typedef struct {
+    int offset;
+    int depth;
+} JitEntry;
+
+struct JitLoop {
+    JitFunction function;
+    void* memory;
+    size_t size;
+    int entry_count;
+    int guard_exits;
+    bool is_disabled;
+    JitLoop* next;
+    JitEntry entries[]; // loop headers native code can be entered at
+};
+
+typedef enum {
+    LABEL_BYTECODE,
+    LABEL_EXIT,
+    LABEL_EPILOGUE
+} LabelType;
+
+typedef struct {
+    int at; // rel32 field in the native code
+    LabelType type;
+    int target; // bytecode offset or exit index
+} Fixup;
+
+typedef struct {
+    int offset;
+    int depth;
+    bool is_guard;
+    int native; // offset of the exit stub
+} Exit;
+
+typedef struct {
+    VM* vm;      // print calls back into it
+    Chunk* chunk;
+    Arena arena; // every array below, freed with the assembler
+    int start; // the region is [start, end) of the bytecode
+    int end;
+    int* depth_at;  // region offset -> stack depth, -1 when unreachable
+    int* native_at; // region offset -> native offset
+    uint8_t* code;
+    int count;
+    int capacity;
+    Fixup* fixups;
+    int fixup_count;
+    int fixup_capacity;
+    Exit* exits;
+    int exit_count;
+    int exit_capacity;
+    int epilogue;
+} Assembler;
+
+static void emitByte(Assembler* as, uint8_t byte) {
+    if (as->capacity < as->count + 1) {
+        int old_capacity = as->capacity;
+        as->capacity = GROW_CAPACITY(old_capacity);
+        as->code = ARENA_GROW_ARRAY(&as->arena, uint8_t, as->code, old_capacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+static void emitInt32(Assembler* as, int32_t value) {
+    for (int i = 0; i < 4; ++i) emitByte(as, (uint8_t)(((uint32_t)value >> (8 * i)) & 0xff));
+}
+static void emitInt64(Assembler* as, uint64_t value) {
+    for (int i = 0; i < 8; ++i) emitByte(as, (uint8_t)((value >> (8 * i)) & 0xff));
+}
+static void patchInt32(Assembler* as, int at, int32_t value) {
+    for (int i = 0; i < 4; ++i) as->code[at + i] = (uint8_t)(((uint32_t)value >> (8 * i)) & 0xff);
+}
+
+// x86-64 encoding
+
+static void emitRex(Assembler* as, bool wide, int reg, int base) {
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((base & 8) ? 0x01 : 0);
+    if (rex != 0x40) emitByte(as, rex);
+}
+// [base + disp32], reg is a register or an opcode extension
+static void emitMemory(Assembler* as, int reg, int base, int disp) {
+    emitByte(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) emitByte(as, 0x24);
+    emitInt32(as, disp);
+}
+static void emitDirect(Assembler* as, int reg, int rm) {
+    emitByte(as, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void movImm64(Assembler* as, Register reg, uint64_t value) {
+    emitRex(as, true, 0, reg);
+    emitByte(as, 0xb8 | (reg & 7));
+    emitInt64(as, value);
+}
+static void movRegReg(Assembler* as, Register dst, Register src) {
+    emitRex(as, true, src, dst);
+    emitByte(as, 0x89);
+    emitDirect(as, src, dst);
+}
+static void movLoad(Assembler* as, Register reg, Register base, int disp) {
+    emitRex(as, true, reg, base);
+    emitByte(as, 0x8b);
+    emitMemory(as, reg, base, disp);
+}
+static void movStore(Assembler* as, Register base, int disp, Register reg) {
+    emitRex(as, true, reg, base);
+    emitByte(as, 0x89);
+    emitMemory(as, reg, base, disp);
+}
+static void lea(Assembler* as, Register reg, Register base, int disp) {
+    emitRex(as, true, reg, base);
+    emitByte(as, 0x8d);
+    emitMemory(as, reg, base, disp);
+}
+static void cmpRegImm8(Assembler* as, Register reg, int8_t value) {
+    emitRex(as, true, 0, reg);
+    emitByte(as, 0x83);
+    emitDirect(as, 7, reg);
+    emitByte(as, (uint8_t)value);
+}
+static void decReg(Assembler* as, Register reg) {
+    emitRex(as, true, 0, reg);
+    emitByte(as, 0xff);
+    emitDirect(as, 1, reg);
+}
+static void cmpEdxImm32(Assembler* as, int32_t value) {
+    emitByte(as, 0x81);
+    emitDirect(as, 7, RDX);
+    emitInt32(as, value);
+}
+// emitters only one Value layout needs
+#ifdef CLOX_NAN_BOXING
+static void addRegReg(Assembler* as, Register dst, Register src) {
+    emitRex(as, true, src, dst);
+    emitByte(as, 0x01);
+    emitDirect(as, src, dst);
+}
+static void andRegReg(Assembler* as, Register dst, Register src) {
+    emitRex(as, true, src, dst);
+    emitByte(as, 0x21);
+    emitDirect(as, src, dst);
+}
+static void cmpRegReg(Assembler* as, Register a, Register b) {
+    emitRex(as, true, b, a);
+    emitByte(as, 0x39);
+    emitDirect(as, b, a);
+}
+static void orRegImm8(Assembler* as, Register reg, uint8_t value) {
+    emitRex(as, true, 0, reg);
+    emitByte(as, 0x83);
+    emitDirect(as, 1, reg);
+    emitByte(as, value);
+}
+#else
+static void storeImm32(Assembler* as, Register base, int disp, int32_t value) {
+    emitRex(as, false, 0, base);
+    emitByte(as, 0xc7);
+    emitMemory(as, 0, base, disp);
+    emitInt32(as, value);
+}
+static void cmpImm32(Assembler* as, Register base, int disp, int32_t value) {
+    emitRex(as, false, 0, base);
+    emitByte(as, 0x81);
+    emitMemory(as, 7, base, disp);
+    emitInt32(as, value);
+}
+static void cmpByteImm8(Assembler* as, Register base, int disp, uint8_t value) {
+    emitRex(as, false, 0, base);
+    emitByte(as, 0x80);
+    emitMemory(as, 7, base, disp);
+    emitByte(as, value);
+}
+#endif // CLOX_NAN_BOXING
+static void xorByteImm8(Assembler* as, Register base, int disp, uint8_t value) {
+    emitRex(as, false, 0, base);
+    emitByte(as, 0x80);
+    emitMemory(as, 6, base, disp);
+    emitByte(as, value);
+}
+// SSE instruction on a register and memory, prefix 0 for none
+static void sseMemory(Assembler* as, uint8_t prefix, uint8_t op,
+    XmmRegister xmm, Register base, int disp)
+{
+    if (prefix != 0) emitByte(as, prefix);
+    emitRex(as, false, xmm, base);
+    emitByte(as, 0x0f);
+    emitByte(as, op);
+    emitMemory(as, xmm, base, disp);
+}
+static void sseDirect(Assembler* as, uint8_t prefix, uint8_t op, XmmRegister dst, XmmRegister src) {
+    if (prefix != 0) emitByte(as, prefix);
+    emitByte(as, 0x0f);
+    emitByte(as, op);
+    emitDirect(as, dst, src);
+}
+static void movqXmmReg(Assembler* as, XmmRegister xmm, Register reg) {
+    emitByte(as, 0x66);
+    emitRex(as, true, xmm, reg);
+    emitByte(as, 0x0f);
+    emitByte(as, 0x6e);
+    emitDirect(as, xmm, reg);
+}
+// setcc on al or cl
+static void setcc(Assembler* as, Condition cc, Register reg) {
+    emitByte(as, 0x0f);
+    emitByte(as, 0x90 | cc);
+    emitDirect(as, 0, reg);
+}
+static void andAlCl(Assembler* as) {
+    emitByte(as, 0x20);
+    emitDirect(as, RCX, RAX);
+}
+static void movzxEaxAl(Assembler* as) {
+    emitByte(as, 0x0f);
+    emitByte(as, 0xb6);
+    emitDirect(as, RAX, RAX);
+}
+static void pushReg(Assembler* as, Register reg) {
+    emitRex(as, false, 0, reg);
+    emitByte(as, 0x50 | (reg & 7));
+}
+static void popReg(Assembler* as, Register reg) {
+    emitRex(as, false, 0, reg);
+    emitByte(as, 0x58 | (reg & 7));
+}
+static void callReg(Assembler* as, Register reg) {
+    emitRex(as, false, 0, reg);
+    emitByte(as, 0xff);
+    emitDirect(as, 2, reg);
+}
+
+#define MOVSD_LOAD 0xf2, 0x10
+#define MOVSD_STORE 0xf2, 0x11
+#define MOVUPS_LOAD 0x00, 0x10
+#define MOVUPS_STORE 0x00, 0x11
+#define ADDSD 0xf2, 0x58
+#define SUBSD 0xf2, 0x5c
+#define MULSD 0xf2, 0x59
+#define DIVSD 0xf2, 0x5e
+#define UCOMISD 0x66, 0x2e
+
+// jumps
+
+static void emitJump(Assembler* as, Condition cc, LabelType type, int target) {
+    if (cc == CC_ALWAYS) {
+        emitByte(as, 0xe9);
+    }
+    else {
+        emitByte(as, 0x0f);
+        emitByte(as, 0x80 | cc);
+    }
+
+    if (as->fixup_capacity < as->fixup_count + 1) {
+        int old_capacity = as->fixup_capacity;
+        as->fixup_capacity = GROW_CAPACITY(old_capacity);
+        as->fixups = ARENA_GROW_ARRAY(&as->arena, Fixup, as->fixups, old_capacity, as->fixup_capacity);
+    }
+    as->fixups[as->fixup_count++] = (Fixup){ as->count, type, target };
+    emitInt32(as, 0);
+}
+// jcc to a spot later in the same instruction, see patchHere()
+static int jumpForward(Assembler* as, Condition cc) {
+    emitByte(as, 0x0f);
+    emitByte(as, 0x80 | cc);
+    emitInt32(as, 0);
+    return as->count - 4;
+}
+static void patchHere(Assembler* as, int at) {
+    patchInt32(as, at, as->count - (at + 4));
+}
+
+static bool inRegion(Assembler* as, int offset) {
+    return offset >= as->start && offset < as->end;
+}
+static int depthAt(Assembler* as, int offset) {
+    return as->depth_at[offset - as->start];
+}
+
+static int exitIndex(Assembler* as, int offset, int depth, bool is_guard) {
+    for (int i = 0; i < as->exit_count; ++i) {
+        Exit* exit = &as->exits[i];
+        if (exit->offset == offset && exit->depth == depth && exit->is_guard == is_guard) return i;
+    }
+
+    if (as->exit_capacity < as->exit_count + 1) {
+        int old_capacity = as->exit_capacity;
+        as->exit_capacity = GROW_CAPACITY(old_capacity);
+        as->exits = ARENA_GROW_ARRAY(&as->arena, Exit, as->exits, old_capacity, as->exit_capacity);
+    }
+    as->exits[as->exit_count] = (Exit){ offset, depth, is_guard, -1 };
+    return as->exit_count++;
+}
+// goes to the bytecode at target, in native code while it stays in the region
+static void jumpToBytecode(Assembler* as, Condition cc, int target, int depth) {
+    if (inRegion(as, target) && depthAt(as, target) != -1) {
+        emitJump(as, cc, LABEL_BYTECODE, target);
+    }
+    else {
+        emitJump(as, cc, LABEL_EXIT, exitIndex(as, target, depth, false));
+    }
+}
+// hands the instruction at offset to the interpreter
+static void guard(Assembler* as, Condition cc, int offset) {
+    emitJump(as, cc, LABEL_EXIT, exitIndex(as, offset, depthAt(as, offset), true));
+}
+
+// Value layout
+
+#ifdef CLOX_NAN_BOXING
+
+#define NUMBER_AT 0
+
+static void copyValue(Assembler* as, Register dst_base, int dst, Register src_base, int src) {
+    movLoad(as, RAX, src_base, src);
+    movStore(as, dst_base, dst, RAX);
+}
+static void storeValue(Assembler* as, Register base, int disp, Value value) {
+    movImm64(as, RAX, value);
+    movStore(as, base, disp, RAX);
+}
+static void guardNumber(Assembler* as, Register base, int disp, int offset) {
+    movLoad(as, RAX, base, disp);
+    movImm64(as, RCX, QNAN);
+    andRegReg(as, RAX, RCX);
+    cmpRegReg(as, RAX, RCX);
+    guard(as, CC_E, offset);
+}
+static void storeNumber(Assembler* as, Register base, int disp, XmmRegister xmm) {
+    sseMemory(as, MOVSD_STORE, xmm, base, disp);
+}
+// stores eax, which is 0 or 1, as a bool
+static void storeBool(Assembler* as, Register base, int disp) {
+    movImm64(as, RCX, FALSE_VAL);
+    addRegReg(as, RAX, RCX);
+    movStore(as, base, disp, RAX);
+}
+static void guardDefined(Assembler* as, Register base, int disp, int offset) {
+    movLoad(as, RAX, base, disp);
+    movImm64(as, RCX, UNDEFINED_VAL);
+    cmpRegReg(as, RAX, RCX);
+    guard(as, CC_E, offset);
+}
+static void jumpIfFalsey(Assembler* as, Register base, int disp, int target, int depth) {
+    movLoad(as, RAX, base, disp);
+    movImm64(as, RCX, NIL_VAL);
+    cmpRegReg(as, RAX, RCX);
+    jumpToBytecode(as, CC_E, target, depth);
+    movImm64(as, RCX, FALSE_VAL);
+    cmpRegReg(as, RAX, RCX);
+    jumpToBytecode(as, CC_E, target, depth);
+}
+static void guardBool(Assembler* as, Register base, int disp, int offset) {
+    movLoad(as, RAX, base, disp);
+    orRegImm8(as, RAX, 1);
+    movImm64(as, RCX, TRUE_VAL);
+    cmpRegReg(as, RAX, RCX);
+    guard(as, CC_NE, offset);
+}
+// true and false only differ in the lowest bit
+static void flipBool(Assembler* as, Register base, int disp) {
+    xorByteImm8(as, base, disp, 1);
+}
+
+#else
+
+#define TYPE_AT ((int)offsetof(Value, type))
+#define NUMBER_AT ((int)offsetof(Value, as))
+
+_Static_assert(sizeof(ValueType) == 4, "the JIT compares Value.type as a dword");
+_Static_assert(sizeof(Value) == 16, "the JIT copies a Value with one movups");
+
+static void copyValue(Assembler* as, Register dst_base, int dst, Register src_base, int src) {
+    sseMemory(as, MOVUPS_LOAD, XMM2, src_base, src);
+    sseMemory(as, MOVUPS_STORE, XMM2, dst_base, dst);
+}
+static void storeValue(Assembler* as, Register base, int disp, Value value) {
+    uint64_t payload;
+    memcpy(&payload, &value.as, sizeof(payload));
+    storeImm32(as, base, disp + TYPE_AT, value.type);
+    movImm64(as, RAX, payload);
+    movStore(as, base, disp + NUMBER_AT, RAX);
+}
+static void guardNumber(Assembler* as, Register base, int disp, int offset) {
+    cmpImm32(as, base, disp + TYPE_AT, VAL_NUMBER);
+    guard(as, CC_NE, offset);
+}
+static void storeNumber(Assembler* as, Register base, int disp, XmmRegister xmm) {
+    storeImm32(as, base, disp + TYPE_AT, VAL_NUMBER);
+    sseMemory(as, MOVSD_STORE, xmm, base, disp + NUMBER_AT);
+}
+// stores eax, which is 0 or 1, as a bool
+static void storeBool(Assembler* as, Register base, int disp) {
+    storeImm32(as, base, disp + TYPE_AT, VAL_BOOL);
+    movStore(as, base, disp + NUMBER_AT, RAX);
+}
+static void guardDefined(Assembler* as, Register base, int disp, int offset) {
+    cmpImm32(as, base, disp + TYPE_AT, VAL_UNDEFINED);
+    guard(as, CC_E, offset);
+}
+static void jumpIfFalsey(Assembler* as, Register base, int disp, int target, int depth) {
+    cmpImm32(as, base, disp + TYPE_AT, VAL_NIL);
+    jumpToBytecode(as, CC_E, target, depth);
+    cmpImm32(as, base, disp + TYPE_AT, VAL_BOOL);
+    int truthy = jumpForward(as, CC_NE);
+    cmpByteImm8(as, base, disp + NUMBER_AT, 0);
+    jumpToBytecode(as, CC_E, target, depth);
+    patchHere(as, truthy);
+}
+static void guardBool(Assembler* as, Register base, int disp, int offset) {
+    cmpImm32(as, base, disp + TYPE_AT, VAL_BOOL);
+    guard(as, CC_NE, offset);
+}
+static void flipBool(Assembler* as, Register base, int disp) {
+    xorByteImm8(as, base, disp + NUMBER_AT, 1);
+}
+
+#endif // CLOX_NAN_BOXING
+
+// compiled loops leave vm->stack_top at the loop entry, move it above the
+// value so that flattening it cannot collect what the loop still holds
+static void jitPrint(VM* vm, Value* value) {
+    vm->stack_top = value + 1;
+    fprintValue(vm, vm->out, *value);
+    fprintf(vm->out, "\n");
+}
+
+// instructions
+
+static void guardNumbers(Assembler* as, int depth, int offset) {
+    guardNumber(as, STACK, SLOT(depth - 2), offset);
+    guardNumber(as, STACK, SLOT(depth - 1), offset);
+}
+static void emitArithmetic(Assembler* as, uint8_t prefix, uint8_t op, int depth, int offset) {
+    guardNumbers(as, depth, offset);
+    sseMemory(as, MOVSD_LOAD, XMM0, STACK, SLOT(depth - 2) + NUMBER_AT);
+    sseMemory(as, prefix, op, XMM0, STACK, SLOT(depth - 1) + NUMBER_AT);
+    // the left operand already is a number, only its payload changes
+    sseMemory(as, MOVSD_STORE, XMM0, STACK, SLOT(depth - 2) + NUMBER_AT);
+}
+// the sum of count numbers replaces the first of them
+static void emitAddMany(Assembler* as, int count, int depth, int offset) {
+    int first = depth - count;
+    for (int i = first; i < depth; ++i) {
+        guardNumber(as, STACK, SLOT(i), offset);
+    }
+    sseMemory(as, MOVSD_LOAD, XMM0, STACK, SLOT(first) + NUMBER_AT);
+    for (int i = first + 1; i < depth; ++i) {
+        sseMemory(as, ADDSD, XMM0, STACK, SLOT(i) + NUMBER_AT);
+    }
+    sseMemory(as, MOVSD_STORE, XMM0, STACK, SLOT(first) + NUMBER_AT);
+}
+// sets the flags as ucomisd left, right does for the two operands,
+// 'swapped' compares right with left instead
+static void compareNumbers(Assembler* as, int depth, int offset, bool swapped) {
+    guardNumbers(as, depth, offset);
+    int left = SLOT(depth - (swapped ? 1 : 2)) + NUMBER_AT;
+    int right = SLOT(depth - (swapped ? 2 : 1)) + NUMBER_AT;
+    sseMemory(as, MOVSD_LOAD, XMM0, STACK, left);
+    sseMemory(as, UCOMISD, XMM0, STACK, right);
+}
+static void emitLocalConstant(Assembler* as, uint8_t prefix, uint8_t op,
+    int slot, Value constant, int depth, int offset)
+{
+    if (!IS_NUMBER(constant)) {
+        guard(as, CC_ALWAYS, offset);
+        return;
+    }
+
+    double number = AS_NUMBER(constant);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+
+    guardNumber(as, STACK, SLOT(slot), offset);
+    sseMemory(as, MOVSD_LOAD, XMM0, STACK, SLOT(slot) + NUMBER_AT);
+    movImm64(as, RAX, bits);
+    movqXmmReg(as, XMM1, RAX);
+    sseDirect(as, prefix, op, XMM0, XMM1);
+    storeNumber(as, STACK, SLOT(depth), XMM0);
+}
+
+static void emitInstruction(Assembler* as, int offset, int depth) {
+    Chunk* chunk = as->chunk;
+    uint8_t* code = &chunk->code[offset];
+    int top = SLOT(depth - 1);
+    int below = SLOT(depth - 2);
+
+    switch (code[0]) {
+    case OP_CONSTANT:
+        storeValue(as, STACK, SLOT(depth), chunk->constants.values[code[1]]);
+        break;
+    case OP_CONSTANT_LONG:
+        storeValue(as, STACK, SLOT(depth), chunk->constants.values[code[1] | (code[2] << 8)]);
+        break;
+    case OP_NIL: storeValue(as, STACK, SLOT(depth), NIL_VAL); break;
+    case OP_TRUE: storeValue(as, STACK, SLOT(depth), BOOL_VAL(true)); break;
+    case OP_FALSE: storeValue(as, STACK, SLOT(depth), BOOL_VAL(false)); break;
+    case OP_POP: break;
+    case OP_GET_LOCAL:
+        copyValue(as, STACK, SLOT(depth), STACK, SLOT(code[1]));
+        break;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+        copyValue(as, STACK, SLOT(code[1]), STACK, top);
+        break;
+    case OP_GET_GLOBAL: {
+        int global = SLOT((code[1] << 8) | code[2]);
+        guardDefined(as, GLOBALS, global, offset);
+        copyValue(as, STACK, SLOT(depth), GLOBALS, global);
+        break;
+    }
+    case OP_DEFINE_GLOBAL:
+        copyValue(as, GLOBALS, SLOT((code[1] << 8) | code[2]), STACK, top);
+        break;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP: {
+        int global = SLOT((code[1] << 8) | code[2]);
+        guardDefined(as, GLOBALS, global, offset);
+        copyValue(as, GLOBALS, global, STACK, top);
+        break;
+    }
+    case OP_EQUAL:
+        // equal and ordered, NaN is not equal to itself
+        compareNumbers(as, depth, offset, false);
+        setcc(as, CC_E, RAX);
+        setcc(as, CC_NP, RCX);
+        andAlCl(as);
+        movzxEaxAl(as);
+        storeBool(as, STACK, below);
+        break;
+    case OP_GREATER:
+        compareNumbers(as, depth, offset, false);
+        setcc(as, CC_A, RAX);
+        movzxEaxAl(as);
+        storeBool(as, STACK, below);
+        break;
+    case OP_LESS:
+        compareNumbers(as, depth, offset, true);
+        setcc(as, CC_A, RAX);
+        movzxEaxAl(as);
+        storeBool(as, STACK, below);
+        break;
+    case OP_ADD: emitArithmetic(as, ADDSD, depth, offset); break;
+    case OP_SUBTRACT: emitArithmetic(as, SUBSD, depth, offset); break;
+    case OP_MULTILPY: emitArithmetic(as, MULSD, depth, offset); break;
+    case OP_DIVIDE: emitArithmetic(as, DIVSD, depth, offset); break;
+    case OP_ADD_MANY: emitAddMany(as, code[1], depth, offset); break;
+    case OP_NOT:
+        guardBool(as, STACK, top, offset);
+        flipBool(as, STACK, top);
+        break;
+    case OP_NEGATE:
+        guardNumber(as, STACK, top, offset);
+        xorByteImm8(as, STACK, top + NUMBER_AT + 7, 0x80);
+        break;
+    case OP_PRINT:
+        movImm64(as, RDI, (uint64_t)(uintptr_t)as->vm);
+        lea(as, RSI, STACK, top);
+        movImm64(as, RAX, (uint64_t)(uintptr_t)jitPrint);
+        callReg(as, RAX);
+        break;
+    case OP_JUMP:
+        jumpToBytecode(as, CC_ALWAYS, jumpTarget(chunk, offset), depth);
+        break;
+    case OP_LOOP:
+        // the last back-edge of a countdown is left to run(), which looks
+        // at the budget and may yield there
+        cmpRegImm8(as, BUDGET, 1);
+        emitJump(as, CC_LE, LABEL_EXIT, exitIndex(as, offset, depth, false));
+        decReg(as, BUDGET);
+        jumpToBytecode(as, CC_ALWAYS, jumpTarget(chunk, offset), depth);
+        break;
+    case OP_JUMP_IF_FALSE:
+        jumpIfFalsey(as, STACK, top, jumpTarget(chunk, offset), depth);
+        break;
+    case OP_JUMP_IF_NOT_LESS:
+        compareNumbers(as, depth, offset, true);
+        jumpToBytecode(as, CC_BE, jumpTarget(chunk, offset), depth - 2);
+        break;
+    case OP_JUMP_IF_LESS:
+        compareNumbers(as, depth, offset, true);
+        jumpToBytecode(as, CC_A, jumpTarget(chunk, offset), depth - 2);
+        break;
+    case OP_JUMP_IF_NOT_GREATER:
+        compareNumbers(as, depth, offset, false);
+        jumpToBytecode(as, CC_BE, jumpTarget(chunk, offset), depth - 2);
+        break;
+    case OP_JUMP_IF_GREATER:
+        compareNumbers(as, depth, offset, false);
+        jumpToBytecode(as, CC_A, jumpTarget(chunk, offset), depth - 2);
+        break;
+    case OP_JUMP_IF_NOT_EQUAL:
+        compareNumbers(as, depth, offset, false);
+        jumpToBytecode(as, CC_P, jumpTarget(chunk, offset), depth - 2);
+        jumpToBytecode(as, CC_NE, jumpTarget(chunk, offset), depth - 2);
+        break;
+    case OP_JUMP_IF_EQUAL: {
+        compareNumbers(as, depth, offset, false);
+        int unordered = jumpForward(as, CC_P);
+        jumpToBytecode(as, CC_E, jumpTarget(chunk, offset), depth - 2);
+        patchHere(as, unordered);
+        break;
+    }
+    case OP_ADD_LOCAL_CONSTANT:
+        emitLocalConstant(as, ADDSD, code[1], chunk->constants.values[code[2]], depth, offset);
+        break;
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+        emitLocalConstant(as, SUBSD, code[1], chunk->constants.values[code[2]], depth, offset);
+        break;
+    default:
+        guard(as, CC_ALWAYS, offset);
+        break;
+    }
+}
+
+static bool isUnconditional(uint8_t op) {
+    return op == OP_JUMP || op == OP_LOOP || op == OP_RETURN;
+}
+static bool isJump(uint8_t op) {
+    switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// widens [start, end) until it holds the header of every back-edge in it
+static int loopStart(Chunk* chunk, int start, int end) {
+    int offset = start;
+    while (offset < end) {
+        if (chunk->code[offset] == OP_LOOP && jumpTarget(chunk, offset) < start) {
+            start = jumpTarget(chunk, offset);
+            offset = start;
+            continue;
+        }
+        offset += instructionSize(chunk, offset);
+    }
+    return start;
+}
+
+static bool reachDepth(Assembler* as, int* worklist, int* count, int offset, int depth) {
+    if (!inRegion(as, offset)) return true;
+
+    int* known = &as->depth_at[offset - as->start];
+    if (*known == -1) {
+        *known = depth;
+        worklist[(*count)++] = offset;
+        return true;
+    }
+    return *known == depth;
+}
+
+// stack depths across the region, from the depth run() is at in the header
+static bool computeDepths(Assembler* as, int entry, int entry_depth) {
+    int size = as->end - as->start;
+    int* worklist = ARENA_ALLOCATE(&as->arena, int, size);
+    int count = 0;
+    bool consistent = reachDepth(as, worklist, &count, entry, entry_depth);
+
+    while (consistent && count > 0) {
+        int offset = worklist[--count];
+        uint8_t op = as->chunk->code[offset];
+        int depth = depthAt(as, offset) + stackEffect(as->chunk, offset);
+        if (depth < 0 || depth >= STACK_MAX) {
+            consistent = false;
+            break;
+        }
+
+        if (isJump(op)) {
+            consistent = reachDepth(as, worklist, &count, jumpTarget(as->chunk, offset), depth);
+        }
+        if (consistent && !isUnconditional(op)) {
+            consistent = reachDepth(as, worklist, &count,
+                offset + instructionSize(as->chunk, offset), depth);
+        }
+    }
+
+    return consistent;
+}
+
+static void emitPrologue(Assembler* as, JitEntry* entries, int entry_count) {
+    pushReg(as, RBX);
+    pushReg(as, R12);
+    pushReg(as, BUDGET); // the third push keeps calls out of native code 16-byte aligned
+    movRegReg(as, STACK, RDI);
+    movRegReg(as, GLOBALS, RSI);
+    movImm64(as, RAX, (uint64_t)(uintptr_t)&as->vm->budget_countdown);
+    movLoad(as, BUDGET, RAX, 0);
+
+    for (int i = 0; i < entry_count - 1; ++i) {
+        cmpEdxImm32(as, entries[i].offset);
+        emitJump(as, CC_E, LABEL_BYTECODE, entries[i].offset);
+    }
+    emitJump(as, CC_ALWAYS, LABEL_BYTECODE, entries[entry_count - 1].offset);
+}
+
+static void emitEpilogue(Assembler* as) {
+    for (int i = 0; i < as->exit_count; ++i) {
+        Exit* exit = &as->exits[i];
+        exit->native = as->count;
+        movImm64(as, RAX, EXIT_CODE(exit->offset, exit->depth, exit->is_guard));
+        emitJump(as, CC_ALWAYS, LABEL_EPILOGUE, 0);
+    }
+
+    as->epilogue = as->count;
+    movImm64(as, RCX, (uint64_t)(uintptr_t)&as->vm->budget_countdown);
+    movStore(as, RCX, 0, BUDGET);
+    popReg(as, BUDGET);
+    popReg(as, R12);
+    popReg(as, RBX);
+    emitByte(as, 0xc3);
+}
+
+static void resolveFixups(Assembler* as) {
+    for (int i = 0; i < as->fixup_count; ++i) {
+        Fixup* fixup = &as->fixups[i];
+        int destination;
+        switch (fixup->type) {
+        case LABEL_BYTECODE: destination = as->native_at[fixup->target - as->start]; break;
+        case LABEL_EXIT: destination = as->exits[fixup->target].native; break;
+        default: destination = as->epilogue; break;
+        }
+        patchInt32(as, fixup->at, destination - (fixup->at + 4));
+    }
+}
+
+static void* mapCode(uint8_t* code, size_t size) {
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return NULL;
+
+    memcpy(memory, code, size);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return NULL;
+    }
+    return memory;
+}
+
+static void freeAssembler(Assembler* as) {
+    freeArena(&as->arena);
+}
+
+static JitLoop* compileLoop(VM* vm, Jit* jit, int loop_offset, int header) {
+    Chunk* chunk = jit->chunk;
+    Assembler as;
+    as.vm = vm;
+    as.chunk = chunk;
+    as.end = loop_offset + instructionSize(chunk, loop_offset);
+    as.start = loopStart(chunk, header, as.end);
+    int size = as.end - as.start;
+    initArena(vm, &as.arena, MEMORY_JIT);
+    as.depth_at = ARENA_ALLOCATE(&as.arena, int, size);
+    as.native_at = ARENA_ALLOCATE(&as.arena, int, size);
+    as.code = NULL;
+    as.count = 0;
+    as.capacity = 0;
+    as.fixups = NULL;
+    as.fixup_count = 0;
+    as.fixup_capacity = 0;
+    as.exits = NULL;
+    as.exit_count = 0;
+    as.exit_capacity = 0;
+    as.epilogue = 0;
+    for (int i = 0; i < size; ++i) {
+        as.depth_at[i] = -1;
+        as.native_at[i] = 0;
+    }
+
+    if (!computeDepths(&as, header, (int)(vm->stack_top - vm->stack))) {
+        freeAssembler(&as);
+        return NULL;
+    }
+
+    // every reachable back-edge header is an entry, the one run() is at first
+    JitEntry* entries = ARENA_ALLOCATE(&as.arena, JitEntry, size);
+    int entry_count = 0;
+    entries[entry_count++] = (JitEntry){ header, depthAt(&as, header) };
+    for (int offset = as.start; offset < as.end; offset += instructionSize(chunk, offset)) {
+        if (chunk->code[offset] != OP_LOOP || depthAt(&as, offset) == -1) continue;
+
+        int target = jumpTarget(chunk, offset);
+        if (depthAt(&as, target) == -1) continue;
+        bool is_known = false;
+        for (int i = 0; i < entry_count; ++i) {
+            if (entries[i].offset == target) is_known = true;
+        }
+        if (!is_known) entries[entry_count++] = (JitEntry){ target, depthAt(&as, target) };
+    }
+
+    emitPrologue(&as, entries, entry_count);
+    for (int offset = as.start; offset < as.end; offset += instructionSize(chunk, offset)) {
+        as.native_at[offset - as.start] = as.count;
+        int depth = depthAt(&as, offset);
+        if (depth == -1) continue;
+
+        emitInstruction(&as, offset, depth);
+
+        uint8_t op = chunk->code[offset];
+        int next = offset + instructionSize(chunk, offset);
+        if (!isUnconditional(op) && !inRegion(&as, next)) {
+            jumpToBytecode(&as, CC_ALWAYS, next, depth + stackEffect(chunk, offset));
+        }
+    }
+    emitEpilogue(&as);
+    resolveFixups(&as);
+
+    // allocated before the code is mapped, running out of memory here
+    // leaves nothing behind
+    JitLoop* loop = (JitLoop*)reallocate(vm, NULL, 0,
+        sizeof(JitLoop) + sizeof(JitEntry) * entry_count, MEMORY_JIT);
+    void* memory = mapCode(as.code, (size_t)as.count);
+    if (memory == NULL) {
+        reallocate(vm, loop, sizeof(JitLoop) + sizeof(JitEntry) * entry_count, 0, MEMORY_JIT);
+        freeAssembler(&as);
+        return NULL;
+    }
+
+#ifdef DEBUG_PRINT_CODE
+    printf("== jit loop %04d-%04d: %d bytes, %d entries, %d exits ==\n",
+        as.start, as.end, as.count, entry_count, as.exit_count);
+#endif // DEBUG_PRINT_CODE
+
+    loop->function = (JitFunction)memory;
+    loop->memory = memory;
+    loop->size = (size_t)as.count;
+    memcpy(loop->entries, entries, sizeof(JitEntry) * entry_count);
+    loop->entry_count = entry_count;
+    loop->guard_exits = 0;
+    loop->is_disabled = false;
+    loop->next = jit->loops;
+    jit->loops = loop;
+
+    for (int i = 0; i < entry_count; ++i) {
+        int entry = loop->entries[i].offset;
+        if (jit->loop_at[entry] == NULL) jit->loop_at[entry] = loop;
+    }
+
+    freeAssembler(&as);
+    return loop;
+}
+
+void initJit(Jit* jit, Chunk* chunk) {
+    jit->chunk = chunk;
+    jit->capacity = 0;
+    jit->loop_counts = NULL;
+    jit->loop_at = NULL;
+    jit->loops = NULL;
+}
+
+void freeJit(VM* vm, Jit* jit) {
+    JitLoop* loop = jit->loops;
+    while (loop != NULL) {
+        JitLoop* next = loop->next;
+        munmap(loop->memory, loop->size);
+        reallocate(vm, loop, sizeof(JitLoop) + sizeof(JitEntry) * loop->entry_count, 0, MEMORY_JIT);
+        loop = next;
+    }
+
+    FREE_ARRAY(vm, int, jit->loop_counts, jit->capacity, MEMORY_JIT);
+    FREE_ARRAY(vm, JitLoop*, jit->loop_at, jit->capacity, MEMORY_JIT);
+    initJit(jit, NULL);
+}
+
+static void enterLoop(VM* vm, Jit* jit, JitLoop* loop, int header) {
+    int depth = (int)(vm->stack_top - vm->stack);
+    bool can_enter = false;
+    for (int i = 0; i < loop->entry_count; ++i) {
+        if (loop->entries[i].offset == header) can_enter = loop->entries[i].depth == depth;
+    }
+    if (!can_enter) return;
+
+    uint64_t exit = loop->function(vm->stack, vm->global_values, header);
+    vm->ip = jit->chunk->code + EXIT_OFFSET(exit);
+    vm->stack_top = vm->stack + EXIT_DEPTH(exit);
+    if (EXIT_IS_GUARD(exit) && ++loop->guard_exits > JIT_MAX_GUARD_EXITS) {
+        loop->is_disabled = true;
+    }
+}
+
+void jitBackEdge(VM* vm, Jit* jit, int loop_offset) {
+    Chunk* chunk = jit->chunk;
+    if (jit->loop_counts == NULL) {
+        jit->capacity = chunk->count;
+        // freeJit skips an array that running out of memory left NULL
+        jit->loop_counts = ALLOCATE(vm, int, jit->capacity, MEMORY_JIT);
+        jit->loop_at = ALLOCATE(vm, JitLoop*, jit->capacity, MEMORY_JIT);
+        for (int i = 0; i < jit->capacity; ++i) {
+            jit->loop_counts[i] = 0;
+            jit->loop_at[i] = NULL;
+        }
+    }
+
+    int header = (int)(vm->ip - chunk->code);
+    JitLoop* loop = jit->loop_at[header];
+    if (loop == NULL) {
+        int* count = &jit->loop_counts[loop_offset];
+        if (*count < 0 || ++*count < vm->jit_threshold) return;
+
+        loop = compileLoop(vm, jit, loop_offset, header);
+        if (loop == NULL) {
+            *count = -1;
+            return;
+        }
+    }
+    if (!loop->is_disabled) enterLoop(vm, jit, loop, header);
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common/common.h"
+#include "common/chunk/chunk.h"
+
+// Baseline JIT for hot loops, built with CLOX_JIT on x86-64 Linux.
+// run() reports every taken OP_LOOP; once a back-edge has been taken
+// vm->jit_threshold times the loop is compiled to native code that works
+// on vm->stack in place. Type checks are guards: when one fails the native
+// code returns and the interpreter resumes at the guarded instruction.
+// Native back-edges count down vm->budget_countdown like run() and leave
+// the last one of a countdown to it, so that compiled loops yield too.
+#define JIT_HOT_LOOP_THRESHOLD 1000
+// loops that keep failing their guards go back to the interpreter for good
+#define JIT_MAX_GUARD_EXITS 64
+
+typedef struct JitLoop JitLoop;
+
+typedef struct {
+    Chunk* chunk;
+    int capacity;        // chunk size the arrays below were made for
+    int* loop_counts;    // taken back-edges per OP_LOOP offset, -1 once compiling failed
+    JitLoop** loop_at;   // compiled loop entered at a loop header offset
+    JitLoop* loops;
+} Jit;
+
+void initJit(Jit* jit, Chunk* chunk);
+void freeJit(VM* vm, Jit* jit);
+// called by run() after the OP_LOOP at loop_offset moved vm->ip to the
+// loop header, may run native code and move vm->ip and vm->stack_top on
+void jitBackEdge(VM* vm, Jit* jit, int loop_offset);
+
+#endif // !clox_jit_h
\ No newline at end of file
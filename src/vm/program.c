@@ -0,0 +1,167 @@
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/memory/memory.h"
+#include "common/object/object.h"
+#include "program.h"
+
+// 0 means that a VM has no program bound
+static atomic_uint_fast64_t next_program_id = 1;
+
+static size_t alignSize(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+// lays the program out in one block: the tables first, then the line runs,
+// the code and the characters of every string
+static Program* copyProgram(VM* vm, Chunk* chunk) {
+    ValueArray* constants = &chunk->constants;
+    size_t chars_size = 0;
+    for (int i = 0; i < constants->count; ++i) {
+        if (IS_OBJ(constants->values[i])) chars_size += AS_STRING(constants->values[i])->length;
+    }
+    for (int i = 0; i < vm->global_count; ++i) chars_size += vm->global_names[i]->length;
+
+    size_t constants_at = alignSize(sizeof(Program));
+    size_t globals_at = constants_at + alignSize(sizeof(ProgramConstant) * constants->count);
+    size_t lines_at = globals_at + alignSize(sizeof(ProgramName) * vm->global_count);
+    size_t line_bytes = sizeof(int) * chunk->lines_info.count;
+    size_t code_at = lines_at + 2 * line_bytes;
+    size_t chars_at = code_at + chunk->count;
+    uint8_t* block = (uint8_t*)malloc(chars_at + chars_size);
+    if (block == NULL) return NULL;
+
+    Program* program = (Program*)block;
+    program->id = atomic_fetch_add(&next_program_id, 1);
+    program->code = block + code_at;
+    program->count = chunk->count;
+    memcpy(program->code, chunk->code, chunk->count);
+    program->lines_info.capacity = chunk->lines_info.count;
+    program->lines_info.count = chunk->lines_info.count;
+    program->lines_info.lines = (int*)(block + lines_at);
+    program->lines_info.counts = (int*)(block + lines_at + line_bytes);
+    memcpy(program->lines_info.lines, chunk->lines_info.lines, line_bytes);
+    memcpy(program->lines_info.counts, chunk->lines_info.counts, line_bytes);
+
+    char* chars = (char*)(block + chars_at);
+    program->constants = (ProgramConstant*)(block + constants_at);
+    program->constant_count = constants->count;
+    for (int i = 0; i < constants->count; ++i) {
+        ProgramConstant* constant = &program->constants[i];
+        *constant = (ProgramConstant){ constants->values[i], NULL, 0 };
+        // the only objects the compiler makes constants of are strings
+        if (IS_OBJ(constant->value)) {
+            ObjString* string = AS_STRING(constant->value);
+            memcpy(chars, string->chars, string->length);
+            *constant = (ProgramConstant){ NIL_VAL, chars, string->length };
+            chars += string->length;
+        }
+    }
+
+    program->globals = (ProgramName*)(block + globals_at);
+    program->global_count = vm->global_count;
+    for (int i = 0; i < vm->global_count; ++i) {
+        ObjString* name = vm->global_names[i];
+        memcpy(chars, name->chars, name->length);
+        program->globals[i] = (ProgramName){ chars, name->length };
+        chars += name->length;
+    }
+    return program;
+}
+
+InterpretResult compileProgram(VM* vm, const char* source, Program** program) {
+    *program = NULL;
+    Chunk chunk;
+    initChunk(&chunk);
+    // the program and vm may outlive source
+    InterpretResult compiled = compileSource(vm, source, &chunk, true);
+    if (compiled == INTERPRET_OK) {
+        *program = copyProgram(vm, &chunk);
+        if (*program == NULL) {
+            fputs("Out of memory.\n", vm->err);
+            compiled = INTERPRET_RUNTIME_ERROR;
+        }
+    }
+    freeChunk(vm, &chunk);
+    return compiled;
+}
+
+void freeProgram(Program* program) {
+    free(program);
+}
+
+void unbindProgram(VM* vm) {
+    if (vm->owns_bound_code) {
+        FREE_ARRAY(vm, uint8_t, vm->bound_chunk.code, vm->bound_chunk.count, MEMORY_CODE);
+    }
+    freeValueArray(vm, &vm->bound_chunk.constants);
+    initChunk(&vm->bound_chunk);
+    vm->owns_bound_code = false;
+    vm->bound_program = 0;
+}
+
+// Interns copies of the constants and resolves the globals of program in
+// vm, which may outlive program. The code is shared unless vm gives the
+// globals other slots than the compiling VM did, then it gets a copy with
+// the operands rewritten. False when vm runs out of global slots.
+static bool bindProgram(VM* vm, const Program* program) {
+    unbindProgram(vm);
+    Chunk* chunk = &vm->bound_chunk;
+    for (int i = 0; i < program->constant_count; ++i) {
+        const ProgramConstant* constant = &program->constants[i];
+        addConstant(vm, chunk, constant->chars != NULL ?
+            OBJ_VAL(copyString(vm, constant->chars, constant->length)) : constant->value);
+    }
+
+    chunk->code = program->code;
+    chunk->count = program->count;
+    chunk->lines_info = program->lines_info;
+    if (program->global_count == 0) {
+        vm->bound_program = program->id;
+        return true;
+    }
+
+    uint16_t* slots = ALLOCATE(vm, uint16_t, program->global_count, MEMORY_SCRATCH);
+    bool moved = false;
+    bool fits = true;
+    for (int i = 0; fits && i < program->global_count; ++i) {
+        const ProgramName* name = &program->globals[i];
+        int slot = globalSlot(vm, copyString(vm, name->chars, name->length));
+        fits = slot < UINT16_COUNT;
+        slots[i] = (uint16_t)slot;
+        moved = moved || slot != i;
+    }
+    if (fits && moved) {
+        chunk->code = ALLOCATE(vm, uint8_t, program->count, MEMORY_CODE);
+        vm->owns_bound_code = true;
+        memcpy(chunk->code, program->code, program->count);
+        remapGlobals(chunk, slots);
+    }
+    FREE_ARRAY(vm, uint16_t, slots, program->global_count, MEMORY_SCRATCH);
+    if (fits) vm->bound_program = program->id;
+    return fits;
+}
+
+InterpretResult runProgram(VM* vm, const Program* program) {
+    // a suspended run may be running the bound chunk
+    interpretAbandon(vm);
+    if (vm->bound_program != program->id) {
+        HeapGuard guard;
+        if (setjmp(guard.jump) != 0) {
+            unbindProgram(vm);
+            fputs("Out of memory.\n", vm->err);
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        pushHeapGuard(vm, &guard);
+        bool bound = bindProgram(vm, program);
+        popHeapGuard(vm, &guard);
+        if (!bound) {
+            unbindProgram(vm);
+            fputs("Too many global variables.\n", vm->err);
+            return INTERPRET_RUNTIME_ERROR;
+        }
+    }
+    return interpretChunk(vm, &vm->bound_chunk);
+}
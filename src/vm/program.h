@@ -0,0 +1,54 @@
+#ifndef clox_program_h
+#define clox_program_h
+
+#include "common/common.h"
+#include "common/value/value.h"
+#include "debug/lines_info.h"
+#include "vm/vm.h"
+
+typedef struct {
+    Value value;        // nil, a boolean or a number
+    const char* chars;  // a string constant instead when not NULL
+    int length;
+} ProgramConstant;
+
+typedef struct {
+    const char* chars;
+    int length;
+} ProgramName;
+
+// A compiled script that belongs to no VM, so that it is scanned and
+// compiled once and run any number of times. Code and line runs are shared
+// by every VM that runs it and never change. Constants and globals are kept
+// by value and by name; the first run on a VM interns the strings and
+// resolves the names to that VM's global slots, later runs there only reset
+// the stack. Programs are immutable, VMs on several threads may run one at
+// the same time. Everything sits in one malloc'd block.
+typedef struct {
+    uint64_t id;            // unique within the process, never 0
+    uint8_t* code;
+    int count;
+    LinesInfo lines_info;
+    ProgramConstant* constants;
+    int constant_count;
+    // every global of the compiling VM, in the slots it gave them; compile
+    // on a fresh VM to keep them to the program's own
+    ProgramName* globals;
+    int global_count;
+} Program;
+
+// compiles source with vm's -O level, *program is NULL unless it returns
+// INTERPRET_OK; the program keeps nothing of vm or source, and vm keeps
+// nothing of source
+InterpretResult compileProgram(VM* vm, const char* source, Program** program);
+// runs program like interpret() runs its source, globals persist between
+// runs on one VM
+InterpretResult runProgram(VM* vm, const Program* program);
+// no VM may be running it, the bindings VMs keep of it are dropped with
+// them or on their next runProgram() of another program
+void freeProgram(Program* program);
+
+// drops what vm bound of the program it ran last
+void unbindProgram(VM* vm);
+
+#endif // !clox_program_h
@@ -1,233 +1,936 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "debug/debug.h"
 #include "compiler/compiler.h"
+#include "compiler/register_emitter.h"
+#include "common/hash/hash.h"
 #include "common/memory/memory.h"
 #include "common/object/object.h"
+#include "vm/program.h"
 
 #include "vm.h"
 
-VM vm;
+// a global slot is its value and its name, see globalSlot()
+#define GLOBAL_SLOT_SIZE (sizeof(Value) + sizeof(ObjString*))
 
-static void resetStack() {
-    vm.stack_top = vm.stack;
+static void resetStack(VM* vm) {
+    vm->stack_top = vm->stack;
 }
 
-static void runtimeError(const char* format, ...) {
+static void runtimeError(VM* vm, const char* format, ...) {
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm->err, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm->err);
 
-    size_t instruction = vm.ip - vm.chunk->code - 1;
-    int line = getLine(&vm.chunk->lines_info, instruction);
-    fprintf(stderr, "[line %d] in script\n", line);
-    resetStack();
+    // no chunk runs yet while it is being lowered to registers
+    if (vm->chunk != NULL) {
+        size_t instruction = vm->ip - vm->chunk->code - 1;
+        int line = getLine(&vm->chunk->lines_info, instruction);
+        fprintf(vm->err, "[line %d] in script\n", line);
+    }
+    resetStack(vm);
+}
+
+void initVM(VM* vm, const Allocator* allocator) {
+    initHeap(&vm->heap);
+    initPool(&vm->pool);
+    vm->allocator = allocator != NULL ? *allocator : poolAllocator(&vm->pool);
+    resetStack(vm);
+    vm->objects = NULL;
+    vm->optimize_level = 0;
+    vm->use_registers = false;
+    vm->out = stdout;
+    vm->err = stderr;
+#ifdef CLOX_JIT
+    vm->jit_enabled = true;
+#else
+    vm->jit_enabled = false;
+#endif // CLOX_JIT
+    vm->jit_threshold = JIT_HOT_LOOP_THRESHOLD;
+    setBudget(vm, 0, 0);
+    vm->is_suspended = false;
+    vm->run_root_count = 0;
+    initChunk(&vm->script);
+    initChunk(&vm->registers.code);
+    vm->registers.frame_size = 0;
+    initTable(&vm->global_slots);
+    vm->global_names = NULL;
+    vm->global_values = NULL;
+    vm->global_count = 0;
+    vm->global_capacity = 0;
+    initInternSet(&vm->strings);
+    vm->shared_strings = NULL;
+    vm->bound_program = 0;
+    initChunk(&vm->bound_chunk);
+    vm->owns_bound_code = false;
+    vm->hash_state = hashState(randomHashSeed());
+}
+
+void freeVM(VM* vm) {
+    interpretAbandon(vm);
+    unbindProgram(vm);
+    freeTable(vm, &vm->global_slots);
+    FREE_ARRAY(vm, uint8_t, vm->global_values, GLOBAL_SLOT_SIZE * vm->global_capacity, MEMORY_TABLES);
+    freeInternSet(vm, &vm->strings);
+    freeObjects(vm);
+    freePool(&vm->pool);
+
+#ifdef CLOX_PROFILE_OPCODES
+    printOpcodeProfile();
+#endif // CLOX_PROFILE_OPCODES
 }
 
-void initVM() {
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+void shareStrings(VM* vm, SharedStrings* shared) {
+    vm->shared_strings = shared;
+    vm->hash_state = shared->hash_state;
 }
 
-void freeVM() {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    freeObjects();
+int globalSlot(VM* vm, ObjString* name) {
+    name = internString(vm, name);
+    Value slot;
+    if (tableGet(&vm->global_slots, name, &slot)) {
+        return (int)AS_NUMBER(slot);
+    }
+
+    // growing the slots or the table can collect before name is in them
+    pushRoot(vm, OBJ_VAL(name));
+    if (vm->global_capacity < vm->global_count + 1) {
+        // values and names share one allocation, the names follow the
+        // values, so running out of memory leaves both as they were
+        int old_capacity = vm->global_capacity;
+        int capacity = GROW_CAPACITY(old_capacity);
+        Value* values = (Value*)ALLOCATE(vm, uint8_t, GLOBAL_SLOT_SIZE * capacity, MEMORY_TABLES);
+        ObjString** names = (ObjString**)(values + capacity);
+        if (vm->global_count > 0) {
+            memcpy(values, vm->global_values, sizeof(Value) * vm->global_count);
+            memcpy(names, vm->global_names, sizeof(ObjString*) * vm->global_count);
+        }
+        FREE_ARRAY(vm, uint8_t, vm->global_values, GLOBAL_SLOT_SIZE * old_capacity, MEMORY_TABLES);
+        vm->global_values = values;
+        vm->global_names = names;
+        vm->global_capacity = capacity;
+    }
+
+    // the slot only counts once the name is in the table
+    int index = vm->global_count;
+    tableSet(vm, &vm->global_slots, name, NUMBER_VAL(index));
+    vm->global_names[index] = name;
+    vm->global_values[index] = UNDEFINED_VAL;
+    vm->global_count++;
+    popRoot(vm);
+    return index;
 }
 
-void push(Value value) {
-    *vm.stack_top = value;
-    vm.stack_top++;
+void push(VM* vm, Value value) {
+    *vm->stack_top = value;
+    vm->stack_top++;
 }
-Value pop() {
-    vm.stack_top--;
-    return *vm.stack_top;
+Value pop(VM* vm) {
+    vm->stack_top--;
+    return *vm->stack_top;
 }
 
-static Value peek(int distance) {
-    return vm.stack_top[-1 - distance];
+static Value peek(VM* vm, int distance) {
+    return vm->stack_top[-1 - distance];
 }
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
-static void concatenate() {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
+static void undefinedVariableError(VM* vm, uint16_t slot) {
+    ObjString* name = vm->global_names[slot];
+    runtimeError(vm, "Undefined variable '%.*s'.", name->length, name->chars);
+}
+// Minor collections move young objects, so they only run where every live
+// value sits in a root. Concatenation is what fills the nursery.
+static void safePoint(VM* vm) {
+#ifdef DEBUG_STRESS_GC
+    collectNursery(vm);
+#else
+    if (vm->heap.nursery.is_full) collectNursery(vm);
+#endif // DEBUG_STRESS_GC
+}
+
+// the operands stay on the stack until the result exists
+static void concatenate(VM* vm) {
+    Obj* result = concatenateStrings(vm, AS_OBJ(peek(vm, 1)), AS_OBJ(peek(vm, 0)));
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
+    safePoint(vm);
+}
+
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(VM* vm) {
+    printf("\t");
+    for (Value* slot = vm->stack; slot < vm->stack_top; ++slot) {
+        printf("[ ");
+        printValue(vm, *slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(vm, vm->chunk, (int)(vm->ip - vm->chunk->code));
+}
+#define TRACE_EXECUTION() traceExecution(vm)
+#else
+#define TRACE_EXECUTION() ((void)0)
+#endif // DEBUG_TRACE_EXECUTION
+
+#ifdef CLOX_PROFILE_OPCODES
+#define PROFILE_INSTRUCTION(instruction) profileInstruction(instruction)
+#else
+#define PROFILE_INSTRUCTION(instruction) ((void)0)
+#endif // CLOX_PROFILE_OPCODES
+
+// Dispatch shared by the stack and the register loop, each of them
+// declares its own dispatch_table and 'instruction'.
+#ifdef CLOX_THREADED_DISPATCH
+#define INTERPRET_LOOP DISPATCH();
+#define INSTRUCTION(name) op_##name
+#define UNKNOWN_INSTRUCTION op_unknown
+#define DISPATCH() \
+    do { \
+        TRACE_EXECUTION(); \
+        instruction = READ_BYTE(); \
+        PROFILE_INSTRUCTION(instruction); \
+        goto *dispatch_table[instruction]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP \
+    loop: \
+        TRACE_EXECUTION(); \
+        instruction = READ_BYTE(); \
+        PROFILE_INSTRUCTION(instruction); \
+        switch (instruction)
+#define INSTRUCTION(name) case name
+#define UNKNOWN_INSTRUCTION default
+#define DISPATCH() goto loop
+#endif // CLOX_THREADED_DISPATCH
+
+// adds or concatenates the two values on top of the stack
+static bool add(VM* vm) {
+    if (IS_ANY_STRING(peek(vm, 0)) && IS_ANY_STRING(peek(vm, 1))) {
+        // ropes make doubling a string cheap, its length still has to fit
+        if ((int64_t)stringLength(peek(vm, 0)) + stringLength(peek(vm, 1)) >= INT_MAX) {
+            runtimeError(vm, "String too long.");
+            return false;
+        }
+        concatenate(vm);
+    }
+    else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+        double b = AS_NUMBER(pop(vm));
+        double a = AS_NUMBER(pop(vm));
+        push(vm, NUMBER_VAL(a + b));
+    }
+    else {
+        runtimeError(vm, "Operands must be two numbers or two strings.");
+        return false;
+    }
+    return true;
+}
+
+// Adds the count operands left to right and pushes the sum, the operands
+// stay where they are. Strings are checked and measured once and joined
+// in one go, mixed operands are added pair by pair like a chain of OP_ADD.
+static bool addMany(VM* vm, Value* operands, int count) {
+    bool numbers = true;
+    bool strings = true;
+    int64_t length = 0;
+    for (int i = 0; i < count; ++i) {
+        numbers = numbers && IS_NUMBER(operands[i]);
+        strings = strings && IS_ANY_STRING(operands[i]);
+        if (strings) length += stringLength(operands[i]);
+    }
+
+    if (numbers) {
+        double sum = AS_NUMBER(operands[0]);
+        for (int i = 1; i < count; ++i) {
+            sum += AS_NUMBER(operands[i]);
+        }
+        push(vm, NUMBER_VAL(sum));
+        return true;
+    }
+    if (strings) {
+        if (length >= INT_MAX) {
+            runtimeError(vm, "String too long.");
+            return false;
+        }
+        push(vm, OBJ_VAL(concatenateMany(vm, operands, count)));
+        safePoint(vm);
+        return true;
+    }
+
+    push(vm, operands[0]);
+    for (int i = 1; i < count; ++i) {
+        push(vm, operands[i]);
+        if (!add(vm)) return false;
+    }
+    return true;
+}
 
-    int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+static uint64_t monotonicNanos() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// back-edges until the budget is looked at again
+static void armBudget(VM* vm) {
+    int64_t countdown = vm->budget_loops;
+    if (vm->budget_deadline != 0 && countdown > BUDGET_CLOCK_INTERVAL) {
+        countdown = BUDGET_CLOCK_INTERVAL;
+    }
+    vm->budget_countdown = countdown;
+    vm->budget_armed = countdown;
+}
+
+void setBudget(VM* vm, int64_t loops, double seconds) {
+    vm->budget_loops = loops > 0 ? loops : INT64_MAX;
+    vm->budget_deadline = seconds > 0 ? monotonicNanos() + (uint64_t)(seconds * 1e9) : 0;
+    armBudget(vm);
+}
 
-    ObjString* result = takeString(chars, length);
-    push(OBJ_VAL(result));
+// The countdown ran out at a back-edge: counts what it took off the
+// budget and, unless that is spent, starts it again. True when the run has
+// to yield at this back-edge.
+static bool isBudgetSpent(VM* vm) {
+    vm->budget_loops -= vm->budget_armed - vm->budget_countdown;
+    vm->budget_armed = vm->budget_countdown;
+    if (vm->budget_loops <= 0) return true;
+    if (vm->budget_deadline != 0 && monotonicNanos() >= vm->budget_deadline) return true;
+    armBudget(vm);
+    return false;
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++)
+static InterpretResult run(VM* vm) {
+#define READ_BYTE() (*vm->ip++)
 #define READ_SHORT() \
-    (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | (vm.ip[-1])))
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+    (vm->ip += 2, (uint16_t)((vm->ip[-2] << 8) | (vm->ip[-1])))
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
 #define BINARY_OP(value_type, op) \
     do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers."); \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+            runtimeError(vm, "Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(value_type(a op b)); \
+        double b = AS_NUMBER(pop(vm)); \
+        double a = AS_NUMBER(pop(vm)); \
+        push(vm, value_type(a op b)); \
     } while(false)
+#define COMPARE_JUMP(op, jump_if) \
+    do { \
+        uint16_t offset = READ_SHORT(); \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+            runtimeError(vm, "Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        double b = AS_NUMBER(pop(vm)); \
+        double a = AS_NUMBER(pop(vm)); \
+        if ((a op b) == jump_if) vm->ip += offset; \
+    } while (false)
+#define EQUAL_JUMP(jump_if) \
+    do { \
+        uint16_t offset = READ_SHORT(); \
+        Value b = pop(vm); \
+        Value a = pop(vm); \
+        if (valuesEqual(vm, a, b) == jump_if) vm->ip += offset; \
+    } while (false)
 
-    for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("\t");
-        for (Value* slot = vm.stack; slot < vm.stack_top; ++slot) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
-#endif // DEBUG_TRACE_EXECUTION
+    // Threaded dispatch jumps straight from the end of one handler to the
+    // next through the label table, so each opcode gets its own indirect
+    // branch instead of all of them sharing the one at the top of a switch.
+#ifdef CLOX_THREADED_DISPATCH
+    static void* dispatch_table[UINT8_COUNT] = {
+        [0 ... UINT8_MAX] = &&op_unknown,
+        [OP_CONSTANT] = &&op_OP_CONSTANT,
+        [OP_CONSTANT_LONG] = &&op_OP_CONSTANT_LONG,
+        [OP_NIL] = &&op_OP_NIL,
+        [OP_TRUE] = &&op_OP_TRUE,
+        [OP_FALSE] = &&op_OP_FALSE,
+        [OP_POP] = &&op_OP_POP,
+        [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+        [OP_EQUAL] = &&op_OP_EQUAL,
+        [OP_GREATER] = &&op_OP_GREATER,
+        [OP_LESS] = &&op_OP_LESS,
+        [OP_ADD] = &&op_OP_ADD,
+        [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+        [OP_MULTILPY] = &&op_OP_MULTILPY,
+        [OP_DIVIDE] = &&op_OP_DIVIDE,
+        [OP_NOT] = &&op_OP_NOT,
+        [OP_NEGATE] = &&op_OP_NEGATE,
+        [OP_PRINT] = &&op_OP_PRINT,
+        [OP_JUMP] = &&op_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&op_OP_LOOP,
+        [OP_RETURN] = &&op_OP_RETURN,
+        [OP_JUMP_IF_NOT_LESS] = &&op_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_LESS] = &&op_OP_JUMP_IF_LESS,
+        [OP_JUMP_IF_NOT_GREATER] = &&op_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_GREATER] = &&op_OP_JUMP_IF_GREATER,
+        [OP_JUMP_IF_NOT_EQUAL] = &&op_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_IF_EQUAL] = &&op_OP_JUMP_IF_EQUAL,
+        [OP_ADD_LOCAL_CONSTANT] = &&op_OP_ADD_LOCAL_CONSTANT,
+        [OP_SUBTRACT_LOCAL_CONSTANT] = &&op_OP_SUBTRACT_LOCAL_CONSTANT,
+        [OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP] = &&op_OP_SET_GLOBAL_POP,
+        [OP_ADD_MANY] = &&op_OP_ADD_MANY,
+    };
+#endif // CLOX_THREADED_DISPATCH
 
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-        case OP_CONSTANT: {
+    uint8_t instruction;
+    INTERPRET_LOOP
+    {
+        INSTRUCTION(OP_CONSTANT): {
             Value constant = READ_CONSTANT();
-            push(constant);           
-        }  break;
-        case OP_CONSTANT_LONG: {
+            push(vm, constant);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_CONSTANT_LONG): {
             uint16_t constant_id;
             uint8_t* constant_id_bytes = (uint8_t*)&constant_id;
             constant_id_bytes[0] = READ_BYTE();
             constant_id_bytes[1] = READ_BYTE();
 
-            Value constant = vm.chunk->constants.values[constant_id];
-            push(constant);
-        } break;
-        case OP_NIL: push(NIL_VAL); break;
-        case OP_TRUE: push(BOOL_VAL(true)); break;
-        case OP_FALSE: push(BOOL_VAL(false)); break;
-        case OP_POP: pop(); break;
-        case OP_GET_LOCAL: {
+            Value constant = vm->chunk->constants.values[constant_id];
+            push(vm, constant);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_NIL): push(vm, NIL_VAL); DISPATCH();
+        INSTRUCTION(OP_TRUE): push(vm, BOOL_VAL(true)); DISPATCH();
+        INSTRUCTION(OP_FALSE): push(vm, BOOL_VAL(false)); DISPATCH();
+        INSTRUCTION(OP_POP): pop(vm); DISPATCH();
+        INSTRUCTION(OP_GET_LOCAL): {
             uint8_t slot = READ_BYTE();
-            push(vm.stack[slot]);
-        }; break;
-        case OP_SET_LOCAL: {
+            push(vm, vm->stack[slot]);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_SET_LOCAL): {
             uint8_t slot = READ_BYTE();
-            vm.stack[slot] = peek(0);
-        } break;
-        case OP_GET_GLOBAL: {
-            ObjString* name = READ_STRING();
-            Value value;
-            if (!tableGet(&vm.globals, name, &value)) {
-                runtimeError("Undefined variable '%.*s'.", name->length, name->chars);
+            vm->stack[slot] = peek(vm, 0);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_GET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            Value value = vm->global_values[slot];
+            if (IS_UNDEFINED(value)) {
+                undefinedVariableError(vm, slot);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(value);
-        } break;
-        case OP_DEFINE_GLOBAL: {
-            ObjString* name = READ_STRING();
-            tableSet(&vm.globals, name, peek(0));
-            pop();
-        } break;
-        case OP_SET_GLOBAL: {
-            ObjString* name = READ_STRING();
-            if (tableSet(&vm.globals, name, peek(0))) {
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable '%.*s'.", name->length, name->chars);
+            push(vm, value);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_DEFINE_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            vm->global_values[slot] = pop(vm);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_SET_GLOBAL): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm->global_values[slot])) {
+                undefinedVariableError(vm, slot);
                 return INTERPRET_RUNTIME_ERROR;
             }
-        } break;
-        case OP_EQUAL: {
-            Value a = pop();
-            Value b = pop();
-            push(BOOL_VAL(valuesEqual(a, b)));
-        } break;
-        case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-        case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-        case OP_ADD: {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                concatenate();
+            vm->global_values[slot] = peek(vm, 0);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_EQUAL): {
+            Value a = pop(vm);
+            Value b = pop(vm);
+            push(vm, BOOL_VAL(valuesEqual(vm, a, b)));
+            DISPATCH();
+        }
+        INSTRUCTION(OP_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+        INSTRUCTION(OP_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+        INSTRUCTION(OP_ADD): {
+            if (!add(vm)) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        INSTRUCTION(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        INSTRUCTION(OP_MULTILPY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        INSTRUCTION(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        INSTRUCTION(OP_NOT):
+            push(vm, BOOL_VAL(isFalsey(pop(vm))));
+            DISPATCH();
+        INSTRUCTION(OP_NEGATE):
+            if (!IS_NUMBER(peek(vm, 0))) {
+                runtimeError(vm, "Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
             }
-            else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+            push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+            DISPATCH();
+        INSTRUCTION(OP_PRINT):
+            fprintValue(vm, vm->out, pop(vm));
+            fprintf(vm->out, "\n");
+            DISPATCH();
+        INSTRUCTION(OP_JUMP): {
+            uint16_t offset = READ_SHORT();
+            vm->ip += offset;
+            DISPATCH();
+        }
+        INSTRUCTION(OP_JUMP_IF_FALSE): {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(vm, 0))) vm->ip += offset;
+            DISPATCH();
+        }
+        INSTRUCTION(OP_LOOP): {
+            uint16_t offset = READ_SHORT();
+            vm->ip -= offset;
+            if (--vm->budget_countdown <= 0 && isBudgetSpent(vm)) return INTERPRET_YIELD;
+#ifdef CLOX_JIT
+            if (vm->jit_enabled) {
+                jitBackEdge(vm, &vm->jit, (int)(vm->ip + offset - 3 - vm->chunk->code));
             }
-            else {
-                runtimeError("Operands must be two numbers or two strings.");
+#endif // CLOX_JIT
+            DISPATCH();
+        }
+        INSTRUCTION(OP_RETURN): {
+            return INTERPRET_OK;
+        }
+        INSTRUCTION(OP_JUMP_IF_NOT_LESS): COMPARE_JUMP(<, false); DISPATCH();
+        INSTRUCTION(OP_JUMP_IF_LESS): COMPARE_JUMP(<, true); DISPATCH();
+        INSTRUCTION(OP_JUMP_IF_NOT_GREATER): COMPARE_JUMP(>, false); DISPATCH();
+        INSTRUCTION(OP_JUMP_IF_GREATER): COMPARE_JUMP(>, true); DISPATCH();
+        INSTRUCTION(OP_JUMP_IF_NOT_EQUAL): EQUAL_JUMP(false); DISPATCH();
+        INSTRUCTION(OP_JUMP_IF_EQUAL): EQUAL_JUMP(true); DISPATCH();
+        INSTRUCTION(OP_ADD_LOCAL_CONSTANT): {
+            Value a = vm->stack[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                push(vm, NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                DISPATCH();
+            }
+
+            push(vm, a);
+            push(vm, b);
+            if (!add(vm)) return INTERPRET_RUNTIME_ERROR;
+            DISPATCH();
+        }
+        INSTRUCTION(OP_SUBTRACT_LOCAL_CONSTANT): {
+            Value a = vm->stack[READ_BYTE()];
+            Value b = READ_CONSTANT();
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                runtimeError(vm, "Operands must be numbers.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-        } break;
-        case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-        case OP_MULTILPY: BINARY_OP(NUMBER_VAL, *); break;
-        case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-        case OP_NOT: 
-            push(BOOL_VAL(isFalsey(pop())));
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(0))) {
-                runtimeError("Operand must be a number.");
+            push(vm, NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b)));
+            DISPATCH();
+        }
+        INSTRUCTION(OP_SET_LOCAL_POP): {
+            uint8_t slot = READ_BYTE();
+            vm->stack[slot] = pop(vm);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_SET_GLOBAL_POP): {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm->global_values[slot])) {
+                undefinedVariableError(vm, slot);
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
-        case OP_PRINT:
-            printValue(pop());
-            printf("\n");
-            break;
-        case OP_JUMP: {
+            vm->global_values[slot] = pop(vm);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_ADD_MANY): {
+            uint8_t count = READ_BYTE();
+            if (!addMany(vm, vm->stack_top - count, count)) return INTERPRET_RUNTIME_ERROR;
+            Value sum = pop(vm);
+            vm->stack_top -= count;
+            push(vm, sum);
+            DISPATCH();
+        }
+        UNKNOWN_INSTRUCTION:
+            printf("default case vm run");
+            DISPATCH();
+    }
+
+#undef READ_BYTE
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef BINARY_OP
+#undef COMPARE_JUMP
+#undef EQUAL_JUMP
+}
+
+// The register loop keeps its registers in vm->stack, stack_top sits at the
+// end of the frame so that add() has scratch room above it.
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceRegisters(VM* vm) {
+    printf("\t");
+    for (Value* slot = vm->stack; slot < vm->stack_top; ++slot) {
+        printf("[ ");
+        printValue(vm, *slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleRegisterInstruction(vm, vm->chunk, (int)(vm->ip - vm->chunk->code));
+}
+#undef TRACE_EXECUTION
+#define TRACE_EXECUTION() traceRegisters(vm)
+#endif // DEBUG_TRACE_EXECUTION
+
+static InterpretResult runRegisters(VM* vm) {
+#define READ_BYTE() (*vm->ip++)
+#define READ_SHORT() \
+    (vm->ip += 2, (uint16_t)((vm->ip[-2] << 8) | (vm->ip[-1])))
+#define READ_CONSTANT() (vm->chunk->constants.values[READ_SHORT()])
+#define R(index) (vm->stack[index])
+#define BINARY_OP(value_type, op) \
+    do { \
+        uint8_t a = READ_BYTE(); \
+        Value b = R(READ_BYTE()); \
+        Value c = R(READ_BYTE()); \
+        if (!IS_NUMBER(b) || !IS_NUMBER(c)) { \
+            runtimeError(vm, "Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        R(a) = value_type(AS_NUMBER(b) op AS_NUMBER(c)); \
+    } while (false)
+#define COMPARE_JUMP(op, jump_if) \
+    do { \
+        Value b = R(READ_BYTE()); \
+        Value c = R(READ_BYTE()); \
+        uint16_t offset = READ_SHORT(); \
+        if (!IS_NUMBER(b) || !IS_NUMBER(c)) { \
+            runtimeError(vm, "Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } \
+        if ((AS_NUMBER(b) op AS_NUMBER(c)) == jump_if) vm->ip += offset; \
+    } while (false)
+#define EQUAL_JUMP(jump_if) \
+    do { \
+        Value b = R(READ_BYTE()); \
+        Value c = R(READ_BYTE()); \
+        uint16_t offset = READ_SHORT(); \
+        if (valuesEqual(vm, b, c) == jump_if) vm->ip += offset; \
+    } while (false)
+
+#ifdef CLOX_THREADED_DISPATCH
+    static void* dispatch_table[UINT8_COUNT] = {
+        [0 ... UINT8_MAX] = &&op_unknown,
+        [OP_REG_MOVE] = &&op_OP_REG_MOVE,
+        [OP_REG_LOAD_CONSTANT] = &&op_OP_REG_LOAD_CONSTANT,
+        [OP_REG_LOAD_NIL] = &&op_OP_REG_LOAD_NIL,
+        [OP_REG_LOAD_TRUE] = &&op_OP_REG_LOAD_TRUE,
+        [OP_REG_LOAD_FALSE] = &&op_OP_REG_LOAD_FALSE,
+        [OP_REG_GET_GLOBAL] = &&op_OP_REG_GET_GLOBAL,
+        [OP_REG_DEFINE_GLOBAL] = &&op_OP_REG_DEFINE_GLOBAL,
+        [OP_REG_SET_GLOBAL] = &&op_OP_REG_SET_GLOBAL,
+        [OP_REG_EQUAL] = &&op_OP_REG_EQUAL,
+        [OP_REG_GREATER] = &&op_OP_REG_GREATER,
+        [OP_REG_LESS] = &&op_OP_REG_LESS,
+        [OP_REG_ADD] = &&op_OP_REG_ADD,
+        [OP_REG_SUBTRACT] = &&op_OP_REG_SUBTRACT,
+        [OP_REG_MULTIPLY] = &&op_OP_REG_MULTIPLY,
+        [OP_REG_DIVIDE] = &&op_OP_REG_DIVIDE,
+        [OP_REG_ADD_CONSTANT] = &&op_OP_REG_ADD_CONSTANT,
+        [OP_REG_SUBTRACT_CONSTANT] = &&op_OP_REG_SUBTRACT_CONSTANT,
+        [OP_REG_NOT] = &&op_OP_REG_NOT,
+        [OP_REG_NEGATE] = &&op_OP_REG_NEGATE,
+        [OP_REG_PRINT] = &&op_OP_REG_PRINT,
+        [OP_REG_JUMP] = &&op_OP_REG_JUMP,
+        [OP_REG_LOOP] = &&op_OP_REG_LOOP,
+        [OP_REG_JUMP_IF_FALSE] = &&op_OP_REG_JUMP_IF_FALSE,
+        [OP_REG_JUMP_IF_NOT_LESS] = &&op_OP_REG_JUMP_IF_NOT_LESS,
+        [OP_REG_JUMP_IF_LESS] = &&op_OP_REG_JUMP_IF_LESS,
+        [OP_REG_JUMP_IF_NOT_GREATER] = &&op_OP_REG_JUMP_IF_NOT_GREATER,
+        [OP_REG_JUMP_IF_GREATER] = &&op_OP_REG_JUMP_IF_GREATER,
+        [OP_REG_JUMP_IF_NOT_EQUAL] = &&op_OP_REG_JUMP_IF_NOT_EQUAL,
+        [OP_REG_JUMP_IF_EQUAL] = &&op_OP_REG_JUMP_IF_EQUAL,
+        [OP_REG_RETURN] = &&op_OP_REG_RETURN,
+        [OP_REG_ADD_MANY] = &&op_OP_REG_ADD_MANY,
+    };
+#endif // CLOX_THREADED_DISPATCH
+
+    uint8_t instruction;
+    INTERPRET_LOOP
+    {
+        INSTRUCTION(OP_REG_MOVE): {
+            uint8_t a = READ_BYTE();
+            R(a) = R(READ_BYTE());
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_LOAD_CONSTANT): {
+            uint8_t a = READ_BYTE();
+            R(a) = READ_CONSTANT();
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_LOAD_NIL): R(READ_BYTE()) = NIL_VAL; DISPATCH();
+        INSTRUCTION(OP_REG_LOAD_TRUE): R(READ_BYTE()) = BOOL_VAL(true); DISPATCH();
+        INSTRUCTION(OP_REG_LOAD_FALSE): R(READ_BYTE()) = BOOL_VAL(false); DISPATCH();
+        INSTRUCTION(OP_REG_GET_GLOBAL): {
+            uint8_t a = READ_BYTE();
+            uint16_t slot = READ_SHORT();
+            Value value = vm->global_values[slot];
+            if (IS_UNDEFINED(value)) {
+                undefinedVariableError(vm, slot);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            R(a) = value;
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_DEFINE_GLOBAL): {
+            uint8_t a = READ_BYTE();
+            vm->global_values[READ_SHORT()] = R(a);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_SET_GLOBAL): {
+            uint8_t a = READ_BYTE();
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm->global_values[slot])) {
+                undefinedVariableError(vm, slot);
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm->global_values[slot] = R(a);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_EQUAL): {
+            uint8_t a = READ_BYTE();
+            Value b = R(READ_BYTE());
+            Value c = R(READ_BYTE());
+            R(a) = BOOL_VAL(valuesEqual(vm, b, c));
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_GREATER): BINARY_OP(BOOL_VAL, >); DISPATCH();
+        INSTRUCTION(OP_REG_LESS): BINARY_OP(BOOL_VAL, <); DISPATCH();
+        INSTRUCTION(OP_REG_ADD): {
+            uint8_t a = READ_BYTE();
+            Value b = R(READ_BYTE());
+            Value c = R(READ_BYTE());
+            if (IS_NUMBER(b) && IS_NUMBER(c)) {
+                R(a) = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+                DISPATCH();
+            }
+
+            push(vm, b);
+            push(vm, c);
+            if (!add(vm)) return INTERPRET_RUNTIME_ERROR;
+            R(a) = pop(vm);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        INSTRUCTION(OP_REG_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        INSTRUCTION(OP_REG_DIVIDE): BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        INSTRUCTION(OP_REG_ADD_CONSTANT): {
+            uint8_t a = READ_BYTE();
+            Value b = R(READ_BYTE());
+            Value c = READ_CONSTANT();
+            if (IS_NUMBER(b) && IS_NUMBER(c)) {
+                R(a) = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+                DISPATCH();
+            }
+
+            push(vm, b);
+            push(vm, c);
+            if (!add(vm)) return INTERPRET_RUNTIME_ERROR;
+            R(a) = pop(vm);
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_SUBTRACT_CONSTANT): {
+            uint8_t a = READ_BYTE();
+            Value b = R(READ_BYTE());
+            Value c = READ_CONSTANT();
+            if (!IS_NUMBER(b) || !IS_NUMBER(c)) {
+                runtimeError(vm, "Operands must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            R(a) = NUMBER_VAL(AS_NUMBER(b) - AS_NUMBER(c));
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_NOT): {
+            uint8_t a = READ_BYTE();
+            R(a) = BOOL_VAL(isFalsey(R(READ_BYTE())));
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_NEGATE): {
+            uint8_t a = READ_BYTE();
+            Value b = R(READ_BYTE());
+            if (!IS_NUMBER(b)) {
+                runtimeError(vm, "Operand must be a number.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            R(a) = NUMBER_VAL(-AS_NUMBER(b));
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_PRINT):
+            fprintValue(vm, vm->out, R(READ_BYTE()));
+            fprintf(vm->out, "\n");
+            DISPATCH();
+        INSTRUCTION(OP_REG_JUMP): {
             uint16_t offset = READ_SHORT();
-            vm.ip += offset;
-        } break;
-        case OP_JUMP_IF_FALSE: {
+            vm->ip += offset;
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_LOOP): {
             uint16_t offset = READ_SHORT();
-            if (isFalsey(peek(0))) vm.ip += offset;
-        } break;
-        case OP_LOOP: {
+            vm->ip -= offset;
+            if (--vm->budget_countdown <= 0 && isBudgetSpent(vm)) return INTERPRET_YIELD;
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_JUMP_IF_FALSE): {
+            Value condition = R(READ_BYTE());
             uint16_t offset = READ_SHORT();
-            vm.ip -= offset;
-        } break;
-        case OP_RETURN: {
+            if (isFalsey(condition)) vm->ip += offset;
+            DISPATCH();
+        }
+        INSTRUCTION(OP_REG_JUMP_IF_NOT_LESS): COMPARE_JUMP(<, false); DISPATCH();
+        INSTRUCTION(OP_REG_JUMP_IF_LESS): COMPARE_JUMP(<, true); DISPATCH();
+        INSTRUCTION(OP_REG_JUMP_IF_NOT_GREATER): COMPARE_JUMP(>, false); DISPATCH();
+        INSTRUCTION(OP_REG_JUMP_IF_GREATER): COMPARE_JUMP(>, true); DISPATCH();
+        INSTRUCTION(OP_REG_JUMP_IF_NOT_EQUAL): EQUAL_JUMP(false); DISPATCH();
+        INSTRUCTION(OP_REG_JUMP_IF_EQUAL): EQUAL_JUMP(true); DISPATCH();
+        INSTRUCTION(OP_REG_RETURN): {
             return INTERPRET_OK;
         }
-        default:
-            printf("default case vm run");
-            break;
+        INSTRUCTION(OP_REG_ADD_MANY): {
+            uint8_t a = READ_BYTE();
+            uint8_t b = READ_BYTE();
+            uint8_t count = READ_BYTE();
+            if (!addMany(vm, &R(b), count)) return INTERPRET_RUNTIME_ERROR;
+            R(a) = pop(vm);
+            DISPATCH();
         }
+        UNKNOWN_INSTRUCTION:
+            printf("default case vm run");
+            DISPATCH();
     }
 
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
-#undef READ_STRING
+#undef R
 #undef BINARY_OP
+#undef COMPARE_JUMP
+#undef EQUAL_JUMP
+}
+
+#undef INTERPRET_LOOP
+#undef INSTRUCTION
+#undef UNKNOWN_INSTRUCTION
+#undef DISPATCH
+
+// what a run holds until it ends: the roots of its chunks, the register
+// code, the compiled loops and the chunk interpret() compiled
+static void endRun(VM* vm) {
+    vm->heap.chunk_root_count = vm->run_root_count;
+    freeRegisterChunk(vm, &vm->registers);
+#ifdef CLOX_JIT
+    freeJit(vm, &vm->jit);
+#endif // CLOX_JIT
+    freeChunk(vm, &vm->script);
+    resetStack(vm);
+    vm->is_suspended = false;
+}
+
+// Runs vm->chunk from vm->ip until the script returns, fails or yields,
+// only a yield keeps what the run holds.
+static InterpretResult continueRun(VM* vm) {
+    InterpretResult result;
+    HeapGuard guard;
+    if (setjmp(guard.jump) == 0) {
+        pushHeapGuard(vm, &guard);
+        result = vm->chunk == &vm->registers.code ? runRegisters(vm) : run(vm);
+        popHeapGuard(vm, &guard);
+    }
+    else {
+        runtimeError(vm, "Out of memory.");
+        result = INTERPRET_RUNTIME_ERROR;
+    }
+
+    vm->is_suspended = result == INTERPRET_YIELD;
+    if (!vm->is_suspended) endRun(vm);
+    return result;
 }
 
-InterpretResult interpret(const char* source) {
-    Chunk chunk;
-    initChunk(&chunk);
+// lowers the compiled chunk to register code, false when it needs more
+// registers than a frame has and the stack code has to run instead
+static bool startRegisters(VM* vm, Chunk* chunk) {
+    pushChunkRoot(vm, &vm->registers.code);
+    if (!emitRegisterChunk(vm, chunk, &vm->registers)) {
+        popChunkRoot(vm);
+        fprintf(vm->err, "Chunk does not fit the register backend, running it on the stack VM.\n");
+        return false;
+    }
+
+#ifdef DEBUG_PRINT_CODE
+    disassembleRegisterChunk(vm, &vm->registers.code, "registers");
+#endif // DEBUG_PRINT_CODE
 
-    if (!compile(source, &chunk)) {
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
+    for (int i = 0; i < vm->registers.frame_size; ++i) {
+        vm->stack[i] = NIL_VAL;
     }
+    vm->stack_top = vm->stack + vm->registers.frame_size;
+    vm->chunk = &vm->registers.code;
+    vm->ip = vm->registers.code.code;
+    return true;
+}
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+InterpretResult interpretChunk(VM* vm, Chunk* chunk) {
+    interpretAbandon(vm);
+    vm->chunk = NULL;
+    vm->run_root_count = vm->heap.chunk_root_count;
+#ifdef CLOX_JIT
+    initJit(&vm->jit, chunk);
+#endif // CLOX_JIT
 
-    InterpretResult result = run();
+    HeapGuard guard;
+    if (setjmp(guard.jump) != 0) {
+        runtimeError(vm, "Out of memory.");
+        endRun(vm);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    pushHeapGuard(vm, &guard);
+    pushChunkRoot(vm, chunk);
+    // compiled loops embed constants, none of them may move later
+    collectNursery(vm);
+    if (!vm->use_registers || !startRegisters(vm, chunk)) {
+        vm->chunk = chunk;
+        vm->ip = chunk->code;
+    }
+    popHeapGuard(vm, &guard);
+    return continueRun(vm);
+}
 
-    freeChunk(&chunk);
-    return result;
+InterpretResult interpretResume(VM* vm) {
+    if (!vm->is_suspended) {
+        fputs("No run to resume.\n", vm->err);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    return continueRun(vm);
+}
+
+void interpretAbandon(VM* vm) {
+    if (vm->is_suspended) endRun(vm);
+}
+
+InterpretResult compileSource(VM* vm, const char* source, Chunk* chunk, bool copy_strings) {
+    HeapGuard guard;
+    if (setjmp(guard.jump) != 0) {
+        fputs("Out of memory.\n", vm->err);
+        freeChunk(vm, chunk);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    pushHeapGuard(vm, &guard);
+    bool compiled = compile(vm, source, chunk, copy_strings);
+    popHeapGuard(vm, &guard);
+    return compiled ? INTERPRET_OK : INTERPRET_COMPILE_ERROR;
+}
+
+InterpretResult interpret(VM* vm, const char* source) {
+    interpretAbandon(vm);
+    InterpretResult compiled = compileSource(vm, source, &vm->script, false);
+    if (compiled != INTERPRET_OK) {
+        freeChunk(vm, &vm->script);
+        return compiled;
+    }
+    // the run frees the chunk when it ends, see endRun()
+    return interpretChunk(vm, &vm->script);
 }
\ No newline at end of file
@@ -5,32 +5,113 @@
 #include "common/chunk/chunk.h"
 #include "common/value/value.h"
 #include "common/table/table.h"
+#include "common/table/intern_set.h"
+#include "common/table/shared_strings.h"
+#include "common/memory/heap.h"
+#include "common/memory/pool.h"
+#include "compiler/register_emitter.h"
+#include "vm/jit.h"
 
 #define STACK_MAX 256
 
-typedef struct {
+struct VM {
+    // every allocation goes here, see common/memory/allocator.h
+    Allocator allocator;
+    Pool pool;
+    Heap heap;
     Chunk* chunk;
     uint8_t* ip;
     Value stack[STACK_MAX];
     Value* stack_top;
-    Table globals;
-    Table strings;
+    // globals live in dense slots that the compiler resolves by name,
+    // a slot holds UNDEFINED_VAL until its 'var' statement runs
+    Table global_slots;
+    ObjString** global_names;
+    Value* global_values;
+    int global_count;
+    int global_capacity;
+    InternSet strings;
+    // string constants are interned here first when it is set, see
+    // shareStrings()
+    SharedStrings* shared_strings;
+    // the program runProgram() ran last with its constants and globals
+    // resolved here, see vm/program.h; a root for the collector
+    uint64_t bound_program;
+    Chunk bound_chunk;
+    bool owns_bound_code;
+    // string hashes are keyed with this, see common/hash/hash.h
+    uint64_t hash_state;
     Obj* objects;
-} VM;
+    // -O level chunks are compiled with, see compiler/optimizer.h
+    int optimize_level;
+    // run chunks on the register backend, see compiler/register_emitter.h
+    bool use_registers;
+    // where print statements write, and compile and runtime errors
+    FILE* out;
+    FILE* err;
+    // Cooperative yielding, see setBudget(). Every taken back-edge counts
+    // budget_countdown down; once it runs out the loop looks at the budget
+    // and returns INTERPRET_YIELD if it is spent.
+    int64_t budget_countdown;
+    int64_t budget_armed;     // what the countdown started from
+    int64_t budget_loops;     // back-edges left
+    uint64_t budget_deadline; // CLOCK_MONOTONIC nanoseconds, 0 for none
+    // A run that yielded keeps its chunks, their roots and its compiled
+    // loops until interpretResume() finishes it.
+    bool is_suspended;
+    int run_root_count;       // chunk roots below the ones of the run
+    Chunk script;             // what interpret() compiled
+    RegisterChunk registers;  // the run's chunk lowered for use_registers
+    // loops run() compiles to native code, see vm/jit.h
+    bool jit_enabled;
+    int jit_threshold;
+#ifdef CLOX_JIT
+    Jit jit;
+#endif // CLOX_JIT
+};
 
 typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    // the budget is spent, interpretResume() continues where it stopped
+    INTERPRET_YIELD
 } InterpretResult;
 
-extern VM vm;
+// the clock is read every this many back-edges when there is a deadline
+#define BUDGET_CLOCK_INTERVAL 1024
 
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);
+// allocator may be NULL for the VM's own size-class pool
+void initVM(VM* vm, const Allocator* allocator);
+void freeVM(VM* vm);
+// the VM keeps string constants that point into source, so source has to
+// outlive it
+InterpretResult interpret(VM* vm, const char* source);
+// compile() that reports running out of memory as INTERPRET_RUNTIME_ERROR
+// and frees the chunk then
+InterpretResult compileSource(VM* vm, const char* source, Chunk* chunk, bool copy_strings);
+// runs a chunk compiled by this VM or loaded with its globals resolved,
+// a run that yields needs the chunk until it ends
+InterpretResult interpretChunk(VM* vm, Chunk* chunk);
+// Limits how far a run gets before it returns INTERPRET_YIELD: loops taken
+// back-edges and seconds of wall time from now, 0 for no limit on either.
+// Both are checked at back-edges only. The budget stays until it is set
+// again, a spent one yields at every back-edge.
+void setBudget(VM* vm, int64_t loops, double seconds);
+// continues the run that yielded last, with the stack and ip it left
+InterpretResult interpretResume(VM* vm);
+// drops a run that yielded; interpret(), interpretChunk() and runProgram()
+// drop it before they start another
+void interpretAbandon(VM* vm);
+// Interns the VM's string constants in shared, which may serve VMs on any
+// number of threads and has to outlive all of them. Equal constants are
+// then the same string in each of those VMs; runtime strings and what a
+// full table turns away stay in vm->strings. The VM takes on the table's
+// hash seed, so call it before the VM hashes its first string.
+void shareStrings(VM* vm, SharedStrings* shared);
+int globalSlot(VM* vm, ObjString* name);
 
-void push(Value value);
-Value pop();
+void push(VM* vm, Value value);
+Value pop(VM* vm);
 
 #endif // !clox_vm_h
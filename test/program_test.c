@@ -0,0 +1,80 @@
+// Runs Programs after the source they were compiled from and the program
+// a VM ran before are freed: neither the compiling VM nor a VM that ran
+// the program may keep strings pointing into them. An ASan build catches
+// what the printed output alone may not.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "vm/program.h"
+#include "vm/vm.h"
+
+static int failures = 0;
+
+// runs source on vm and compares what it prints with expected
+static void expectInterpret(VM* vm, const char* source, const char* expected) {
+    char* printed = NULL;
+    size_t size = 0;
+    vm->out = open_memstream(&printed, &size);
+    InterpretResult result = interpret(vm, source);
+    fclose(vm->out);
+    vm->out = stdout;
+
+    if (result != INTERPRET_OK || strcmp(printed, expected) != 0) {
+        fprintf(stderr, "%s\nprinted \"%s\", expected \"%s\"\n", source, printed, expected);
+        failures++;
+    }
+    free(printed);
+}
+
+static void expectRun(VM* vm, const Program* program, const char* expected) {
+    char* printed = NULL;
+    size_t size = 0;
+    vm->out = open_memstream(&printed, &size);
+    InterpretResult result = runProgram(vm, program);
+    fclose(vm->out);
+    vm->out = stdout;
+
+    if (result != INTERPRET_OK || strcmp(printed, expected) != 0) {
+        fprintf(stderr, "program %llu printed \"%s\", expected \"%s\"\n",
+            (unsigned long long)program->id, printed, expected);
+        failures++;
+    }
+    free(printed);
+}
+
+// compiles a copy of source that is wiped and freed right after
+static Program* compileCopy(VM* vm, const char* source) {
+    char* copy = strdup(source);
+    Program* program;
+    if (compileProgram(vm, copy, &program) != INTERPRET_OK) {
+        fprintf(stderr, "%s\ndoes not compile\n", source);
+        exit(1);
+    }
+    memset(copy, '#', strlen(copy));
+    free(copy);
+    return program;
+}
+
+int main() {
+    VM compiler;
+    initVM(&compiler, NULL);
+    Program* first = compileCopy(&compiler, "var greeting = \"hello\"; print greeting;");
+    Program* second = compileCopy(&compiler, "print greeting + \" again\"; var count = 2; print count;");
+    // the compiling VM interned the literals and names of both sources
+    expectInterpret(&compiler, "var greeting = \"hello\"; print greeting == \"hello\";", "true\n");
+
+    VM vm;
+    initVM(&vm, NULL);
+    expectRun(&vm, first, "hello\n");
+    freeProgram(first);
+    expectRun(&vm, second, "hello again\n2\n");
+    freeProgram(second);
+    // the strings bound of both programs stay in vm's intern set and globals
+    expectInterpret(&vm, "print greeting == \"hello\"; print greeting + \" \" + \"again\";",
+        "true\nhello again\n");
+
+    freeVM(&vm);
+    freeVM(&compiler);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Compiles a regression script to a .loxc file with the given flags, runs
+# the file and compares what it prints with the .out file of the script.
+#   usage: test/run_chunk_file_test.sh clox script.lox work-dir [flags...]
+clox=$1
+script=$2
+work=$3
+shift 3
+
+mkdir -p "$work"
+compiled="$work/$(basename "${script%.lox}").loxc"
+"$clox" "$@" --compile "$script" -o "$compiled" || exit 1
+
+expected=$(cat "${script%.lox}.out")
+actual=$("$clox" "$compiled" 2>&1; echo "exit $?")
+if [ "$actual" != "$expected" ]; then
+    printf '%s\n' "$actual" | diff "${script%.lox}.out" -
+    exit 1
+fi
@@ -0,0 +1,14 @@
+#!/bin/sh
+# Runs a regression script with the given flags and compares what it
+# prints, errors and exit status included, with the .out file next to it.
+#   usage: test/run_test.sh clox script.lox [flags...]
+clox=$1
+script=$2
+shift 2
+
+expected=$(cat "${script%.lox}.out")
+actual=$("$clox" "$@" "$script" 2>&1; echo "exit $?")
+if [ "$actual" != "$expected" ]; then
+    printf '%s\n' "$actual" | diff "${script%.lox}.out" -
+    exit 1
+fi
@@ -0,0 +1,89 @@
+// Runs a looping script under a budget of back-edges, collecting between
+// the slices and resuming until it finishes, on both backends with and
+// without compiled loops, and checks that it prints what an unlimited run
+// prints. Then checks that interpret() on a suspended VM drops the run
+// that yielded.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common/memory/memory.h"
+#include "vm/vm.h"
+
+static int failures = 0;
+
+static const char* script =
+    "var sum = 0;\n"
+    "for (var i = 0; i < 1000; i = i + 1) {\n"
+    "    var word = \"n\" + \"o\";\n"
+    "    if (i < 500) sum = sum + i; else sum = sum - 1;\n"
+    "    if (i == 250 or i == 750) print word + \" \" + \"yet\";\n"
+    "}\n"
+    "print sum;\n";
+static const char* expected = "no yet\nno yet\n124250\n";
+
+static void check(bool ok, const char* what, bool use_registers, int jit_threshold) {
+    if (ok) return;
+    fprintf(stderr, "%s, %s backend, jit threshold %d\n", what,
+        use_registers ? "register" : "stack", jit_threshold);
+    failures++;
+}
+
+static void runSliced(bool use_registers, int jit_threshold) {
+    VM vm;
+    initVM(&vm, NULL);
+    vm.use_registers = use_registers;
+    vm.jit_threshold = jit_threshold;
+    char* printed = NULL;
+    size_t size = 0;
+    vm.out = open_memstream(&printed, &size);
+
+    setBudget(&vm, 100, 0);
+    int yields = 0;
+    InterpretResult result = interpret(&vm, script);
+    while (result == INTERPRET_YIELD) {
+        yields++;
+        // what the run holds has to survive a collection between slices
+        collectGarbage(&vm);
+        result = interpretResume(&vm);
+    }
+    fclose(vm.out);
+
+    check(result == INTERPRET_OK && strcmp(printed, expected) == 0, "the run printed something else",
+        use_registers, jit_threshold);
+    check(yields >= 9, "the run did not yield at every budget", use_registers, jit_threshold);
+    check(!vm.is_suspended && vm.script.code == NULL, "the finished run kept its chunk",
+        use_registers, jit_threshold);
+    free(printed);
+    freeVM(&vm);
+}
+
+static void interpretWhileSuspended(bool use_registers) {
+    VM vm;
+    initVM(&vm, NULL);
+    vm.use_registers = use_registers;
+    vm.err = fopen("/dev/null", "w");
+    setBudget(&vm, 10, 0);
+    InterpretResult result = interpret(&vm, script);
+    check(result == INTERPRET_YIELD && vm.is_suspended, "the run did not yield", use_registers, 0);
+
+    // a compile error ends interpret() before it runs anything, the
+    // suspended run is gone all the same
+    result = interpret(&vm, "print ;");
+    check(result == INTERPRET_COMPILE_ERROR, "the broken script compiled", use_registers, 0);
+    check(!vm.is_suspended && vm.script.code == NULL && vm.heap.chunk_root_count == 0,
+        "interpret() kept the suspended run", use_registers, 0);
+    check(interpretResume(&vm) == INTERPRET_RUNTIME_ERROR, "the dropped run resumed", use_registers, 0);
+
+    fclose(vm.err);
+    freeVM(&vm);
+}
+
+int main() {
+    for (int registers = 0; registers <= 1; ++registers) {
+        runSliced(registers, JIT_HOT_LOOP_THRESHOLD);
+        runSliced(registers, 1);
+        interpretWhileSuspended(registers);
+    }
+    return failures == 0 ? 0 : 1;
+}